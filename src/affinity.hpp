@@ -0,0 +1,88 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+namespace pubsub {
+
+using CpuSet = std::vector<int>; //!< CPU番号のリスト 空の場合は固定しない
+
+/**
+ * NUMAノードに属するCPUの一覧を取得する
+ *
+ * \detail /sys/devices/system/node/node<N>/cpulist ("0-3,8-11"の形式)を読み込む。
+ * 読み込めなかった場合は空のリストを返す。
+ */
+inline CpuSet cpusOfNode(int node) {
+    CpuSet cpus;
+    std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string range;
+    while (std::getline(ifs, range, ',')) {
+        int first = 0, last = 0;
+        char dash = 0;
+        std::istringstream iss(range);
+        if (!(iss >> first)) {
+            continue;
+        }
+        last = first;
+        if (iss >> dash >> last && dash != '-') {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+/**
+ * スレッドを、指定したCPUに固定する
+ *
+ * \return 固定に成功した場合はtrue。cpusが空の場合は何もせずにfalse
+ */
+inline bool setThreadAffinity(pthread_t th, const CpuSet &cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(th, sizeof(set), &set) == 0;
+}
+
+/**
+ * 実行中のスレッドを、指定したCPUに固定する
+ *
+ * スレッドプールのスレッドから毎回呼ばれることを想定し、直前と同じCPUが指定された場合はシステムコールを省略する。
+ * 最初に固定する前のCPUの設定を保存しておき、cpusが空の場合は、その設定に戻す。
+ */
+inline void pinCurrentThread(const CpuSet &cpus) {
+    thread_local CpuSet current;
+    thread_local cpu_set_t original;
+    if (cpus == current) {
+        return;
+    }
+    if (current.empty()) {
+        CPU_ZERO(&original);
+        if (pthread_getaffinity_np(pthread_self(), sizeof(original), &original) != 0) {
+            return; //戻せなくなるので、固定しない
+        }
+    }
+    if (cpus.empty()) {
+        if (pthread_setaffinity_np(pthread_self(), sizeof(original), &original) == 0) {
+            current.clear();
+        }
+        return;
+    }
+    if (setThreadAffinity(pthread_self(), cpus)) {
+        current = cpus;
+    }
+}
+}
@@ -7,9 +7,15 @@
 #include <mutex>
 #include <functional>
 #include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
 #include <unistd.h>
 
 #include "topic_func_pair_list.hpp"
+#include "service.hpp"
+#include "spin_wait.hpp"
 
 namespace pubsub {
 
@@ -20,19 +26,56 @@ namespace pubsub {
  */
 class BrokerCore {
 public:
+    BrokerCore() {
+    }
+
+    ~BrokerCore() {
+        stop();
+    }
+
     void run() {
         th = std::thread(&BrokerCore::loop, this);
+        setThreadAffinity(th.native_handle(), dispatcher_cpus);
         usleep(100); //スレッドが確実に立ち上がるまで待つ。
     }
 
+    /**
+     * ディスパッチスレッドを固定するCPUを設定する
+     *
+     * run()の前に設定した場合は、スレッド起動時に適用する。
+     */
+    void setDispatcherAffinity(const CpuSet &cpus) {
+        std::lock_guard<std::mutex> lk(mtx);
+        dispatcher_cpus = cpus;
+        if (th.joinable()) {
+            setThreadAffinity(th.native_handle(), cpus);
+        }
+    }
+
+    /**
+     * ディスパッチスレッドのビジーポーリングを設定する
+     *
+     * 有効にすると、ディスパッチスレッドは条件変数で眠らず、出版をスピンして待つ。
+     * spin_timeの間出版がなければ、条件変数で眠る。コールバック関数の実行中は、その終了も短い間隔で確認する。
+     *
+     * \param spin_time 眠る前にスピンする時間 0だとビジーポーリングしない
+     */
+    void setBusyPoll(std::chrono::microseconds spin_time) {
+        busy_spin_time.store(spin_time.count(), std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lk(mtx);
+        notify(); //眠っている場合は、起こしてスピンさせる
+    }
+
     void stop() {
+        if (!th.joinable()) {
+            return;
+        }
         mtx.lock();
         stop_request = true;
-        cond.notify_one();
+        notify();
         mtx.unlock();
-        if (th.joinable()) {
-            th.join();
-        }
+        th.join();
+        stop_request = false; //再びrunできるようにしておく
     }
 
     /**
@@ -42,13 +85,44 @@ public:
      *
      */
     template<class ClassType, class DataTypeWithConstAndReference>
-    unsigned int subscribe(const std::string &topic, void (ClassType::*func_ptr)(DataTypeWithConstAndReference), ClassType *caller, size_t max_que_size = 0) {
+    SubscribeHandler subscribe(const std::string &topic, void (ClassType::*func_ptr)(DataTypeWithConstAndReference), ClassType *caller, size_t max_que_size = 0) {
         std::lock_guard<std::mutex> lk(mtx);
         std::function<void(DataTypeWithConstAndReference)> functional = std::bind(func_ptr, caller, std::placeholders::_1);
 
         return func_buffer.subscribe(topic, functional, max_que_size);
     }
 
+    /**
+     * takeでメッセージを取り出す購読を開始する
+     *
+     * コールバック関数の購読と同様に、ここで開始した以降に出版されたメッセージから、購読が開始される。
+     */
+    template<class DataType>
+    SubscribeHandler subscribe_pull(const std::string &topic, size_t max_que_size = 0) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return func_buffer.subscribe_pull<DataType>(topic, max_que_size);
+    }
+
+    /**
+     * subscribe_pullで開始した購読から、次のメッセージを取り出す
+     */
+    template<class DataType>
+    bool take(const std::string &topic, SubscribeHandler handler, DataType &data) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return func_buffer.take<DataType>(topic, handler, data);
+    }
+
+    /**
+     * subscribe_pullで開始した購読に、次のメッセージが届いたときに呼ばれる関数を登録する
+     */
+    template<class DataType>
+    bool await_next(const std::string &topic, SubscribeHandler handler, const std::function<void(const DataType*)> &waiter, QThreadPool *pool) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto ret = func_buffer.await_next<DataType>(topic, handler, waiter, pool);
+        notify(); //すでにメッセージが届いている場合に備えて、ディスパッチを促す
+        return ret;
+    }
+
     /**
      * 最新のメッセージを取得する
      */
@@ -58,20 +132,117 @@ public:
         return func_buffer.getLatestData<DataType>(topic, data);
     }
 
+    /**
+     * 最新のメッセージと、出版からの経過時間を取得する
+     */
+    template<class DataType>
+    bool getLatestData(const std::string &topic, DataType &data, std::chrono::nanoseconds &age) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return func_buffer.getLatestData<DataType>(topic, data, age);
+    }
+
+    /**
+     * キー付きトピックの購読を開始する
+     *
+     * ここで開始した以降に出版されたメッセージから、購読が開始される。
+     *
+     * \param conflate trueの場合、キーごとに最新のメッセージだけを受け取る
+     */
+    template<class ClassType, class Key, class DataType>
+    SubscribeHandler subscribe_keyed(const std::string &topic, void (ClassType::*func_ptr)(const Key&, const DataType&), ClassType *caller, bool conflate = false) {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::function<void(const Key&, const DataType&)> functional = [func_ptr, caller](const Key &key, const DataType &data) {(caller->*func_ptr)(key, data);};
+        return func_buffer.subscribe_keyed<Key, DataType>(topic, functional, conflate);
+    }
+
+    /**
+     * キー付きトピックのメッセージを出版する
+     */
+    template<class Key, class DataType>
+    void publish_keyed(const std::string &topic, const Key &key, const DataType &value) {
+        std::lock_guard<std::mutex> lk(mtx);
+
+        func_buffer.publish_keyed(topic, key, value);
+
+        notify();
+    }
+
+    /**
+     * キー付きトピックの、キーの最新のメッセージを取得する
+     */
+    template<class Key, class DataType>
+    bool getLatestKeyedData(const std::string &topic, const Key &key, DataType &data) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return func_buffer.getLatestKeyedData(topic, key, data);
+    }
+
+    /**
+     * キー付きトピックを参照する出版者を登録する
+     */
+    template<class Key, class DataType>
+    void retain_keyed_publisher(const std::string &topic) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.retain_keyed_publisher<Key, DataType>(topic);
+    }
+
+
+    /**
+     * 出版時刻の揃った、複数トピックのメッセージの組を受け取る購読を開始する
+     *
+     * \return 結合購読のハンドラ。トピックの型が一致しない場合は0
+     */
+    template<class ClassType, class... DataTypes>
+    unsigned int subscribe_join(const std::array<std::string, sizeof...(DataTypes)> &topics, void (ClassType::*func_ptr)(const DataTypes&...), ClassType *caller, std::chrono::nanoseconds tolerance, size_t max_que_size = 0, QThreadPool *pool = nullptr) {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::function<void(const DataTypes&...)> functional = [func_ptr, caller](const DataTypes&... values) {(caller->*func_ptr)(values...);};
+        return func_buffer.subscribe_join<DataTypes...>(topics, functional, tolerance, max_que_size, pool);
+    }
+
+    /**
+     * 結合購読を閉じる
+     */
+    void close_join(unsigned int handler) {
+        std::vector<std::string> topics;
+        std::shared_ptr<JoinBase> join;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            join = func_buffer.detach_join(handler, topics);
+        }
+        if (!join) {
+            return;
+        }
+
+        join->close(); //コールバック関数の終了を、ロックを取らずに待つ
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto &topic : topics) {
+            func_buffer.release(topic);
+        }
+    }
 
     /**
      * メッセージの購読を閉じる
+     *
+     * 実行中のコールバック関数の終了は、ロックを取らずに待つ。待っている間も、他のトピックの出版やディスパッチは止まらない。
      */
-    void close_subscribe(const std::string &topic, unsigned int handler) {
+    void close_subscribe(const std::string &topic, SubscribeHandler handler) {
+        std::shared_ptr<CallbackFuncsBase> func;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            func = func_buffer.getTopic(topic); //購読の参照があるので、閉じるまでトピックは削除されない
+        }
+        if (!func || !func->close_subscribe(handler)) {
+            return;
+        }
+
         std::lock_guard<std::mutex> lk(mtx);
-        func_buffer.close_subscribe(topic, handler);
+        func_buffer.release(topic);
     }
 
 
     /**
      * メッセージの購読を一時停止する
      */
-    void pause_subscribe(const std::string &topic, unsigned int handler) {
+    void pause_subscribe(const std::string &topic, SubscribeHandler handler) {
         std::lock_guard<std::mutex> lk(mtx);
         func_buffer.pause_subscribe(topic, handler);
     }
@@ -79,11 +250,108 @@ public:
     /**
      * メッセージの購読を再開する
      */
-    void resume_subscribe(const std::string &topic, unsigned int handler) {
+    void resume_subscribe(const std::string &topic, SubscribeHandler handler) {
         std::lock_guard<std::mutex> lk(mtx);
         func_buffer.resume_subscribe(topic, handler);
     }
 
+    /**
+     * コールバック関数の優先度を設定する
+     */
+    void set_subscribe_priority(const std::string &topic, SubscribeHandler handler, int priority) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.set_subscribe_priority(topic, handler, priority);
+    }
+
+    /**
+     * コールバック関数に送信するメッセージの間引き数を設定する
+     */
+    void set_subscribe_decimation(const std::string &topic, SubscribeHandler handler, unsigned int decimation) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.set_subscribe_decimation(topic, handler, decimation);
+    }
+
+    /**
+     * コールバック関数を呼び出す最小間隔を設定する
+     */
+    void set_subscribe_interval(const std::string &topic, SubscribeHandler handler, std::chrono::nanoseconds interval) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.set_subscribe_interval(topic, handler, interval);
+    }
+
+    /**
+     * 購読ごとのメッセージの有効期間を設定する
+     */
+    void set_subscribe_ttl(const std::string &topic, SubscribeHandler handler, std::chrono::nanoseconds ttl) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.set_subscribe_ttl(topic, handler, ttl);
+    }
+
+    /**
+     * トピックごとの、メッセージの有効期間を設定する
+     */
+    void setTimeToLive(const std::string &topic, std::chrono::nanoseconds ttl) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setTimeToLive(topic, ttl);
+    }
+
+
+    /**
+     * トピックを参照する出版者を登録する
+     */
+    template<class DataType>
+    void retain_publisher(const std::string &topic) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.retain_publisher<DataType>(topic);
+    }
+
+    /**
+     * トピックを参照して、そのハンドルを取得する。release_topicで参照を解除するまで、トピックは削除されない。
+     *
+     * \return トピックの型が一致しない場合はnullptr
+     */
+    template<class DataType>
+    std::shared_ptr<CallbackFuncs<void, DataType>> retain_topic(const std::string &topic) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return func_buffer.retain_topic<DataType>(topic);
+    }
+
+    void release_topic(const std::string &topic) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.release(topic);
+    }
+
+    /**
+     * 出版者によるトピックの参照を解除する
+     */
+    void release_publisher(const std::string &topic) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.release(topic);
+    }
+
+    /**
+     * 参照がなくなった後に、トピックの最新のメッセージを保持する時間を設定する
+     */
+    void setRetention(const std::string &topic, std::chrono::milliseconds retention) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setRetention(topic, retention);
+    }
+
+    /**
+     * トピックごとの設定を削除する
+     */
+    void clearTopicConfig(const std::string &topic) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.clearTopicConfig(topic);
+    }
+
+    /**
+     * 設定が残っているトピックの数
+     */
+    size_t topicConfigCount() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return func_buffer.topicConfigCount();
+    }
 
     /**
      * メッセージを出版する
@@ -94,7 +362,21 @@ public:
 
         func_buffer.publish(topic, value, type);
 
-        cond.notify_one();
+        notify();
+    }
+
+    /**
+     * 複数のトピックのメッセージを、一度のロックでまとめて出版する。ディスパッチスレッドを起こすのも一度だけ。
+     */
+    void publish_batch(const std::vector<std::unique_ptr<BatchMessageBase>> &messages) {
+        if (messages.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(mtx);
+
+        func_buffer.publish_batch(messages);
+
+        notify();
     }
 
     /**
@@ -105,28 +387,32 @@ public:
 
         func_buffer.publish_serialized(topic, msg, type, sender_id);
 
-        cond.notify_one();
+        notify();
     }
 
     /**
      * シリアライズされた全トピックのメッセージを購読する
      *
-     * 購読を開始した時点で、最新のメッセージが一つ受信される。
+     * 購読を開始した時点で、各トピックの最新のメッセージが一つ受信される。
+     *
+     * \param filter 受け取るトピックを選ぶ関数 nullptrだと全てのトピック 購読の一覧が変わった後、トピックごとに最初の出版時に一度だけ呼ばれる
+     * \param max_queue_size トピックごとの、未送信のメッセージの最大数 超えた場合は古いものから捨てる 0だと無限
      */
     template<class ClassType>
-    int subscribe_serialized(void(ClassType::*func_ptr)(const std::string&,const std::string&), ClassType *caller, size_t max_queue_size = 0,int except_sender = NO_EXCEPT) {
+    int subscribe_serialized(void(ClassType::*func_ptr)(const std::string&,const std::string&), ClassType *caller, size_t max_queue_size = 0,int except_sender = NO_EXCEPT, const std::function<bool(const std::string&)> &filter = nullptr) {
         std::lock_guard<std::mutex> lk(mtx);
         auto functional = std::bind(func_ptr, caller, std::placeholders::_1, std::placeholders::_2);
-        cond.notify_one();
-        return func_buffer.subscribe_serialized(functional,max_queue_size,except_sender);
+        notify();
+        return func_buffer.subscribe_serialized(functional, filter, max_queue_size, except_sender);
     }
 
 
     /**
      * subscribe_serializedで登録した購読を破棄する
+     *
+     * 全トピックの購読の一覧は自身のロックで保護されているので、ブローカーのロックを取らずに、実行中のコールバック関数の終了を待つ。
      */
     void close_subscribe_serialized(unsigned int handler) {
-        std::lock_guard<std::mutex> lk(mtx);
         func_buffer.close_subscribe_serialized(handler);
     }
 
@@ -139,50 +425,213 @@ public:
         func_buffer.setSerializer<DataType, SerializerType>(topic);
     }
 
+    /**
+     * トピックごとの、優先度と処理期限を設定する
+     */
+    void setPriority(const std::string &topic, int priority, std::chrono::microseconds deadline) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setPriority(topic, priority, deadline);
+    }
+
+    /**
+     * トピックごとの、コールバック関数を実行するスレッドプールを設定する
+     */
+    void setThreadPool(const std::string &topic, QThreadPool *pool) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setThreadPool(topic, pool);
+    }
+
+    /**
+     * トピックごとの、コールバック関数を実行するスレッドを固定するCPUを設定する
+     */
+    void setWorkerAffinity(const std::string &topic, const CpuSet &cpus) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setWorkerAffinity(topic, cpus);
+    }
+
+    /**
+     * トピックごとの、シリアライズされたメッセージの差分符号化を設定する
+     */
+    void setDeltaCodec(const std::string &topic, size_t keyframe_interval, size_t max_message_size) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setDeltaCodec(topic, keyframe_interval, max_message_size);
+    }
+
+    /**
+     * トピックごとの、ビジーポーリングを設定する
+     */
+    void setBusyPoll(const std::string &topic, bool enable) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setBusyPoll(topic, enable);
+    }
+
+    /**
+     * キー付きトピックで、キーごとに保持するメッセージの数を設定する
+     */
+    void setKeyHistoryDepth(const std::string &topic, size_t depth) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setKeyHistoryDepth(topic, depth);
+    }
+
+    /**
+     * キー付きトピックで、最後の出版からキーを破棄するまでの時間を設定する
+     */
+    void setKeyIdleTimeout(const std::string &topic, std::chrono::nanoseconds timeout) {
+        std::lock_guard<std::mutex> lk(mtx);
+        func_buffer.setKeyIdleTimeout(topic, timeout);
+    }
+
+
+    /**
+     * サービスを登録する
+     *
+     * \param pool ハンドラを実行するスレッドプール。nullptrの場合は、呼び出し元のスレッドで実行する。
+     * \return サービスを停止するためのハンドラ。同じ名前のサービスが登録済みの場合は0
+     */
+    template<class ClassType, class ReqType, class RepType>
+    unsigned int advertise_service(const std::string &name, RepType (ClassType::*func_ptr)(const ReqType&), ClassType *caller, QThreadPool *pool = nullptr) {
+        std::function<RepType(const ReqType&)> functional = std::bind(func_ptr, caller, std::placeholders::_1);
+        return services.advertise<ReqType, RepType>(name, functional, pool);
+    }
+
+    /**
+     * サービスの登録を解除する
+     */
+    void unadvertise_service(const std::string &name, unsigned int handler) {
+        services.unadvertise(name, handler);
+    }
+
+    /**
+     * サービスを呼び出す
+     *
+     * メッセージキューやディスパッチスレッドを経由せず、直接ハンドラを実行する。
+     *
+     * \param async trueの場合、ハンドラを必ず別のスレッドで実行する
+     */
+    template<class ReqType, class RepType>
+    std::future<RepType> call(const std::string &name, const ReqType &req, bool async = false) {
+        return services.call<ReqType, RepType>(name, req, async);
+    }
 
 private:
+    BrokerCore(const BrokerCore&) = delete;
+    BrokerCore& operator=(const BrokerCore&) = delete;
 
     void loop() {
 
+        const auto processing_spin = std::chrono::microseconds(10); //ビジーポーリング中に、コールバック関数の終了を確認する間隔
         auto processing = false;
+        unsigned long seen = 0;
+        auto notified = [&] {return stop_request || notify_seq.load(std::memory_order_relaxed) != seen;}; //ロックを解放中の通知も見逃さない
         while (1) {
-            std::unique_lock<std::mutex> lk(mtx);
-            if (processing) { //処理中であれば、少し待って、様子を見に行く。
-                cond.wait_for(lk, std::chrono::milliseconds(1));
-            } else {
-                cond.wait(lk);
+            auto spin_time = std::chrono::microseconds(busy_spin_time.load(std::memory_order_relaxed));
+            bool busy = (spin_time.count() != 0);
+            if (busy) { //ロックを取らずにスピンする。処理中であれば、コールバック関数の終了を確認するため、短い間だけ待つ。
+                spinWait(seen, processing ? std::min(spin_time, processing_spin) : spin_time);
             }
 
-            if (stop_request) {
-                break;
+            std::shared_ptr<const TopicFuncPairList::DispatchSnapshot> snapshot;
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                if (busy) {
+                    if (!processing) { //スピンしても出版がなければ、眠る
+                        cond.wait(lk, notified);
+                    }
+                } else if (processing) { //処理中であれば、少し待って、様子を見に行く。
+                    cond.wait_for(lk, std::chrono::milliseconds(1), notified);
+                } else {
+                    cond.wait(lk, notified);
+                }
+                seen = notify_seq.load(std::memory_order_relaxed);
+
+                if (stop_request) {
+                    break;
+                }
+                snapshot = func_buffer.getDispatchSnapshot();
             }
 
-            processing = func_buffer.callOnce(); //次のpublish,subscribe要求をロックしないように、すぐ抜ける。
+            //ロックを解放してから処理するので、処理中も出版や購読の要求は待たされない。
+            processing = TopicFuncPairList::callOnce(*snapshot);
+            snapshot.reset(); //一覧から外されたトピックは、ここで解放される場合がある。ロックの外で解放する。
         }
     }
 
 private:
+    /**
+     * ディスパッチスレッドを起こす。ロックを取得した状態で呼ぶ。
+     */
+    void notify() {
+        notify_seq.fetch_add(1, std::memory_order_release);
+        cond.notify_one();
+    }
 
+    /**
+     * notify_seqがseenから変わるか、spin_timeが過ぎるまでスピンする
+     */
+    void spinWait(unsigned long seen, std::chrono::microseconds spin_time) {
+        SpinBackoff backoff;
+        auto until = std::chrono::steady_clock::now() + spin_time;
+        while (notify_seq.load(std::memory_order_acquire) == seen) {
+            if (backoff.spins() % 64 == 0 && std::chrono::steady_clock::now() >= until) { //時刻の取得は、64回に1回にする
+                return;
+            }
+            backoff.pause();
+        }
+    }
+
+private:
     std::thread th;
     std::mutex mtx;
     std::condition_variable cond;
+    std::atomic<unsigned long> notify_seq { 0 }; //!< notifyのたびに進める。mtxを取得して書き込む
+    std::atomic<std::chrono::microseconds::rep> busy_spin_time { 0 }; //!< ビジーポーリングでスピンする時間[us] 0だとビジーポーリングしない
 
     TopicFuncPairList func_buffer; //!< 各トピックと、関数のリスト
+    ServiceList services; //!< サービスのリスト サービスは独自にロックを持つので、mtxでは保護しない
 
     bool stop_request = false;
+    CpuSet dispatcher_cpus; //!< ディスパッチスレッドを固定するCPU 空だと固定しない
 };
 
 #include "singleton.hpp"
+
+/**
+ * デフォルトのブローカー
+ *
+ * 独立したブローカーが必要な場合は、BrokerCoreを生成してrun()し、各APIの引数brokerに渡す。
+ * ブローカーごとにディスパッチスレッド、ロック、トピックの一覧が分かれるので、互いの処理に干渉しない。
+ */
 class Broker{
 public:
     static void run(){
         Singleton<BrokerCore>::getInstance().run();
     }
 
+    /**
+     * ディスパッチスレッドを固定するCPUを設定する。cpusOfNodeで、NUMAノード単位で指定できる。
+     */
+    static void setDispatcherAffinity(const CpuSet &cpus){
+        Singleton<BrokerCore>::getInstance().setDispatcherAffinity(cpus);
+    }
+
+    /**
+     * ディスパッチスレッドのビジーポーリングを設定する。0だとビジーポーリングしない
+     */
+    static void setBusyPoll(std::chrono::microseconds spin_time){
+        Singleton<BrokerCore>::getInstance().setBusyPoll(spin_time);
+    }
+
     static BrokerCore& getInstance(){
         return Singleton<BrokerCore>::getInstance();
     }
 
+    /**
+     * brokerがnullptrの場合は、デフォルトのブローカーを返す
+     */
+    static BrokerCore& getInstance(BrokerCore *broker){
+        return broker ? *broker : Singleton<BrokerCore>::getInstance();
+    }
+
     static void stop(){
         Singleton<BrokerCore>::getInstance().stop();
         Singleton<BrokerCore>::destroy();
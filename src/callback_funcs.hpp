@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
 #include <deque>
 #include <string>
 #include <mutex>
@@ -11,46 +12,91 @@
 #include <QtConcurrent/QtConcurrent>
 #include <unistd.h>
 #include <type_traits>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <atomic>
+#include <memory>
 
 #include "serializer_holder.hpp"
+#include "delta_codec.hpp"
+#include "spin_wait.hpp"
+#include "priority_task.hpp"
 #include "callback_funcs_base.hpp"
+#include "tap_list.hpp"
+#include "trace.hpp"
 
 namespace pubsub {
 
 
 template<class ReturnType, class DataType>
-class CallbackFuncs: public CallbackFuncsBase {
+class CallbackFuncs: public CallbackFuncsBase, public std::enable_shared_from_this<CallbackFuncs<ReturnType, DataType>> {
     struct MsgType{
         DataType data; //!< データ本体
         int sender_id; //!< メッセージの送信者
         SendType type;
+        std::chrono::steady_clock::time_point stamp; //!< 出版時刻
+        unsigned long seq; //!< トピック内の通し番号
     };
 
     struct FuncInfo {
         std::function<ReturnType(MsgType &msg)> func;  //!< コールバック関数
-        QFuture<ReturnType> future; //!< コールバック実行結果取得
+        QFuture<void> future;       //!< コールバック実行結果取得
         unsigned long msg_idx = 0;  //!< 次に送信するメッセージのインデックス番号
         size_t max_sque_size = 0;   //!< コールバックメッセージキューの最大サイズ 0だと無限サイズ
-        unsigned int handler = 0;   //!< コールバック関数を特定するためのID
-        bool active = true;         //!< コールバックが有効かどうか
+        int priority = 0;           //!< 優先度 値が大きいほど先に実行される
+        bool pull = false;          //!< コールバックではなく、takeでメッセージを取り出すかどうか
+        std::function<void(const DataType*)> waiter; //!< pullの場合に、次のメッセージを待っている関数
+        QThreadPool *waiter_pool = nullptr; //!< waiterを実行するスレッドプール
+        unsigned int decimation = 1; //!< N個に1個のメッセージだけ送信する
+        std::chrono::nanoseconds min_interval { 0 }; //!< コールバック関数を呼び出す最小間隔
+        unsigned long decimation_count = 0; //!< 間引きのために数えたメッセージの数
+        unsigned long counted_seq = 0; //!< 最後に数えたメッセージの通し番号
+        bool selected = false; //!< 最後に数えたメッセージが、間引かれずに残ったかどうか
+        std::chrono::steady_clock::time_point last_call; //!< 最後にコールバック関数を呼び出した時刻
+        std::chrono::nanoseconds ttl { 0 }; //!< メッセージの有効期間 0だとトピックの設定に従う
+        int notify_fd = -1;         //!< pullの場合に、未読のメッセージがある間だけ読み込み可能にするeventfd -1は無効
+        bool signaled = false;      //!< notify_fdに書き込み済みかどうか
     };
 
+    /**
+     * コールバック関数を格納するスロット
+     *
+     * 閉じられたスロットは再利用される。再利用のたびに世代番号を進めるので、古いハンドラでは見つからない。
+     */
+    struct Slot {
+        FuncInfo info;
+        uint32_t generation = 1;   //!< 世代番号
+        bool used = false;         //!< 使用中かどうか
+        size_t active_pos = NOT_ACTIVE; //!< active_funcs内の位置 NOT_ACTIVEは一時停止中
+    };
+
+    static constexpr size_t NOT_ACTIVE = std::numeric_limits<size_t>::max();
+
 public:
     CallbackFuncs(size_t max_que_size = 0) :
             max_rque_size(max_que_size) {
     }
 
     ~CallbackFuncs(){
-        std::lock_guard<std::mutex> lk(mtx);
-        for (auto &func : funcs) {
-            if (func.future.isRunning()) {
-                func.future.waitForFinished();
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            spin_stop = true;
+        }
+        if (spin_thread.joinable()) {
+            if (spin_thread.get_id() == std::this_thread::get_id()) {
+                spin_thread.detach(); //ビジーポーリングのスレッドで最後の参照が外れた。スレッドは、この後すぐに終了する
+            } else {
+                spin_thread.join();
             }
         }
 
-        if(serializer){
-            delete serializer;
-            serializer = nullptr;
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto &slot : slots) {
+            if (slot.used && slot.info.future.isRunning()) {
+                slot.info.future.waitForFinished();
+            }
         }
     }
 
@@ -59,51 +105,323 @@ public:
      * コールバック関数を登録する
      */
     template<class DataTypeWithRef>
-    unsigned int subscribe(const std::function<ReturnType(DataTypeWithRef)> &in_func, size_t max_que_size = 0) {
+    SubscribeHandler subscribe(const std::function<ReturnType(DataTypeWithRef)> &in_func, size_t max_que_size = 0) {
         std::lock_guard<std::mutex> lk(mtx);
         auto lambda = [=](MsgType &msg){in_func(msg.data);};
-        FuncInfo info { lambda, QFuture<ReturnType>(), msg_que.size(), max_que_size, ++cur_handler_id  };
-        funcs.push_back(info);
+        FuncInfo info { lambda, QFuture<void>(), msg_que.size(), max_que_size };
+
+        return insert_func(info);
+    }
+
+    /**
+     * コールバック関数を使わず、takeでメッセージを取り出す購読を登録する
+     *
+     * メッセージの読み込み位置やキューサイズの扱いは、コールバック関数と同じ。
+     */
+    SubscribeHandler subscribe_pull(size_t max_que_size = 0) {
+        std::lock_guard<std::mutex> lk(mtx);
+        FuncInfo info { nullptr, QFuture<void>(), msg_que.size(), max_que_size };
+        info.pull = true;
 
-        return info.handler;
+        return insert_func(info);
     }
 
-    void close_subscribe(unsigned int handler) override{
+    /**
+     * pullの購読から、次のメッセージを一つ取り出す
+     *
+     * \return メッセージがなかった場合はfalse
+     */
+    bool take(SubscribeHandler handler, DataType &data) {
         std::lock_guard<std::mutex> lk(mtx);
-        auto itr = std::find_if(funcs.begin(),funcs.end(),[&](FuncInfo& info){return info.handler == handler;});
-        if(itr == funcs.end()){
-            return;
+        auto *slot = find_slot(handler);
+        if (!slot || slot->active_pos == NOT_ACTIVE) {
+            return false;
         }
-        if (itr->future.isRunning()) {
-            itr->future.waitForFinished();
+        skipExpired(slot->info, std::chrono::steady_clock::now());
+        bool found = (slot->info.msg_idx < msg_que.size());
+        if (found) {
+            data = msg_que[slot->info.msg_idx].data;
+            advance(slot->info);
         }
-        funcs.erase(itr);
+        updateNotifyFd(slot->info);
+        return found;
+    }
+
+    /**
+     * pullの購読から、最大max_size個のメッセージをまとめて取り出す
+     *
+     * 一度のロックで取り出すので、takeを繰り返すよりも出版と競合しにくい。
+     *
+     * \return 取り出したメッセージの数
+     */
+    size_t drain(SubscribeHandler handler, std::vector<DataType> &values, size_t max_size) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (!slot || slot->active_pos == NOT_ACTIVE) {
+            return 0;
+        }
+        skipExpired(slot->info, std::chrono::steady_clock::now());
+        size_t count = 0;
+        while (count < max_size && slot->info.msg_idx < msg_que.size()) {
+            values.push_back(msg_que[slot->info.msg_idx].data);
+            advance(slot->info);
+            count++;
+        }
+        updateNotifyFd(slot->info);
+        return count;
+    }
+
+    /**
+     * pullの購読に、未読のメッセージがある間だけ読み込み可能にするeventfdを設定する
+     *
+     * fdはEFD_NONBLOCKで生成し、購読を閉じるまで呼び出し側が保持する。-1で解除する。
+     *
+     * \return 購読が見つからなかった場合はfalse
+     */
+    bool set_notify_fd(SubscribeHandler handler, int fd) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (!slot || !slot->info.pull) {
+            return false;
+        }
+        notify_fd_count += (fd >= 0 ? 1 : 0) - (slot->info.notify_fd >= 0 ? 1 : 0);
+        slot->info.notify_fd = fd;
+        slot->info.signaled = false;
+        updateNotifyFd(slot->info);
+        return true;
+    }
+
+    /**
+     * pullの購読の、次のメッセージの出版時刻を取得する。メッセージはコピーしない。
+     *
+     * \return メッセージがなかった場合はfalse
+     */
+    bool peek_stamp(SubscribeHandler handler, std::chrono::steady_clock::time_point &stamp) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (!slot || slot->active_pos == NOT_ACTIVE) {
+            return false;
+        }
+        skipExpired(slot->info, std::chrono::steady_clock::now());
+        updateNotifyFd(slot->info);
+        if (slot->info.msg_idx >= msg_que.size()) {
+            return false;
+        }
+        stamp = msg_que[slot->info.msg_idx].stamp;
+        return true;
+    }
+
+    /**
+     * pullの購読の、次のメッセージをコピーせずに読み飛ばす
+     */
+    void skip(SubscribeHandler handler) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (slot && slot->active_pos != NOT_ACTIVE && slot->info.msg_idx < msg_que.size()) {
+            advance(slot->info);
+            updateNotifyFd(slot->info);
+        }
+    }
+
+    /**
+     * pullの購読で、次のメッセージが届いたときに一度だけ呼ばれる関数を登録する
+     *
+     * 関数はpoolで実行される。購読が閉じられた場合は、nullptrを引数に呼ばれる。
+     *
+     * \return 購読が見つからなかった場合はfalse
+     */
+    bool await_next(SubscribeHandler handler, const std::function<void(const DataType*)> &waiter, QThreadPool *pool) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (!slot || !slot->info.pull) {
+            return false;
+        }
+        slot->info.waiter = waiter;
+        slot->info.waiter_pool = (pool ? pool : this->pool);
+        notifySpinner();
+        return true;
+    }
+
+    /**
+     * 購読を閉じる
+     *
+     * 購読を外してからロックを解放し、実行中のコールバック関数の終了を待つ。待っている間も、出版とディスパッチは止まらない。
+     * 購読を外した後は新たに呼び出されないので、戻った時点でコールバック関数は実行されていない。
+     */
+    bool close_subscribe(SubscribeHandler handler) override{
+        std::function<void(const DataType*)> waiter;
+        QThreadPool *waiter_pool = nullptr;
+        QFuture<void> future;
+        bool from_spinner = false;
+        bool from_waiter = false;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            from_spinner = (std::this_thread::get_id() == spin_thread_id);
+            from_waiter = (resumingWaiter().owner == this && resumingWaiter().handler == handler);
+            auto *slot = find_slot(handler);
+            if(!slot){
+                return false;
+            }
+            future = slot->info.future;
+            waiter = std::move(slot->info.waiter);
+            waiter_pool = slot->info.waiter_pool;
+            remove_func(handler);
+        }
+
+        if (!from_waiter && future.isRunning()) {
+            future.waitForFinished(); //再開したコルーチンの中から閉じた場合は、自分自身の終了を待たない
+        }
+
+        if (!from_spinner) {
+            //ビジーポーリングのスレッドが実行中のコールバック関数が、終わるのを待つ
+            std::lock_guard<std::mutex> inline_lk(inline_mtx);
+        }
+
+        if (waiter) {
+            //待っている側が購読を終了できるよう、nullptrで呼び出す
+            QtConcurrent::run(waiter_pool, waiter, nullptr);
+        }
+        return true;
     }
 
     /**
      * 指定された関数のコールバックを停止する
      */
-    void pause_subscribe(unsigned int  handler)override{
+    void pause_subscribe(SubscribeHandler handler)override{
         std::lock_guard<std::mutex> lk(mtx);
-        auto itr = std::find_if(funcs.begin(),funcs.end(),[&](FuncInfo& info){return info.handler == handler;});
-        if(itr == funcs.end()){
+        auto *slot = find_slot(handler);
+        if(!slot || slot->active_pos == NOT_ACTIVE){
             return;
         }
 
-        itr->active = false;
+        deactivate(handler_index(handler));
     }
 
     /**
      * 指定された関数のコールバックを再開する
      */
-    void resume_subscribe(unsigned int  handler)override{
+    void resume_subscribe(SubscribeHandler handler)override{
         std::lock_guard<std::mutex> lk(mtx);
-        auto itr = std::find_if(funcs.begin(),funcs.end(),[&](FuncInfo& info){return info.handler == handler;});
-        if(itr == funcs.end()){
+        auto *slot = find_slot(handler);
+        if(!slot || slot->active_pos != NOT_ACTIVE){
             return;
         }
 
-        itr->active = true;
+        slot->info.msg_idx = msg_que.size(); //一時停止中に出版されたメッセージは送信しない
+        updateNotifyFd(slot->info);
+        activate(handler_index(handler));
+        notifySpinner();
+    }
+
+    void set_subscribe_priority(SubscribeHandler handler, int priority) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if(!slot){
+            return;
+        }
+
+        slot->info.priority = priority;
+        //これ以降は、callOnceで優先度の高い関数から実行されるよう、順序を保って並べる。
+        priority_ordered = true;
+        std::stable_sort(active_funcs.begin(), active_funcs.end(), [&](uint32_t a, uint32_t b) {return slots[a].info.priority > slots[b].info.priority;});
+        update_active_pos(0);
+    }
+
+    void set_subscribe_decimation(SubscribeHandler handler, unsigned int decimation) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if(!slot){
+            return;
+        }
+        slot->info.decimation = std::max(1u, decimation);
+        slot->info.decimation_count = 0;
+    }
+
+    void set_subscribe_interval(SubscribeHandler handler, std::chrono::nanoseconds interval) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if(!slot){
+            return;
+        }
+        slot->info.min_interval = interval;
+    }
+
+    void set_subscribe_ttl(SubscribeHandler handler, std::chrono::nanoseconds ttl) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if(!slot){
+            return;
+        }
+        slot->info.ttl = ttl;
+    }
+
+    void setTimeToLive(std::chrono::nanoseconds ttl) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        topic_ttl = ttl;
+    }
+
+    void setPriority(int priority, std::chrono::microseconds deadline) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        topic_priority = priority;
+        this->deadline = deadline;
+    }
+
+    int getPriority() override {
+        std::lock_guard<std::mutex> lk(mtx);
+        return topic_priority;
+    }
+
+    std::chrono::steady_clock::time_point getNextDeadline() override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto next = std::chrono::steady_clock::time_point::max();
+        if (deadline.count() == 0) {
+            return next;
+        }
+        for (auto idx : active_funcs) {
+            auto &func = slots[idx].info;
+            if (func.msg_idx < msg_que.size()) {
+                next = std::min(next, msg_que[func.msg_idx].stamp + deadline);
+            }
+        }
+        return next;
+    }
+
+    void setThreadPool(QThreadPool *pool) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        this->pool = (pool ? pool : QThreadPool::globalInstance());
+    }
+
+    void setWorkerAffinity(const CpuSet &cpus) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        worker_cpus = cpus;
+    }
+
+    /**
+     * ビジーポーリングを設定する
+     *
+     * 有効にすると、専用のスレッドがメッセージの追加をスピンして待ち、届いたメッセージのコールバック関数をそのスレッドで実行する。
+     * ディスパッチスレッドとスレッドプールを経由しないため、起床と受け渡しの遅延がなくなる。
+     * 無効にした場合、スレッドは実行中のコールバック関数を終えてから停止する。
+     */
+    void setBusyPoll(bool enable) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        spin_stop = !enable;
+        if (!enable || busy_poll) {
+            return; //停止は、スレッドが自身で行う
+        }
+        if (spin_thread.joinable()) {
+            spin_thread.join(); //停止済みのスレッド
+        }
+        busy_poll = true;
+        std::weak_ptr<CallbackFuncs> owner = this->weak_from_this();
+        spin_thread = std::thread([this, owner]() {spinLoop(owner);});
+        spin_thread_id = spin_thread.get_id();
+    }
+
+    void setDeltaCodec(size_t keyframe_interval, size_t max_message_size) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        codec_keyframe_interval.store(keyframe_interval, std::memory_order_relaxed);
+        codec_max_message_size = max_message_size;
     }
 
     bool getLatestData(DataType& data){
@@ -115,39 +433,74 @@ public:
         return false;
     }
 
+    /**
+     * メッセージキューを保護するロック
+     *
+     * 複数のトピックをまとめて読み書きする場合に、全てのトピックのロックを取得するために使う。
+     * 複数のロックを取得する場合は、デッドロックを避けるためアドレスの小さい順に取得する。
+     */
+    std::mutex& queueMutex() {
+        return mtx;
+    }
+
+    /**
+     * 最新のメッセージを取得する。queueMutexのロックを取得した状態で呼ぶ。
+     */
+    bool getLatestDataLocked(DataType& data){
+        if (msg_que.size() != 0) {
+            data = msg_que.back().data;
+            return true;
+        }
+        return false;
+    }
 
-    void subscribe_serialized(std::function<void(const std::string&)> func, int except_sender, unsigned int handler, size_t max_queue_size) override {
+    /**
+     * 最新のメッセージと、出版からの経過時間を取得する
+     */
+    bool getLatestData(DataType& data, std::chrono::nanoseconds &age){
         std::lock_guard<std::mutex> lk(mtx);
-        auto lambda = [=](MsgType &msg) {
-            if (!serializer || msg.type == LOCAL || (except_sender != NO_EXCEPT && msg.sender_id == except_sender)) {
-                return;
-            }
-            std::string data = serializer->serialize(msg.data);
-            func(data);
-        };
-
-        size_t msg_idx = msg_que.size();
-        if(msg_idx != 0){
-            msg_idx--;//すでにデータが入っている場合、最新の値を一つpublishする。
+        if (msg_que.size() != 0) {
+            data = msg_que.back().data;
+            age = std::chrono::steady_clock::now() - msg_que.back().stamp;
+            return true;
         }
-        FuncInfo info { lambda, QFuture<ReturnType>(), msg_idx, max_queue_size, handler_max + handler };
-        funcs.push_back(info);
+        return false;
+    }
+
 
-        return;
+    void setTapList(TapList *taps) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        this->taps = taps;
     }
 
-    void close_subscribe_serialized(unsigned int handler) override {
-        close_subscribe(handler + handler_max);
+    bool getLatestTapMessage(TapMessage &tap_msg) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (!serializer || msg_que.empty() || msg_que.back().type == LOCAL) {
+            return false;
+        }
+        auto &msg = msg_que.back();
+        tap_msg = TapMessage { tapTopic(), std::make_shared<TypedTapPayload<DataType>>(msg.data, serializer), msg.sender_id, codec_keyframe_interval.load(std::memory_order_relaxed), 0, 0 };
+        return true;
     }
 
+    /**
+     * トピック名を設定する。トレースの記録に利用する。
+     */
+    void setTopic(const std::string &topic) {
+        std::lock_guard<std::mutex> lk(mtx);
+        this->topic = topic;
+        trace_topic_id = 0;
+        tap_topic = nullptr;
+    }
 
+    /**
+     * シリアライザを設定する。出版中に差し替えても、使用中のシリアライザは使い終わるまで破棄されない。
+     */
     template<class SerializerType>
     void setSerializer() {
-        if (this->serializer) {
-            delete this->serializer;
-            this->serializer = nullptr;
-        }
-        this->serializer = new SerializerHolder<SerializerType, DataType>();
+        auto holder = std::make_shared<SerializerHolder<SerializerType, DataType>>();
+        std::lock_guard<std::mutex> lk(mtx);
+        serializer = holder;
     }
 
 
@@ -155,20 +508,49 @@ public:
      * コールバックメッセージを保存する
      */
     void publish(const DataType &data, SendType type, int sender_id) {
+        int64_t publish_time = (Tracer::enabled() ? Tracer::now() : 0); //ロック待ちの時間も記録するため、ロック前に時刻を取得する
         std::lock_guard<std::mutex> lk(mtx);
+        publishLocked(data, type, sender_id, std::chrono::steady_clock::now(), publish_time);
+    }
 
+    /**
+     * コールバックメッセージを保存する。queueMutexのロックを取得した状態で呼ぶ。
+     *
+     * \param stamp 出版時刻 複数のトピックにまとめて出版する場合は、同じ時刻を渡す
+     * \param publish_time トレースに記録する出版時刻 0の場合は現在時刻
+     */
+    void publishLocked(const DataType &data, SendType type, int sender_id, std::chrono::steady_clock::time_point stamp, int64_t publish_time = 0) {
+        bool tracing = Tracer::enabled();
         MsgType msg;
         msg.data = data;
         msg.sender_id = sender_id;
         msg.type = type;
+        msg.stamp = stamp;
+        msg.seq = ++pub_seq;
+        if (type == GLOBAL && serializer && taps && taps->enabled()) {
+            //受け取る全トピックの購読がある場合だけコピーし、シリアライズは送信時に一度だけ行う
+            taps->push(tapTopic(), sender_id, codec_keyframe_interval.load(std::memory_order_relaxed), [&]() {
+                return std::make_shared<TypedTapPayload<DataType>>(msg.data, serializer);
+            });
+        }
         msg_que.push_back(msg);
 
+        if (tracing) {
+            if (publish_time == 0) {
+                publish_time = Tracer::now();
+            }
+            Tracer::record(Tracer::PUBLISH, traceTopicId(), msg.seq, publish_time);
+            Tracer::record(Tracer::ENQUEUE, traceTopicId(), msg.seq);
+        }
+        notifySpinner();
+
         for (size_t idx = 0; idx < oldest_idx_supposed_to_be_pub; ++idx) {
             msg_que.pop_front(); //不要になったメッセージを削除する。この前にメッセージを追加するので、最低一つはメッセージが残る
         }
         assert(msg_que.size() >= 1);
 
-        for (auto &func : funcs) {
+        for (auto idx : active_funcs) {
+            auto &func = slots[idx].info;
             size_t msg_size_max = (func.max_sque_size == 0 ? msg_que.size() : func.max_sque_size);
             func.msg_idx = get_new_sndmsg_idx(func.msg_idx,oldest_idx_supposed_to_be_pub,msg_que.size(),msg_size_max);
         }
@@ -181,86 +563,116 @@ public:
 
 
             //バッファがずれたので、関数のメッセージ読み込み開始場所もずらしておく。
-            for (auto &func : funcs) {
-                if(!func.active){
-                    func.msg_idx = msg_que.size();//不要だが、一応
-                }else{
-                    size_t msg_size_max = (func.max_sque_size == 0 ? msg_que.size() : func.max_sque_size);
-                    func.msg_idx = get_new_sndmsg_idx(func.msg_idx,1,msg_que.size(),msg_size_max);
-                }
+            //一時停止中の関数は、再開時に読み込み位置を設定し直す。
+            for (auto idx : active_funcs) {
+                auto &func = slots[idx].info;
+                size_t msg_size_max = (func.max_sque_size == 0 ? msg_que.size() : func.max_sque_size);
+                func.msg_idx = get_new_sndmsg_idx(func.msg_idx,1,msg_que.size(),msg_size_max);
             }
         } else {
             //受信キューのサイズが増えた場合
 
-            for (auto &func : funcs) {
-                if (!func.active) {
-                    func.msg_idx = msg_que.size();
-                } else {
-                    //送信キューサイズよりも多くのデータが溜まった場合、最古のデータを破棄してインデックスを進める。
-                    size_t msg_size_max = (func.max_sque_size == 0 ? msg_que.size() : func.max_sque_size);
-                    if (func.msg_idx + msg_size_max < msg_que.size()) {
-                        func.msg_idx = msg_que.size() - func.max_sque_size;
-                    }
+            for (auto idx : active_funcs) {
+                auto &func = slots[idx].info;
+                //送信キューサイズよりも多くのデータが溜まった場合、最古のデータを破棄してインデックスを進める。
+                size_t msg_size_max = (func.max_sque_size == 0 ? msg_que.size() : func.max_sque_size);
+                if (func.msg_idx + msg_size_max < msg_que.size()) {
+                    func.msg_idx = msg_que.size() - func.max_sque_size;
                 }
             }
         }
+
+        if (notify_fd_count > 0) {
+            for (auto idx : active_funcs) {
+                updateNotifyFd(slots[idx].info);
+            }
+        }
     }
 
 
     void publish_serialized(const std::string &msg, SendType type, int sender_id) {
-        if (serializer) {
-            auto data = serializer->deserialize(msg);
-            publish(data, type, sender_id);
+        std::shared_ptr<SerializerHolderBase<DataType>> holder;
+        std::string decoded;
+        bool delta = (codec_keyframe_interval.load(std::memory_order_relaxed) != 0);
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            holder = serializer;
+            if (!holder) {
+                return;
+            }
+            if (delta && !decoders[sender_id].decode(msg, decoded, codec_max_message_size)) {
+                return; //キーフレームを受け取るまでは、差分を復元できないので捨てる。長すぎるメッセージも捨てる
+            }
         }
+        publish(holder->deserialize(delta ? decoded : msg), type, sender_id);
     }
 
 
     /**
      * 各関数に対して、コールバックメッセージがある場合は、一度だけコールバック関数を呼び出す。
      *
-     * \detail コールバック関数は、Qtのスレッドプールで実行する。
+     * \detail コールバック関数は、Qtのスレッドプールで実行する。優先度の高い関数から順にスレッドプールに投入する。
+     * スレッドプールの待ち行列では、トピックの優先度の高いものが先に実行される。
      *
      * \return コールバック関数実行中かどうか
      */
     bool callOnce() {
         std::lock_guard<std::mutex> lk(mtx);
         bool processing = false;
+        if (busy_poll) {
+            return false; //ビジーポーリングのスレッドが実行する
+        }
 
-        //最古のメッセージを破棄可能かどうか。
-        //一度のcallOnceで関数は最大一回呼ばれるので、最大一つのメッセージが破棄される可能性がある。
-        bool oldest_msg_discardable = false;
-
-        if (funcs.size() == 0) {
+        if (active_funcs.size() == 0) {
             oldest_idx_supposed_to_be_pub = msg_que.size();
         } else {
-            for (auto &func : funcs) {
-                if (!func.active) {
-                    continue;
-                }
-
+            auto now = std::chrono::steady_clock::now();
+            for (auto idx : active_funcs) {
+                auto &func = slots[idx].info;
                 if (!func.future.isFinished()) {
                     processing = true;
                     continue;
                 }
 
-                if (func.msg_idx < msg_que.size()) {
-                    func.future = QtConcurrent::run(QThreadPool::globalInstance(), func.func, msg_que[func.msg_idx]);        //msgは、この時点でコピーされる。
-                    func.msg_idx++;
-
-                    if (!oldest_msg_discardable && (func.msg_idx - 1) == oldest_idx_supposed_to_be_pub) {
-                        //本関数が最古のメッセージを利用した場合、最古のメッセージを削除していいかを調べる
-                        oldest_msg_discardable = true;
-                        for (auto &func_other : funcs) {
-                            oldest_msg_discardable = oldest_msg_discardable && (func_other.msg_idx != oldest_idx_supposed_to_be_pub);
-                            if (!oldest_msg_discardable) {
-                                break;
-                            }
-                        }
+                skipExpired(func, now);
+                updateNotifyFd(func); //有効期間切れで未読がなくなった場合は、読み込み可能でなくする
 
-                        if (oldest_msg_discardable) {
-                            oldest_idx_supposed_to_be_pub = func.msg_idx;
+                if (func.decimation > 1 || func.min_interval.count() != 0) {
+                    bool waiting = false;
+                    if (!throttle(func, waiting)) {
+                        updateNotifyFd(func);
+                        processing |= waiting; //最小間隔が過ぎたら送信できるよう、様子を見に来てもらう
+                        continue;
+                    }
+                }
+
+                if (func.msg_idx < msg_que.size()) {
+                    if (func.pull) {
+                        if (!func.waiter) {
+                            continue; //takeで取り出されるのを待つ
                         }
+                        auto waiter = std::move(func.waiter);
+                        func.waiter = nullptr;
+                        SubscribeHandler handler = (static_cast<SubscribeHandler>(slots[idx].generation) << 32) | idx;
+                        func.future = QtConcurrent::run(func.waiter_pool, [this, handler, waiter](const DataType &data) {
+                            auto &resuming = resumingWaiter();
+                            auto prev = resuming;
+                            resuming = { this, handler };
+                            waiter(&data);
+                            resuming = prev;
+                        }, msg_que[func.msg_idx].data);
+                    } else {
+                        //トピックの優先度で、スレッドプールの待ち行列に並べる。msgは、この時点でコピーされる。
+                        bool wrap = (!worker_cpus.empty() || Tracer::enabled() || pool != QThreadPool::globalInstance());
+                        auto function = (wrap ? wrapCallback(func.func) : func.func);
+                        func.future = runWithPriority(pool, topic_priority, [function, msg = msg_que[func.msg_idx]]() mutable {function(msg);});
+                    }
+                    if (Tracer::enabled()) {
+                        Tracer::record(Tracer::DISPATCH, traceTopicId(), msg_que[func.msg_idx].seq);
                     }
+                    func.last_call = std::chrono::steady_clock::now();
+                    advance(func);
+                    updateNotifyFd(func);
                     processing = true;
                 }
             }
@@ -269,6 +681,375 @@ public:
     }
 
 private:
+    /**
+     * 未読のメッセージの有無に合わせて、notify_fdを読み込み可能にする、または読み込み可能でなくする。ロックを取得した状態で呼ぶ。
+     *
+     * \detail 状態が変わるときだけ書き込みと読み込みを行うので、メッセージごとのシステムコールは発生しない。
+     */
+    void updateNotifyFd(FuncInfo &func) {
+        if (func.notify_fd < 0) {
+            return;
+        }
+        bool pending = (func.msg_idx < msg_que.size());
+        uint64_t value = 1;
+        if (pending && !func.signaled) {
+            if (::write(func.notify_fd, &value, sizeof(value)) == sizeof(value)) {
+                func.signaled = true;
+            }
+        } else if (!pending && func.signaled) {
+            if (::read(func.notify_fd, &value, sizeof(value)) == sizeof(value)) {
+                func.signaled = false;
+            }
+        }
+    }
+
+    /**
+     * ビジーポーリングのスレッドに、メッセージの追加などの変化を伝える。ロックを取得した状態で呼ぶ。
+     */
+    void notifySpinner() {
+        if (busy_poll) {
+            change_seq.fetch_add(1, std::memory_order_release);
+        }
+    }
+
+    /**
+     * ビジーポーリングのスレッドの処理
+     *
+     * 変化がなければ、SpinBackoffで待ち時間を伸ばしながらchange_seqを監視し続ける。
+     * コールバック関数の実行中は参照を保持し、コールバック関数の中で購読が閉じられてトピックが破棄されても、実行し終えるまで破棄されないようにする。
+     *
+     * \param owner shared_ptrで管理されている場合の、自身への参照
+     */
+    void spinLoop(std::weak_ptr<CallbackFuncs> owner) {
+        SpinBackoff backoff;
+        unsigned long seen = 0;
+        bool pending = true;
+        bool owned = !owner.expired();
+        while (true) {
+            if (spin_stop.load(std::memory_order_acquire)) {
+                std::lock_guard<std::mutex> lk(mtx);
+                if (spin_stop) { //停止直前に再び有効にされた場合は、続ける
+                    busy_poll = false;
+                    return;
+                }
+            }
+
+            unsigned long current = change_seq.load(std::memory_order_acquire);
+            if (current == seen && !pending) {
+                backoff.pause();
+                continue;
+            }
+            seen = current;
+            backoff.reset();
+            if (!owned) {
+                pending = runInline();
+                continue;
+            }
+            {
+                auto self = owner.lock();
+                if (!self) {
+                    return; //破棄が始まっている
+                }
+                pending = runInline();
+            }
+            if (owner.expired()) {
+                return; //このスレッドで破棄したので、メンバには触れない
+            }
+        }
+    }
+
+    /**
+     * 各関数に対して、メッセージがある場合は一度だけ、呼び出したスレッドでコールバック関数を実行する
+     *
+     * メッセージのコピーはロック中に行い、コールバック関数はロックを解放してから実行する。
+     *
+     * \return まだ送信していないメッセージがある場合はtrue
+     */
+    bool runInline() {
+        std::lock_guard<std::mutex> inline_lk(inline_mtx);
+        bool pending = false;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            pinCurrentThread(worker_cpus);
+            if (active_funcs.size() == 0) {
+                oldest_idx_supposed_to_be_pub = msg_que.size();
+                return false;
+            }
+
+            bool tracing = Tracer::enabled();
+            auto now = std::chrono::steady_clock::now();
+            for (auto idx : active_funcs) {
+                auto &func = slots[idx].info;
+                skipExpired(func, now);
+                updateNotifyFd(func);
+                if (func.decimation > 1 || func.min_interval.count() != 0) {
+                    bool waiting = false;
+                    if (!throttle(func, waiting)) {
+                        updateNotifyFd(func);
+                        pending |= waiting;
+                        continue;
+                    }
+                }
+                if (func.msg_idx >= msg_que.size()) {
+                    continue;
+                }
+
+                auto &msg = msg_que[func.msg_idx];
+                if (func.pull) {
+                    if (!func.waiter) {
+                        continue; //takeで取り出されるのを待つ
+                    }
+                    auto waiter = std::move(func.waiter);
+                    func.waiter = nullptr;
+                    DataType data = msg.data;
+                    inline_calls.push_back([waiter, data]() {waiter(&data);});
+                } else {
+                    auto function = (tracing ? wrapCallback(func.func) : func.func);
+                    inline_calls.push_back([function, msg]() mutable {function(msg);});
+                }
+                if (tracing) {
+                    Tracer::record(Tracer::DISPATCH, traceTopicId(), msg.seq);
+                }
+                func.last_call = std::chrono::steady_clock::now();
+                advance(func);
+                updateNotifyFd(func);
+                pending |= (func.msg_idx < msg_que.size());
+            }
+        }
+
+        for (auto &call : inline_calls) {
+            call();
+        }
+        inline_calls.clear();
+        return pending;
+    }
+
+    /**
+     * コールバック関数の実行前にスレッドを固定し、実行の前後をトレースに記録する関数を生成する
+     *
+     * \detail 固定しないトピックでは、他のトピックが固定したスレッドを元のCPUの設定に戻す。
+     * グローバルなスレッドプールは、固定しないトピックでもこの関数を経由しないので、固定したトピックが実行後に戻す。
+     */
+    std::function<ReturnType(MsgType &msg)> wrapCallback(const std::function<ReturnType(MsgType &msg)> &function) {
+        auto cpus = worker_cpus;
+        bool restore = (!cpus.empty() && pool == QThreadPool::globalInstance());
+        uint32_t topic_id = (Tracer::enabled() ? traceTopicId() : 0);
+        return [cpus, restore, topic_id, function](MsgType &msg) {
+            pinCurrentThread(cpus);
+            if (topic_id == 0) {
+                function(msg);
+            } else {
+                Tracer::record(Tracer::CALLBACK_BEGIN, topic_id, msg.seq);
+                function(msg);
+                Tracer::record(Tracer::CALLBACK_END, topic_id, msg.seq);
+            }
+            if (restore) {
+                pinCurrentThread(CpuSet());
+            }
+        };
+    }
+
+    /**
+     * 有効期間が過ぎたメッセージを読み飛ばす
+     *
+     * メッセージは出版順に並んでいるので、有効期間内のメッセージが見つかった時点で止める。
+     */
+    void skipExpired(FuncInfo &func, std::chrono::steady_clock::time_point now) {
+        auto ttl = (func.ttl.count() != 0 ? func.ttl : topic_ttl);
+        if (ttl.count() == 0) {
+            return;
+        }
+        while (func.msg_idx < msg_que.size() && now - msg_que[func.msg_idx].stamp > ttl) {
+            advance(func);
+        }
+    }
+
+    /**
+     * 間引きと最小間隔に従って、送信しないメッセージを読み飛ばす
+     *
+     * 読み飛ばしたメッセージは、コピーもスレッドプールへの投入もされない。
+     * 最小間隔が過ぎていない場合は、間引きで選ばれるメッセージのうち最新のものだけを残して待つ。
+     *
+     * \param waiting 最小間隔が過ぎるのを待っているメッセージがある場合にtrue
+     * \return 読み込み位置のメッセージを、すぐに送信してよい場合はtrue
+     */
+    bool throttle(FuncInfo &func, bool &waiting) {
+        bool interval_elapsed = (std::chrono::steady_clock::now() - func.last_call >= func.min_interval);
+        while (func.msg_idx < msg_que.size()) {
+            auto &msg = msg_que[func.msg_idx];
+            if (msg.seq != func.counted_seq) {
+                func.counted_seq = msg.seq;
+                func.selected = (func.decimation_count++ % func.decimation == 0);
+            }
+
+            if (!func.selected) {
+                advance(func);
+            } else if (interval_elapsed) {
+                return true;
+            } else {
+                //後続のメッセージのうち、次に間引きで選ばれるものの位置
+                size_t next_selected = func.msg_idx + 1 + (func.decimation - func.decimation_count % func.decimation) % func.decimation;
+                if (next_selected >= msg_que.size()) {
+                    waiting = true; //選ばれたメッセージを残し、間隔が過ぎるのを待つ
+                    return false;
+                }
+                advance(func); //選ばれる新しいメッセージがあるので、古いものは送信しない
+            }
+        }
+        return false;
+    }
+
+    /**
+     * 全トピックの購読から見た、このトピックの状態を取得する。初めて呼ばれたときに生成する。ロックを取得した状態で呼ぶ。
+     */
+    const std::shared_ptr<TapTopic>& tapTopic() {
+        if (!tap_topic) {
+            tap_topic = std::make_shared<TapTopic>(topic);
+        }
+        return tap_topic;
+    }
+
+    /**
+     * トレース用のトピック番号を取得する。初めて呼ばれたときに登録する。
+     */
+    uint32_t traceTopicId() {
+        if (trace_topic_id == 0) {
+            trace_topic_id = Tracer::topicId(topic);
+        }
+        return trace_topic_id;
+    }
+
+    /**
+     * 関数のメッセージ読み込み位置を一つ進める
+     *
+     * 本関数が最古のメッセージを利用した場合、他の関数も利用済みであれば、最古のメッセージを破棄可能にする。
+     */
+    void advance(FuncInfo &func) {
+        func.msg_idx++;
+        if ((func.msg_idx - 1) != oldest_idx_supposed_to_be_pub) {
+            return;
+        }
+
+        for (auto idx : active_funcs) {
+            if (slots[idx].info.msg_idx == oldest_idx_supposed_to_be_pub) {
+                return;
+            }
+        }
+        oldest_idx_supposed_to_be_pub = func.msg_idx;
+    }
+
+    /**
+     * このスレッドで実行中のwaiterの購読
+     */
+    struct ResumingWaiter {
+        const CallbackFuncs *owner;
+        SubscribeHandler handler;
+    };
+
+    /**
+     * このスレッドで実行中のwaiterを取得する。waiterの中から購読を閉じた場合に、waiter自身の終了を待たないために使う。
+     */
+    static ResumingWaiter& resumingWaiter() {
+        thread_local ResumingWaiter resuming { nullptr, 0 };
+        return resuming;
+    }
+
+    static uint32_t handler_index(SubscribeHandler handler) {
+        return static_cast<uint32_t>(handler & 0xffffffff);
+    }
+
+    static uint32_t handler_generation(SubscribeHandler handler) {
+        return static_cast<uint32_t>(handler >> 32);
+    }
+
+    /**
+     * ハンドラに対応するスロットを取得する。閉じられた購読や、再利用されたスロットの場合はnullptr
+     */
+    Slot* find_slot(SubscribeHandler handler) {
+        auto idx = handler_index(handler);
+        if (idx >= slots.size() || !slots[idx].used || slots[idx].generation != handler_generation(handler)) {
+            return nullptr;
+        }
+        return &slots[idx];
+    }
+
+    /**
+     * 空いているスロットにコールバック関数を追加し、有効にする
+     */
+    SubscribeHandler insert_func(const FuncInfo &info) {
+        uint32_t idx = 0;
+        if (!free_slots.empty()) {
+            idx = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            idx = slots.size();
+            slots.emplace_back();
+        }
+        auto &slot = slots[idx];
+        slot.info = info;
+        slot.used = true;
+        activate(idx);
+
+        return (static_cast<SubscribeHandler>(slot.generation) << 32) | idx;
+    }
+
+    /**
+     * コールバック関数を削除し、スロットを再利用できるようにする
+     */
+    void remove_func(SubscribeHandler handler) {
+        auto idx = handler_index(handler);
+        auto &slot = slots[idx];
+        if (slot.active_pos != NOT_ACTIVE) {
+            deactivate(idx);
+        }
+        if (slot.info.notify_fd >= 0) {
+            notify_fd_count--;
+        }
+        slot.info = FuncInfo();
+        slot.used = false;
+        slot.generation = (slot.generation == std::numeric_limits<uint32_t>::max() ? 1 : slot.generation + 1); //0は無効なハンドラになるので使わない
+        free_slots.push_back(idx);
+    }
+
+    /**
+     * スロットをactive_funcsに追加する。優先度が設定されている場合は、順序を保つ位置に追加する。
+     */
+    void activate(uint32_t idx) {
+        if (!priority_ordered) {
+            slots[idx].active_pos = active_funcs.size();
+            active_funcs.push_back(idx);
+            return;
+        }
+        auto itr = std::upper_bound(active_funcs.begin(), active_funcs.end(), idx, [&](uint32_t a, uint32_t b) {return slots[a].info.priority > slots[b].info.priority;});
+        auto pos = itr - active_funcs.begin();
+        active_funcs.insert(itr, idx);
+        update_active_pos(pos);
+    }
+
+    /**
+     * スロットをactive_funcsから外す。優先度が設定されていない場合は、末尾と入れ替えて定数時間で外す。
+     */
+    void deactivate(uint32_t idx) {
+        auto pos = slots[idx].active_pos;
+        slots[idx].active_pos = NOT_ACTIVE;
+        if (!priority_ordered) {
+            active_funcs[pos] = active_funcs.back();
+            active_funcs.pop_back();
+            if (pos < active_funcs.size()) {
+                slots[active_funcs[pos]].active_pos = pos;
+            }
+            return;
+        }
+        active_funcs.erase(active_funcs.begin() + pos);
+        update_active_pos(pos);
+    }
+
+    void update_active_pos(size_t begin) {
+        for (size_t pos = begin; pos < active_funcs.size(); ++pos) {
+            slots[active_funcs[pos]].active_pos = pos;
+        }
+    }
+
     /**
      * 受信メッセージキューが前に詰められた場合、送信メッセージの開始インデックス番号を調整する。
      */
@@ -284,16 +1065,38 @@ private:
 
 private:
     std::mutex mtx;
-    std::vector<FuncInfo> funcs;
-    SerializerHolderBase<DataType> *serializer = nullptr; //!< シリアライザ
+    std::string topic; //!< トピック名
+    std::vector<Slot> slots; //!< コールバック関数のスロット ハンドラの下位32bitが添字
+    std::vector<uint32_t> free_slots; //!< 再利用可能なスロット
+    std::vector<uint32_t> active_funcs; //!< 一時停止していない関数のスロット番号 callOnceはこの順に実行する
+    bool priority_ordered = false; //!< 優先度が設定され、active_funcsの順序を保つ必要があるかどうか
+    TapList *taps = nullptr; //!< 全トピックの購読の一覧 TopicFuncPairListが持ち、トピックより長く存在する
+    std::shared_ptr<TapTopic> tap_topic; //!< 全トピックの購読から見た、このトピックの状態 列のメッセージと共有する
+    std::shared_ptr<SerializerHolderBase<DataType>> serializer; //!< シリアライザ mtxで保護し、使う側はコピーを保持する
+    QThreadPool *pool = QThreadPool::globalInstance(); //!< コールバック関数を実行するスレッドプール
+
+    int topic_priority = 0; //!< トピックの優先度
+    std::chrono::microseconds deadline { 0 }; //!< 出版からコールバック実行までの期限 0だと期限なし
+    CpuSet worker_cpus; //!< コールバック関数を実行するスレッドを固定するCPU 空だと固定しない
+    uint32_t trace_topic_id = 0; //!< トレース用のトピック番号 0は未登録
+    unsigned long pub_seq = 0; //!< 出版したメッセージの通し番号
+    std::chrono::nanoseconds topic_ttl { 0 }; //!< メッセージの有効期間 0だと期限なし
+    std::atomic<size_t> codec_keyframe_interval { 0 }; //!< シリアライズされたメッセージの差分符号化のキーフレーム間隔 0だと符号化しない
+    size_t codec_max_message_size = DeltaDecoder::DEFAULT_MAX_SIZE; //!< 差分符号化されたメッセージの、復号後の最大の長さ
+    std::map<int, DeltaDecoder> decoders; //!< 送信者ごとの、差分符号化されたメッセージの復号器
 
-    unsigned int cur_handler_id = 0; //!< コールバックの関数のハンドラを割り振るための値
-    unsigned int handler_max = std::numeric_limits<unsigned int>::max() / 2; //!<登録可能なコールバック関数のハンドラIDの最大値
-    unsigned int serialized_func_handler_max = std::numeric_limits<unsigned int>::max(); //!<シリアライザ付きの関数のハンドラIDの最大値。handler_max+1から番号を割り振る。
+    bool busy_poll = false; //!< ビジーポーリングのスレッドがコールバック関数を実行しているかどうか
+    std::thread spin_thread; //!< ビジーポーリングのスレッド
+    std::thread::id spin_thread_id; //!< ビジーポーリングのスレッドのID 停止後も、スレッド自身からの呼び出しを判定するために保持する
+    std::atomic<bool> spin_stop { false }; //!< ビジーポーリングのスレッドの停止要求 mtxを取得して書き込む
+    std::atomic<unsigned long> change_seq { 0 }; //!< ビジーポーリングのスレッドが確認すべき変化のたびに進める
+    std::mutex inline_mtx; //!< ビジーポーリングのスレッドが、メッセージを取り出してコールバック関数を実行し終えるまでロックする
+    std::vector<std::function<void()>> inline_calls; //!< ビジーポーリングのスレッドで実行する関数 inline_mtxで保護する
 
     std::deque<MsgType> msg_que; //!< メッセージ受信キュー
     size_t max_rque_size = 0; //!< メッセージ受信キューの最大サイズ 0だと、無限サイズ
     size_t oldest_idx_supposed_to_be_pub = 0; //!< 送信予定の最古のメッセージ
+    size_t notify_fd_count = 0; //!< notify_fdを設定した購読の数
 };
 
 }
@@ -3,6 +3,12 @@
 #include <iostream>
 #include <vector>
 #include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include "affinity.hpp"
+
+class QThreadPool;
 
 namespace pubsub {
 
@@ -13,6 +19,16 @@ enum SendType{
 
 static constexpr int NO_EXCEPT = -1;
 
+/**
+ * 購読を特定するハンドラ
+ *
+ * 下位32bitがスロット番号、上位32bitが世代番号。0は無効値。
+ */
+using SubscribeHandler = uint64_t;
+
+class TapList;
+struct TapMessage;
+
 
 class CallbackFuncsBase {
 public:
@@ -20,15 +36,86 @@ public:
     }
     virtual bool callOnce() = 0;
 
-    virtual void close_subscribe(unsigned int handler) = 0;
-    virtual void pause_subscribe(unsigned int handler) = 0;
-    virtual void resume_subscribe(unsigned int handler) = 0;
+    /**
+     * \return 購読が見つかり、閉じた場合はtrue
+     */
+    virtual bool close_subscribe(SubscribeHandler handler) = 0;
+    virtual void pause_subscribe(SubscribeHandler handler) = 0;
+    virtual void resume_subscribe(SubscribeHandler handler) = 0;
+
+    /**
+     * コールバック関数ごとの優先度を設定する。値が大きいほど先に実行される。
+     */
+    virtual void set_subscribe_priority(SubscribeHandler handler, int priority) = 0;
+
+    /**
+     * コールバック関数に、N個に1個のメッセージだけを送信する。1だと全て送信する。
+     */
+    virtual void set_subscribe_decimation(SubscribeHandler handler, unsigned int decimation) = 0;
+
+    /**
+     * コールバック関数を呼び出す最小間隔を設定する。間隔内に届いたメッセージは、最新のもの以外送信しない。0だと制限しない。
+     */
+    virtual void set_subscribe_interval(SubscribeHandler handler, std::chrono::nanoseconds interval) = 0;
 
     /**
-     * シリアライザを利用する場合の、コールバック関数登録
+     * 購読ごとのメッセージの有効期間を設定する。出版から有効期間が過ぎたメッセージは送信しない。0だとトピックの設定に従う。
      */
-    virtual void subscribe_serialized(std::function<void(const std::string&)> func, int except_sender, unsigned int handler, size_t max_queue_size)=0;
-    virtual void close_subscribe_serialized(unsigned int handler) = 0;
+    virtual void set_subscribe_ttl(SubscribeHandler handler, std::chrono::nanoseconds ttl) = 0;
+
+    /**
+     * トピックのメッセージの有効期間を設定する。0だと期限なし。
+     */
+    virtual void setTimeToLive(std::chrono::nanoseconds ttl) = 0;
+
+    /**
+     * トピックの優先度と、メッセージの処理期限を設定する
+     *
+     * \param deadline 出版からコールバック実行までの期限。0だと期限なし。
+     */
+    virtual void setPriority(int priority, std::chrono::microseconds deadline) = 0;
+    virtual int getPriority() = 0;
+
+    /**
+     * 未処理メッセージのうち、最も早い処理期限を取得する。期限がない場合はtime_point::max()
+     */
+    virtual std::chrono::steady_clock::time_point getNextDeadline() = 0;
+
+    /**
+     * コールバック関数を実行するスレッドプールを設定する
+     */
+    virtual void setThreadPool(QThreadPool *pool) = 0;
+
+    /**
+     * コールバック関数を実行するスレッドを固定するCPUを設定する
+     */
+    virtual void setWorkerAffinity(const CpuSet &cpus) = 0;
+
+    /**
+     * シリアライズされたメッセージの差分符号化を設定する
+     *
+     * \param keyframe_interval キーフレームを送る間隔 0だと符号化しない
+     * \param max_message_size 復号後のメッセージの最大の長さ 超えるメッセージは捨てる
+     */
+    virtual void setDeltaCodec(size_t keyframe_interval, size_t max_message_size) = 0;
+
+    /**
+     * ビジーポーリングを設定する。有効な間は、専用のスレッドでコールバック関数を実行する
+     */
+    virtual void setBusyPoll(bool enable) = 0;
+
+    /**
+     * 出版したメッセージを流す、全トピックの購読の一覧を設定する
+     */
+    virtual void setTapList(TapList *taps) = 0;
+
+    /**
+     * 最新のメッセージを取得する。全トピックの購読の開始時に送るために使う。シリアライズは送信時に行う。
+     *
+     * \return メッセージがない場合や、LOCALで出版された場合はfalse
+     */
+    virtual bool getLatestTapMessage(TapMessage &msg) = 0;
+
     virtual void publish_serialized(const std::string &msg, SendType type, int sender_id) = 0;
 
 };
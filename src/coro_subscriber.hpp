@@ -0,0 +1,201 @@
+#pragma once
+
+#if __cplusplus < 202002L
+#error "coro_subscriber.hpp requires C++20"
+#endif
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <optional>
+#include <coroutine>
+#include <exception>
+
+#include "broker.hpp"
+
+namespace pubsub {
+
+/**
+ * 購読用のコルーチンの戻り値
+ *
+ * 呼び出すとすぐに実行が開始され、完了すると自動的に破棄される。
+ */
+struct Task {
+    struct promise_type {
+        Task get_return_object() {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {
+        }
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+/**
+ * co_awaitでメッセージを受け取る購読
+ *
+ * メッセージの読み込み位置やキューサイズの扱いは、api::subscribeと同じ。
+ * すでに届いているメッセージは、スレッドを切り替えずにそのまま受け取る。
+ * メッセージを待つ場合は、届いた時点でコンストラクタで指定したスレッドプールでコルーチンを再開する。
+ *
+ * \code
+ * pubsub::Task consume(pubsub::CoroSubscriber<int> &sub) {
+ *     while (auto data = co_await sub.next()) {
+ *         std::cout << *data << std::endl;
+ *     }
+ * }
+ * \endcode
+ */
+template<class DataType>
+class CoroSubscriber {
+public:
+    /**
+     * 次のメッセージを待つ。購読が閉じられた場合はstd::nulloptを返す。
+     */
+    class NextAwaiter {
+    public:
+        bool await_ready() {
+            DataType data;
+            if (sub->try_take(data)) {
+                value = std::move(data);
+                return true;
+            }
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            return sub->wait([this, handle](const DataType *data) {
+                if (data) {
+                    value = *data;
+                }
+                handle.resume();
+            });
+        }
+
+        std::optional<DataType> await_resume() {
+            return std::move(value);
+        }
+
+    private:
+        NextAwaiter(CoroSubscriber *sub) :
+                sub(sub) {
+        }
+
+    private:
+        CoroSubscriber *sub;
+        std::optional<DataType> value;
+        friend class CoroSubscriber;
+    };
+
+    /**
+     * 最大max_size個のメッセージをまとめて受け取る。購読が閉じられた場合は空の配列を返す。
+     */
+    class BatchAwaiter {
+    public:
+        bool await_ready() {
+            sub->drain(values, max_size);
+            return !values.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) {
+            return sub->wait([this, handle](const DataType *data) {
+                if (data) {
+                    values.push_back(*data);
+                    sub->drain(values, max_size); //待っている間に届いたメッセージも、まとめて受け取る
+                }
+                handle.resume();
+            });
+        }
+
+        std::vector<DataType> await_resume() {
+            return std::move(values);
+        }
+
+    private:
+        BatchAwaiter(CoroSubscriber *sub, size_t max_size) :
+                sub(sub), max_size(max_size) {
+        }
+
+    private:
+        CoroSubscriber *sub;
+        size_t max_size;
+        std::vector<DataType> values;
+        friend class CoroSubscriber;
+    };
+
+public:
+    /**
+     * \param pool コルーチンを再開するスレッドプール。nullptrの場合は、トピックのスレッドプール
+     * \param broker 購読するブローカー。nullptrの場合はデフォルトのブローカー
+     */
+    CoroSubscriber(const std::string &topic, size_t max_queue_size = 0, QThreadPool *pool = nullptr, BrokerCore *broker = nullptr) :
+            topic(topic), pool(pool), broker(broker) {
+        handler = Broker::getInstance(broker).subscribe_pull<DataType>(topic, max_queue_size);
+    }
+
+    ~CoroSubscriber() {
+        close();
+    }
+
+    /**
+     * 購読を閉じる。メッセージを待っているコルーチンは、購読終了として再開される。
+     */
+    void close() {
+        if (handler == 0) {
+            return;
+        }
+        Broker::getInstance(broker).close_subscribe(topic, handler);
+        handler = 0;
+    }
+
+    NextAwaiter next() {
+        return NextAwaiter(this);
+    }
+
+    BatchAwaiter next_batch(size_t max_size) {
+        return BatchAwaiter(this, max_size);
+    }
+
+    /**
+     * 届いているメッセージを一つ取り出す。待たずに戻る。
+     */
+    bool try_take(DataType &data) {
+        if (handler == 0) {
+            return false;
+        }
+        return Broker::getInstance(broker).take<DataType>(topic, handler, data);
+    }
+
+private:
+    void drain(std::vector<DataType> &values, size_t max_size) {
+        DataType data;
+        while (values.size() < max_size && try_take(data)) {
+            values.push_back(std::move(data));
+        }
+    }
+
+    bool wait(const std::function<void(const DataType*)> &waiter) {
+        if (handler == 0) {
+            return false;
+        }
+        return Broker::getInstance(broker).await_next<DataType>(topic, handler, waiter, pool);
+    }
+
+    CoroSubscriber(const CoroSubscriber &sub) = delete;
+    CoroSubscriber& operator=(const CoroSubscriber &sub) = delete;
+
+private:
+    std::string topic;
+    QThreadPool *pool = nullptr;
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
+    SubscribeHandler handler = 0; //!< 0は、無効値
+};
+}
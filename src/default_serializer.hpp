@@ -8,21 +8,47 @@
 #include <functional>
 #include <thread>
 #include <unistd.h>
+#include <type_traits>
 
 #include "callback_funcs.hpp"
+#include "simd_serializer.hpp"
 
 namespace pubsub {
+/**
+ * 文字列に変換できない数値の配列や構造体は、arraySerializerでシリアライズする
+ */
 class defaultSerializer {
 public:
     template<class DataType>
     std::string serialize(DataType &data) {
-        return data;
+        return toString(data);
     }
 
     template<class DataType>
     DataType deserialize(const std::string &msg) {
+        return fromString<DataType>(msg);
+    }
+
+private:
+    template<class DataType>
+    static typename std::enable_if<std::is_convertible<DataType, std::string>::value, std::string>::type toString(DataType &data) {
+        return data;
+    }
+
+    template<class DataType>
+    static typename std::enable_if<!std::is_convertible<DataType, std::string>::value, std::string>::type toString(DataType &data) {
+        return arraySerializer().serialize(data);
+    }
+
+    template<class DataType>
+    static typename std::enable_if<std::is_constructible<DataType, const std::string&>::value, DataType>::type fromString(const std::string &msg) {
         return DataType(msg);
     }
+
+    template<class DataType>
+    static typename std::enable_if<!std::is_constructible<DataType, const std::string&>::value, DataType>::type fromString(const std::string &msg) {
+        return arraySerializer().deserialize<DataType>(msg);
+    }
 };
 
 template<>
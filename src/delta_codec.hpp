@@ -0,0 +1,211 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <new>
+
+namespace pubsub {
+
+/**
+ * 連長圧縮
+ *
+ * \detail 同じバイトが続く部分を(長さ, 値)、それ以外を(長さ, バイト列)として格納する。
+ * 長さは可変長整数で、最下位bitが1なら同じバイトの繰り返し、0ならバイト列を表す。
+ */
+class RunLengthCompressor {
+public:
+    static void compress(const char *data, size_t size, std::string &out) {
+        size_t literal_begin = 0;
+        size_t idx = 0;
+        while (idx < size) {
+            size_t run = 1;
+            while (idx + run < size && data[idx + run] == data[idx]) {
+                run++;
+            }
+
+            if (run >= MIN_RUN) {
+                writeLiteral(data + literal_begin, idx - literal_begin, out);
+                writeVarint((run << 1) | 1, out);
+                out.push_back(data[idx]);
+                idx += run;
+                literal_begin = idx;
+            } else {
+                idx += run;
+            }
+        }
+        writeLiteral(data + literal_begin, size - literal_begin, out);
+    }
+
+    /**
+     * \param max_size 展開後の最大の長さ。これを超える長さを含むデータは、展開する前に壊れたデータとして扱う。
+     * \return 壊れたデータの場合はfalse
+     */
+    static bool decompress(const char *data, size_t size, std::string &out, size_t max_size) {
+        size_t idx = 0;
+        while (idx < size) {
+            uint64_t header = 0;
+            if (!readVarint(data, size, idx, header)) {
+                return false;
+            }
+            uint64_t len = header >> 1;
+            if (out.size() > max_size || len > max_size - out.size()) {
+                return false;
+            }
+            if (header & 1) {
+                if (idx >= size) {
+                    return false;
+                }
+                out.append(len, data[idx++]);
+            } else {
+                if (size - idx < len) {
+                    return false;
+                }
+                out.append(data + idx, len);
+                idx += len;
+            }
+        }
+        return true;
+    }
+
+    static void writeVarint(uint64_t value, std::string &out) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    static bool readVarint(const char *data, size_t size, size_t &idx, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && idx < size; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(data[idx++]);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static void writeLiteral(const char *data, size_t size, std::string &out) {
+        if (size == 0) {
+            return;
+        }
+        writeVarint(size << 1, out);
+        out.append(data, size);
+    }
+
+    static constexpr size_t MIN_RUN = 4; //!< これより短い繰り返しは、バイト列として格納する
+};
+
+/**
+ * 直前のメッセージとの差分で、シリアライズされたメッセージを符号化する
+ *
+ * \detail 先頭1バイトが'K'ならキーフレーム、'D'なら差分。続けて元のメッセージ長(可変長整数)と、
+ * キーフレームはメッセージそのもの、差分は直前のメッセージとの排他的論理和を連長圧縮したものを格納する。
+ * 少しだけ変化するメッセージでは、差分のほとんどが0になるため、大きく圧縮される。
+ */
+class DeltaEncoder {
+public:
+    /**
+     * \param keyframe_interval キーフレームを送る間隔。この回数ごとに、差分ではなくメッセージ全体を送る。
+     */
+    std::string encode(const std::string &msg, size_t keyframe_interval) {
+        std::string frame;
+        bool keyframe = (!has_prev || keyframe_interval <= 1 || count % keyframe_interval == 0);
+        frame.push_back(keyframe ? 'K' : 'D');
+        RunLengthCompressor::writeVarint(msg.size(), frame);
+
+        if (keyframe) {
+            RunLengthCompressor::compress(msg.data(), msg.size(), frame);
+        } else {
+            diff.resize(msg.size());
+            for (size_t idx = 0; idx < msg.size(); ++idx) {
+                diff[idx] = msg[idx] ^ (idx < prev.size() ? prev[idx] : 0);
+            }
+            RunLengthCompressor::compress(diff.data(), diff.size(), frame);
+        }
+
+        prev = msg;
+        has_prev = true;
+        count++;
+        return frame;
+    }
+
+    /**
+     * 次のメッセージをキーフレームにする
+     */
+    void reset() {
+        has_prev = false;
+        count = 0;
+    }
+
+private:
+    std::string prev; //!< 直前のメッセージ
+    std::string diff; //!< 差分の作業領域
+    bool has_prev = false;
+    size_t count = 0; //!< 前回のキーフレームからの数
+};
+
+/**
+ * DeltaEncoderで符号化されたメッセージを復号する
+ *
+ * \detail フレームに書かれたメッセージ長は送信者が決めるので、そのままでは上限にならない。
+ * 復号後の長さがmax_sizeを超えるフレームは、領域を確保する前に壊れたデータとして捨てる。
+ */
+class DeltaDecoder {
+public:
+    static constexpr size_t DEFAULT_MAX_SIZE = 16 * 1024 * 1024; //!< 復号後のメッセージの最大の長さの既定値
+
+    /**
+     * \param max_size 復号後のメッセージの最大の長さ これを超える長さを宣言したフレームや、超える繰り返しを含むフレームは捨てる
+     * \return キーフレームを受け取る前の差分や、壊れたデータの場合はfalse
+     */
+    bool decode(const std::string &frame, std::string &msg, size_t max_size = DEFAULT_MAX_SIZE) {
+        if (frame.empty() || (frame[0] != 'K' && frame[0] != 'D')) {
+            return false;
+        }
+        bool keyframe = (frame[0] == 'K');
+        if (!keyframe && !has_prev) {
+            return false;
+        }
+
+        size_t idx = 1;
+        uint64_t size = 0;
+        if (!RunLengthCompressor::readVarint(frame.data(), frame.size(), idx, size)) {
+            return false;
+        }
+        if (size > max_size) {
+            has_prev = false;
+            return false;
+        }
+        std::string body;
+        bool ok = false;
+        try {
+            ok = RunLengthCompressor::decompress(frame.data() + idx, frame.size() - idx, body, size);
+        } catch (const std::bad_alloc&) {
+            ok = false; //上限以内でも確保できない場合は、例外を出版側に伝えず、壊れたデータと同じく捨てる
+        }
+        if (!ok || body.size() != size) {
+            has_prev = false;
+            return false;
+        }
+
+        if (!keyframe) {
+            for (size_t pos = 0; pos < body.size(); ++pos) {
+                body[pos] ^= (pos < prev.size() ? prev[pos] : 0);
+            }
+        }
+        prev = body;
+        has_prev = true;
+        msg = std::move(body);
+        return true;
+    }
+
+private:
+    std::string prev; //!< 直前に復号したメッセージ
+    bool has_prev = false;
+};
+}
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <array>
+#include <tuple>
+#include <utility>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+
+#include "callback_funcs.hpp"
+
+namespace pubsub {
+
+/**
+ * 複数トピックの結合購読の基底クラス
+ */
+class JoinBase {
+public:
+    virtual ~JoinBase() {
+    }
+
+    /**
+     * 揃ったメッセージの組がある場合は、一度だけコールバック関数を呼び出す
+     *
+     * \return コールバック関数実行中かどうか
+     */
+    virtual bool callOnce() = 0;
+
+    /**
+     * 実行中のコールバック関数を待ち、各トピックの購読を閉じる
+     */
+    virtual void close() = 0;
+};
+
+/**
+ * 出版時刻の揃ったメッセージの組を、一つのコールバック関数で受け取る購読
+ *
+ * \detail 各トピックにpullの購読を持ち、キューの先頭のメッセージの出版時刻を比較する。
+ * 最も新しい先頭よりtolerance以上古いメッセージは、組になる相手がもう来ないため、コピーせずに読み飛ばす。
+ * 全ての先頭がtolerance以内に揃ったら、それぞれを一つずつ取り出してコールバック関数を呼び出す。
+ * toleranceが0の場合は、出版時刻が完全に一致する組だけを送信する(PublishBatchなどで同時に出版した場合)。
+ *
+ * 読み飛ばしたメッセージは、他の購読者が利用済みであればすぐに破棄される。
+ * コールバック関数は、前回の呼び出しが終わるまで次を呼び出さない。
+ */
+template<class... DataTypes>
+class Join: public JoinBase {
+    using Indices = std::index_sequence_for<DataTypes...>;
+    static constexpr size_t N = sizeof...(DataTypes);
+
+public:
+    using FuncsType = std::tuple<CallbackFuncs<void, DataTypes>*...>;
+
+    /**
+     * \param max_queue_size トピックごとに溜めるメッセージの最大数 0だと無限
+     */
+    Join(const FuncsType &funcs, const std::function<void(const DataTypes&...)> &func, std::chrono::nanoseconds tolerance, size_t max_queue_size, QThreadPool *pool) :
+            funcs(funcs), func(func), tolerance(tolerance), pool(pool ? pool : QThreadPool::globalInstance()) {
+        subscribeAll(max_queue_size, Indices());
+    }
+
+    bool callOnce() override {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (closed) {
+            return false;
+        }
+        if (future.isRunning()) {
+            return true;
+        }
+
+        while (true) {
+            std::array<std::chrono::steady_clock::time_point, N> stamps;
+            if (!peekAll(stamps, Indices())) {
+                return false; //まだ揃っていない
+            }
+            auto newest = *std::max_element(stamps.begin(), stamps.end());
+            if (!skipOlder(stamps, newest, Indices())) {
+                break;
+            }
+        }
+
+        std::tuple<DataTypes...> values;
+        takeAll(values, Indices());
+        auto function = func;
+        future = QtConcurrent::run(pool, [function, values]() {
+            invoke(function, values, Indices());
+        });
+        return true;
+    }
+
+    void close() override {
+        QFuture<void> running;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (closed) {
+                return;
+            }
+            closed = true; //これ以降、コールバック関数は呼ばれない
+            running = future;
+        }
+        if (running.isRunning()) {
+            running.waitForFinished();
+        }
+        closeAll(Indices());
+    }
+
+private:
+    template<size_t... I>
+    void subscribeAll(size_t max_queue_size, std::index_sequence<I...>) {
+        int dummy[] = { 0, (handlers[I] = std::get<I>(funcs)->subscribe_pull(max_queue_size), 0)... };
+        (void)dummy;
+    }
+
+    template<size_t... I>
+    bool peekAll(std::array<std::chrono::steady_clock::time_point, N> &stamps, std::index_sequence<I...>) {
+        bool found[] = { std::get<I>(funcs)->peek_stamp(handlers[I], stamps[I])... };
+        return std::all_of(std::begin(found), std::end(found), [](bool f) {return f;});
+    }
+
+    /**
+     * 最も新しい先頭よりtolerance以上古い先頭を、読み飛ばす
+     *
+     * \return 読み飛ばしたメッセージがある場合はtrue
+     */
+    template<size_t... I>
+    bool skipOlder(const std::array<std::chrono::steady_clock::time_point, N> &stamps, std::chrono::steady_clock::time_point newest, std::index_sequence<I...>) {
+        bool skipped = false;
+        int dummy[] = { 0, ((newest - stamps[I] > tolerance ? (std::get<I>(funcs)->skip(handlers[I]), skipped = true) : false), 0)... };
+        (void)dummy;
+        return skipped;
+    }
+
+    template<size_t... I>
+    void takeAll(std::tuple<DataTypes...> &values, std::index_sequence<I...>) {
+        int dummy[] = { 0, (std::get<I>(funcs)->take(handlers[I], std::get<I>(values)), 0)... };
+        (void)dummy;
+    }
+
+    template<size_t... I>
+    void closeAll(std::index_sequence<I...>) {
+        int dummy[] = { 0, (std::get<I>(funcs)->close_subscribe(handlers[I]), 0)... };
+        (void)dummy;
+    }
+
+    template<size_t... I>
+    static void invoke(const std::function<void(const DataTypes&...)> &function, const std::tuple<DataTypes...> &values, std::index_sequence<I...>) {
+        function(std::get<I>(values)...);
+    }
+
+private:
+    FuncsType funcs; //!< 各トピック トピックは結合購読が参照を持つので、購読中は削除されない
+    std::array<SubscribeHandler, N> handlers; //!< 各トピックのpullの購読
+    std::function<void(const DataTypes&...)> func; //!< コールバック関数
+    std::chrono::nanoseconds tolerance; //!< 組にする出版時刻の差の許容値
+    QThreadPool *pool;
+    QFuture<void> future; //!< コールバック実行結果取得
+    std::mutex mtx; //!< ディスパッチスレッドのcallOnceと、closeを排他する
+    bool closed = false;
+};
+}
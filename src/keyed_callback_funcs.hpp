@@ -0,0 +1,494 @@
+#pragma once
+
+#include <iostream>
+#include <deque>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+
+#include "callback_funcs_base.hpp"
+#include "open_hash_map.hpp"
+#include "affinity.hpp"
+#include "priority_task.hpp"
+
+namespace pubsub {
+
+/**
+ * キー付きトピックの基底クラス
+ */
+class KeyedCallbackFuncsBase: public CallbackFuncsBase {
+public:
+    /**
+     * キーごとに保持するメッセージの数を設定する。0は1として扱う。
+     */
+    virtual void setHistoryDepth(size_t depth) = 0;
+
+    /**
+     * 最後の出版からtimeoutが過ぎたキーを破棄するようにする。0だと破棄しない。
+     */
+    virtual void setKeyIdleTimeout(std::chrono::nanoseconds timeout) = 0;
+};
+
+/**
+ * 一つのトピックに、キーで区別される複数の系列を流すトピック
+ *
+ * \detail メッセージの履歴はキーごとに持ち、キーごとの最大数を超えた場合はそのキーの古いものから破棄する。
+ * そのため、頻繁に出版されるキーが、他のキーのメッセージを押し出すことはない。
+ * キーごとの状態はオープンアドレス法のハッシュテーブルに持つので、キーを指定した最新のメッセージの取得は定数時間でできる。
+ *
+ * 購読ごとに、未送信のメッセージがあるキーの待ち行列を持つ。
+ * コールバック関数を呼び出すたびに、送信したキーを待ち行列の末尾に回すので、キーの間で公平に送信される。
+ * conflateを指定した購読には、キーごとに最新のメッセージだけを送信する。
+ * キーの破棄を設定した場合は、しばらく出版されていないキーを出版時に破棄するので、キーが入れ替わり続けても状態は増え続けない。
+ *
+ * 購読ごとの間引き・最小間隔、トピックの処理期限・差分符号化・ビジーポーリング・シリアライズ付きの購読には対応しない。
+ */
+template<class Key, class DataType>
+class KeyedCallbackFuncs: public KeyedCallbackFuncsBase {
+    struct Entry {
+        DataType data;
+        std::chrono::steady_clock::time_point stamp; //!< 出版時刻
+        unsigned long seq; //!< トピック内の通し番号
+    };
+
+    /**
+     * 購読ごとの、あるキーの読み込み位置
+     */
+    struct Cursor {
+        unsigned long next_seq = 0; //!< 次に送信するメッセージの通し番号 これより前は送信済み
+        bool queued = false;        //!< 購読の待ち行列に入っているかどうか
+    };
+
+    struct KeyState {
+        std::deque<Entry> history;   //!< 古い順 最大history_depth個
+        std::vector<Cursor> cursors; //!< 購読のスロット番号ごとの読み込み位置
+    };
+
+    struct FuncInfo {
+        std::function<void(const Key&, const DataType&)> func; //!< コールバック関数
+        QFuture<void> future; //!< コールバック実行結果取得
+        std::deque<Key> ready; //!< 未送信のメッセージがあるキーの待ち行列
+        bool conflate = false; //!< キーごとに最新のメッセージだけを送信するかどうか
+        int priority = 0; //!< 優先度 値が大きいほど先に実行される
+        std::chrono::nanoseconds ttl { 0 }; //!< メッセージの有効期間 0だとトピックの設定に従う
+    };
+
+    struct Slot {
+        FuncInfo info;
+        uint32_t generation = 1; //!< 世代番号
+        bool used = false;       //!< 使用中かどうか
+        bool active = false;     //!< 一時停止していないかどうか
+    };
+
+public:
+    KeyedCallbackFuncs() {
+    }
+
+    ~KeyedCallbackFuncs() {
+    }
+
+    void setTopic(const std::string &topic) {
+        this->topic = topic;
+    }
+
+    /**
+     * コールバック関数を登録する
+     *
+     * ここで登録した以降に出版されたメッセージから送信する。
+     *
+     * \param conflate trueの場合、キーごとに最新のメッセージだけを送信する
+     */
+    SubscribeHandler subscribe(const std::function<void(const Key&, const DataType&)> &func, bool conflate = false) {
+        std::lock_guard<std::mutex> lk(mtx);
+        uint32_t idx = 0;
+        if (!free_slots.empty()) {
+            idx = free_slots.back();
+            free_slots.pop_back();
+        } else {
+            idx = slots.size();
+            slots.emplace_back();
+        }
+        auto &slot = slots[idx];
+        slot.info = FuncInfo();
+        slot.info.func = func;
+        slot.info.conflate = conflate;
+        slot.used = true;
+        skipToLatest(idx);
+        activate(idx);
+
+        return (static_cast<SubscribeHandler>(slot.generation) << 32) | idx;
+    }
+
+    /**
+     * メッセージを保存する
+     */
+    void publish(const Key &key, const DataType &data) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto now = std::chrono::steady_clock::now();
+        if (key_idle_timeout.count() != 0 && now - last_eviction >= key_idle_timeout) {
+            evictIdleKeys(now);
+        }
+
+        bool inserted = false;
+        auto &state = keys.findOrInsert(key, inserted);
+        state.history.push_back(Entry { data, now, ++pub_seq });
+        if (state.history.size() > history_depth) {
+            state.history.pop_front();
+        }
+
+        for (auto idx : active_funcs) {
+            auto &c = cursor(state, idx);
+            if (!c.queued) {
+                c.queued = true;
+                slots[idx].info.ready.push_back(key);
+            }
+        }
+    }
+
+    /**
+     * キーの最新のメッセージを取得する
+     *
+     * \return キーのメッセージがまだない場合はfalse
+     */
+    bool getLatestData(const Key &key, DataType &data) {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *state = keys.find(key);
+        if (!state || state->history.empty()) {
+            return false;
+        }
+        data = state->history.back().data;
+        return true;
+    }
+
+    /**
+     * メッセージが出版されたキーの数
+     */
+    size_t keyCount() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return keys.size();
+    }
+
+    void setHistoryDepth(size_t depth) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        history_depth = std::max<size_t>(depth, 1);
+        keys.forEach([&](const Key&, KeyState &state) {
+            while (state.history.size() > history_depth) {
+                state.history.pop_front();
+            }
+        });
+    }
+
+    void setKeyIdleTimeout(std::chrono::nanoseconds timeout) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        key_idle_timeout = timeout;
+        last_eviction = std::chrono::steady_clock::now();
+    }
+
+    /**
+     * 各購読に対して、未送信のメッセージがある場合は、一度だけコールバック関数を呼び出す
+     *
+     * 待ち行列の先頭のキーのメッセージを送信し、まだ未送信のメッセージが残っていれば、キーを末尾に回す。
+     *
+     * \return コールバック関数実行中かどうか
+     */
+    bool callOnce() override {
+        std::lock_guard<std::mutex> lk(mtx);
+        bool processing = false;
+        auto now = std::chrono::steady_clock::now();
+        for (auto idx : active_funcs) {
+            auto &func = slots[idx].info;
+            if (!func.future.isFinished()) {
+                processing = true;
+                continue;
+            }
+
+            while (!func.ready.empty()) {
+                Key key = std::move(func.ready.front());
+                func.ready.pop_front();
+                auto *state = keys.find(key);
+                if (!state) {
+                    continue;
+                }
+                auto &c = cursor(*state, idx);
+                c.queued = false;
+                auto *entry = nextEntry(*state, c, func, now);
+                if (!entry) {
+                    continue; //有効期間が過ぎたか、履歴から押し出された
+                }
+                c.next_seq = entry->seq + 1;
+                if (state->history.back().seq >= c.next_seq) {
+                    c.queued = true;
+                    func.ready.push_back(key);
+                }
+
+                //トピックの優先度で、スレッドプールの待ち行列に並べる。メッセージは、この時点でコピーされる
+                auto cpus = worker_cpus;
+                bool restore = (!cpus.empty() && pool == QThreadPool::globalInstance()); //グローバルなスレッドプールは、他のトピックと共有するので戻す
+                auto function = func.func;
+                func.future = runWithPriority(pool, topic_priority, [cpus, restore, function, key, data = entry->data]() {
+                    pinCurrentThread(cpus);
+                    function(key, data);
+                    if (restore) {
+                        pinCurrentThread(CpuSet());
+                    }
+                });
+                processing = true;
+                break;
+            }
+        }
+        return processing;
+    }
+
+    /**
+     * 購読を閉じる。ロックを解放してから、実行中のコールバック関数の終了を待つ。
+     */
+    bool close_subscribe(SubscribeHandler handler) override {
+        QFuture<void> future;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto *slot = find_slot(handler);
+            if (!slot) {
+                return false;
+            }
+            future = slot->info.future;
+            auto idx = handler_index(handler);
+            if (slot->active) {
+                deactivate(idx);
+            }
+            slot->info = FuncInfo();
+            slot->used = false;
+            slot->generation = (slot->generation == std::numeric_limits<uint32_t>::max() ? 1 : slot->generation + 1); //0は無効なハンドラになるので使わない
+            free_slots.push_back(idx);
+        }
+
+        if (future.isRunning()) {
+            future.waitForFinished();
+        }
+        return true;
+    }
+
+    void pause_subscribe(SubscribeHandler handler) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (!slot || !slot->active) {
+            return;
+        }
+        deactivate(handler_index(handler));
+    }
+
+    /**
+     * 購読を再開する。一時停止中に出版されたメッセージは送信しない。
+     */
+    void resume_subscribe(SubscribeHandler handler) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (!slot || slot->active) {
+            return;
+        }
+        auto idx = handler_index(handler);
+        skipToLatest(idx);
+        activate(idx);
+    }
+
+    void set_subscribe_priority(SubscribeHandler handler, int priority) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (!slot) {
+            return;
+        }
+        slot->info.priority = priority;
+        sortActiveFuncs();
+    }
+
+    void set_subscribe_decimation(SubscribeHandler, unsigned int) override {
+    }
+
+    void set_subscribe_interval(SubscribeHandler, std::chrono::nanoseconds) override {
+    }
+
+    void set_subscribe_ttl(SubscribeHandler handler, std::chrono::nanoseconds ttl) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        auto *slot = find_slot(handler);
+        if (slot) {
+            slot->info.ttl = ttl;
+        }
+    }
+
+    void setTimeToLive(std::chrono::nanoseconds ttl) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        topic_ttl = ttl;
+    }
+
+    /**
+     * トピックの優先度を設定する。処理期限には対応しない。
+     */
+    void setPriority(int priority, std::chrono::microseconds) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        topic_priority = priority;
+    }
+
+    int getPriority() override {
+        std::lock_guard<std::mutex> lk(mtx);
+        return topic_priority;
+    }
+
+    std::chrono::steady_clock::time_point getNextDeadline() override {
+        return std::chrono::steady_clock::time_point::max();
+    }
+
+    void setThreadPool(QThreadPool *pool) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        this->pool = (pool ? pool : QThreadPool::globalInstance());
+    }
+
+    void setWorkerAffinity(const CpuSet &cpus) override {
+        std::lock_guard<std::mutex> lk(mtx);
+        worker_cpus = cpus;
+    }
+
+    void setDeltaCodec(size_t, size_t) override {
+    }
+
+    void setBusyPoll(bool) override {
+    }
+
+    void setTapList(TapList*) override {
+    }
+
+    bool getLatestTapMessage(TapMessage&) override {
+        return false;
+    }
+
+    void publish_serialized(const std::string&, SendType, int) override {
+    }
+
+private:
+    static uint32_t handler_index(SubscribeHandler handler) {
+        return static_cast<uint32_t>(handler & 0xffffffffu);
+    }
+
+    Slot* find_slot(SubscribeHandler handler) {
+        auto idx = handler_index(handler);
+        if (idx >= slots.size()) {
+            return nullptr;
+        }
+        auto &slot = slots[idx];
+        if (!slot.used || slot.generation != static_cast<uint32_t>(handler >> 32)) {
+            return nullptr;
+        }
+        return &slot;
+    }
+
+    /**
+     * キーの、購読の読み込み位置を取得する。購読の後に追加されたキーの場合は、ここで領域を確保する。
+     */
+    Cursor& cursor(KeyState &state, uint32_t idx) {
+        if (state.cursors.size() <= idx) {
+            state.cursors.resize(slots.size());
+        }
+        return state.cursors[idx];
+    }
+
+    /**
+     * 購読の読み込み位置を、全てのキーで最新のメッセージの次に進め、待ち行列を空にする
+     */
+    void skipToLatest(uint32_t idx) {
+        slots[idx].info.ready.clear();
+        keys.forEach([&](const Key&, KeyState &state) {
+            auto &c = cursor(state, idx);
+            c.next_seq = (state.history.empty() ? 0 : state.history.back().seq + 1);
+            c.queued = false;
+        });
+    }
+
+    /**
+     * 購読に次に送信するメッセージを探す
+     *
+     * \return 送信するメッセージがない場合はnullptr
+     */
+    const Entry* nextEntry(const KeyState &state, const Cursor &c, const FuncInfo &func, std::chrono::steady_clock::time_point now) {
+        auto &history = state.history;
+        if (history.empty() || history.back().seq < c.next_seq) {
+            return nullptr;
+        }
+        auto itr = (func.conflate ? history.end() - 1 : std::lower_bound(history.begin(), history.end(), c.next_seq, [](const Entry &entry, unsigned long seq) {return entry.seq < seq;}));
+
+        auto ttl = (func.ttl.count() != 0 ? func.ttl : topic_ttl);
+        if (ttl.count() != 0) {
+            while (itr != history.end() && now - itr->stamp > ttl) {
+                ++itr;
+            }
+        }
+        return (itr != history.end() ? &*itr : nullptr);
+    }
+
+    /**
+     * 最後の出版からkey_idle_timeoutが過ぎたキーを破棄する
+     *
+     * \detail 全てのキーを走査するので、出版ごとではなくkey_idle_timeoutに一度だけ行う。
+     * 未送信のメッセージが残っているキーは、送信されるまで破棄しない。
+     */
+    void evictIdleKeys(std::chrono::steady_clock::time_point now) {
+        last_eviction = now;
+        idle_keys.clear();
+        keys.forEach([&](const Key &key, KeyState &state) {
+            if (!state.history.empty() && now - state.history.back().stamp < key_idle_timeout) {
+                return;
+            }
+            for (auto &c : state.cursors) {
+                if (c.queued) {
+                    return;
+                }
+            }
+            idle_keys.push_back(key);
+        });
+        for (auto &key : idle_keys) {
+            keys.erase(key);
+        }
+        idle_keys.clear();
+    }
+
+    void activate(uint32_t idx) {
+        slots[idx].active = true;
+        active_funcs.push_back(idx);
+        sortActiveFuncs();
+    }
+
+    void deactivate(uint32_t idx) {
+        slots[idx].active = false;
+        slots[idx].info.ready.clear();
+        active_funcs.erase(std::remove(active_funcs.begin(), active_funcs.end(), idx), active_funcs.end());
+        keys.forEach([&](const Key&, KeyState &state) {
+            cursor(state, idx).queued = false;
+        });
+    }
+
+    void sortActiveFuncs() {
+        std::stable_sort(active_funcs.begin(), active_funcs.end(), [&](uint32_t a, uint32_t b) {return slots[a].info.priority > slots[b].info.priority;});
+    }
+
+private:
+    std::mutex mtx;
+    std::string topic; //!< トピック名
+    OpenHashMap<Key, KeyState> keys; //!< キーごとの履歴と読み込み位置
+    size_t history_depth = 1; //!< キーごとに保持するメッセージの最大数
+    std::chrono::nanoseconds key_idle_timeout { 0 }; //!< 最後の出版からこの時間が過ぎたキーを破棄する 0だと破棄しない
+    std::chrono::steady_clock::time_point last_eviction; //!< 最後にキーの破棄を行った時刻
+    std::vector<Key> idle_keys; //!< 破棄するキーを集める作業領域
+    std::vector<Slot> slots; //!< コールバック関数のスロット ハンドラの下位32bitが添字
+    std::vector<uint32_t> free_slots; //!< 再利用可能なスロット
+    std::vector<uint32_t> active_funcs; //!< 一時停止していない購読のスロット番号 優先度の高い順
+    QThreadPool *pool = QThreadPool::globalInstance(); //!< コールバック関数を実行するスレッドプール
+    CpuSet worker_cpus; //!< コールバック関数を実行するスレッドを固定するCPU 空だと固定しない
+    int topic_priority = 0; //!< トピックの優先度
+    std::chrono::nanoseconds topic_ttl { 0 }; //!< メッセージの有効期間 0だと期限なし
+    unsigned long pub_seq = 0; //!< 出版したメッセージの通し番号
+};
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <cstdint>
+
+namespace pubsub {
+
+/**
+ * 線形探索のオープンアドレス法によるハッシュテーブル
+ *
+ * \detail 要素を一つの配列に並べるので、std::mapやstd::unordered_mapと違い、要素ごとのメモリ確保やポインタの追跡がない。
+ * 容量は2のべき乗で、要素数が容量の半分を超えたら倍に広げる。
+ * 削除は後続の要素を詰め直すので、墓標は残らず、探索が長くならない。
+ *
+ * 挿入と削除で要素が移動するので、findで取得したポインタは、次の挿入・削除まで有効。
+ */
+template<class Key, class Value, class Hash = std::hash<Key>>
+class OpenHashMap {
+    struct Bucket {
+        Key key;
+        Value value;
+        bool used = false;
+    };
+
+public:
+    OpenHashMap() {
+        buckets.resize(MIN_CAPACITY);
+    }
+
+    /**
+     * \return 見つからない場合はnullptr
+     */
+    Value* find(const Key &key) {
+        size_t idx = index(key);
+        while (buckets[idx].used) {
+            if (buckets[idx].key == key) {
+                return &buckets[idx].value;
+            }
+            idx = (idx + 1) & mask();
+        }
+        return nullptr;
+    }
+
+    const Value* find(const Key &key) const {
+        return const_cast<OpenHashMap*>(this)->find(key);
+    }
+
+    /**
+     * 要素を取得する。なければ既定値で挿入する。
+     *
+     * \param inserted 挿入した場合はtrue
+     */
+    Value& findOrInsert(const Key &key, bool &inserted) {
+        if ((count + 1) * 2 > buckets.size()) {
+            rehash(buckets.size() * 2);
+        }
+        size_t idx = index(key);
+        while (buckets[idx].used) {
+            if (buckets[idx].key == key) {
+                inserted = false;
+                return buckets[idx].value;
+            }
+            idx = (idx + 1) & mask();
+        }
+        buckets[idx].key = key;
+        buckets[idx].value = Value();
+        buckets[idx].used = true;
+        count++;
+        inserted = true;
+        return buckets[idx].value;
+    }
+
+    Value& operator[](const Key &key) {
+        bool inserted = false;
+        return findOrInsert(key, inserted);
+    }
+
+    /**
+     * \return 削除した場合はtrue
+     */
+    bool erase(const Key &key) {
+        size_t idx = index(key);
+        while (buckets[idx].used && !(buckets[idx].key == key)) {
+            idx = (idx + 1) & mask();
+        }
+        if (!buckets[idx].used) {
+            return false;
+        }
+
+        //後続の要素のうち、本来の位置から見て空いた位置を越えているものを詰める
+        size_t hole = idx;
+        size_t next = (hole + 1) & mask();
+        while (buckets[next].used) {
+            size_t home = index(buckets[next].key);
+            if (((next - home) & mask()) >= ((next - hole) & mask())) {
+                buckets[hole] = std::move(buckets[next]);
+                hole = next;
+            }
+            next = (next + 1) & mask();
+        }
+        buckets[hole] = Bucket();
+        count--;
+        return true;
+    }
+
+    /**
+     * 全ての要素に対して、関数を呼び出す。順番は不定。
+     */
+    template<class Func>
+    void forEach(Func func) {
+        for (auto &bucket : buckets) {
+            if (bucket.used) {
+                func(bucket.key, bucket.value);
+            }
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    void clear() {
+        buckets.assign(MIN_CAPACITY, Bucket());
+        count = 0;
+    }
+
+private:
+    size_t mask() const {
+        return buckets.size() - 1;
+    }
+
+    size_t index(const Key &key) const {
+        //下位ビットだけを使うので、整数の恒等ハッシュでも偏らないよう混ぜる
+        uint64_t h = static_cast<uint64_t>(Hash()(key)) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(h >> 32) & mask();
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Bucket> old(capacity);
+        old.swap(buckets);
+        for (auto &bucket : old) {
+            if (!bucket.used) {
+                continue;
+            }
+            size_t idx = index(bucket.key);
+            while (buckets[idx].used) {
+                idx = (idx + 1) & mask();
+            }
+            buckets[idx] = std::move(bucket);
+        }
+    }
+
+private:
+    static constexpr size_t MIN_CAPACITY = 16; //!< 2のべき乗
+    std::vector<Bucket> buckets;
+    size_t count = 0; //!< 要素数
+};
+}
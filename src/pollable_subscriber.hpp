@@ -0,0 +1,128 @@
+#pragma once
+
+#ifndef __linux__
+#error "pollable_subscriber.hpp requires Linux eventfd"
+#endif
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "broker.hpp"
+
+namespace pubsub {
+
+/**
+ * epollなどの外部のイベントループから、メッセージを取り出す購読
+ *
+ * \detail 未読のメッセージがある間だけ読み込み可能になるeventfdを持つ。
+ * イベントループはfd()を監視し、読み込み可能になったらtry_takeやdrainで、ループのスレッドから直接メッセージを取り出す。
+ * コールバック関数は使わないので、スレッドプールを経由せず、ブローカーのロックも取らない。
+ *
+ * fdは取り出し側が読み込む必要はない。キューが空になった時点で、取り出し側のスレッドで読み込み可能でなくなる。
+ * そのため、レベルトリガーでもエッジトリガーでも監視できる。
+ * ただしエッジトリガーの場合は、try_takeがfalseを返すまで取り出すこと。
+ *
+ * メッセージの読み込み位置やキューサイズの扱いは、api::subscribeと同じ。
+ *
+ * \code
+ * pubsub::PollableSubscriber<int> sub("/count");
+ * epoll_event ev { EPOLLIN };
+ * epoll_ctl(epfd, EPOLL_CTL_ADD, sub.fd(), &ev);
+ * ...
+ * std::vector<int> values;
+ * sub.drain(values, 64);
+ * \endcode
+ */
+template<class DataType>
+class PollableSubscriber {
+public:
+    /**
+     * \param broker 購読するブローカー。nullptrの場合はデフォルトのブローカー
+     */
+    PollableSubscriber(const std::string &topic, size_t max_queue_size = 0, BrokerCore *broker = nullptr) :
+            topic(topic), broker(broker) {
+        notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (notify_fd < 0) {
+            return;
+        }
+        func = Broker::getInstance(broker).retain_topic<DataType>(topic);
+        if (!func) {
+            ::close(notify_fd);
+            notify_fd = -1;
+            return;
+        }
+        handler = func->subscribe_pull(max_queue_size);
+        func->set_notify_fd(handler, notify_fd);
+    }
+
+    ~PollableSubscriber() {
+        close();
+    }
+
+    /**
+     * 購読を閉じる。閉じた後は、fd()は-1を返す。
+     */
+    void close() {
+        if (handler == 0) {
+            return;
+        }
+        func->close_subscribe(handler);
+        func = nullptr;
+        Broker::getInstance(broker).release_topic(topic);
+        handler = 0;
+        ::close(notify_fd);
+        notify_fd = -1;
+    }
+
+    /**
+     * 購読できたかどうか。型の一致しないトピックや、eventfdを生成できなかった場合はfalse
+     */
+    bool isValid() const {
+        return handler != 0;
+    }
+
+    /**
+     * 未読のメッセージがある間だけ読み込み可能になるfd
+     */
+    int fd() const {
+        return notify_fd;
+    }
+
+    /**
+     * 届いているメッセージを一つ取り出す。待たずに戻る。
+     */
+    bool try_take(DataType &data) {
+        if (handler == 0) {
+            return false;
+        }
+        return func->take(handler, data);
+    }
+
+    /**
+     * 届いているメッセージを、最大max_size個までvaluesの末尾に追加する。待たずに戻る。
+     *
+     * \return 取り出したメッセージの数
+     */
+    size_t drain(std::vector<DataType> &values, size_t max_size) {
+        if (handler == 0) {
+            return 0;
+        }
+        return func->drain(handler, values, max_size);
+    }
+
+private:
+    PollableSubscriber(const PollableSubscriber &sub) = delete;
+    PollableSubscriber& operator=(const PollableSubscriber &sub) = delete;
+
+private:
+    std::string topic;
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
+    std::shared_ptr<CallbackFuncs<void, DataType>> func; //!< 購読するトピック 購読中は参照を持つので削除されない
+    SubscribeHandler handler = 0; //!< 0は、無効値
+    int notify_fd = -1; //!< 未読のメッセージがある間だけ読み込み可能になるeventfd
+};
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <iostream>
+#include <utility>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QFuture>
+#include <QFutureInterface>
+
+namespace pubsub {
+
+/**
+ * スレッドプールの待ち行列での優先度を指定して実行するタスク
+ *
+ * \detail QtConcurrent::runはQThreadPoolに優先度を渡せないので、QRunnableとしてQThreadPool::start(runnable, priority)に渡す。
+ * 実行の終了は、QtConcurrent::runと同様にQFutureで確認できる。実行後はQThreadPoolが削除する。
+ */
+template<class Function>
+class PriorityTask: public QRunnable {
+public:
+    explicit PriorityTask(Function function) :
+            function(std::move(function)) {
+        result.reportStarted();
+    }
+
+    QFuture<void> future() {
+        return result.future();
+    }
+
+    void run() override {
+        try {
+            function();
+        } catch (...) {
+            result.reportFinished(); //終了を待っている側を止めない
+            throw;
+        }
+        result.reportFinished();
+    }
+
+private:
+    Function function;
+    QFutureInterface<void> result;
+};
+
+/**
+ * 関数をスレッドプールで実行する。priorityの値が大きいほど、待ち行列の先に並ぶ。
+ */
+template<class Function>
+QFuture<void> runWithPriority(QThreadPool *pool, int priority, Function function) {
+    auto *task = new PriorityTask<Function>(std::move(function));
+    auto future = task->future();
+    pool->start(task, priority);
+    return future;
+}
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <utility>
+
+#include "broker.hpp"
+
+namespace pubsub {
+
+/**
+ * まとめて出版する、型付きのメッセージ
+ */
+template<class DataType>
+class BatchMessage: public BatchMessageBase {
+public:
+    BatchMessage(const std::string &topic, DataType value, SendType type) :
+            topic(topic), value(std::move(value)), type(type) {
+    }
+
+    /**
+     * 同じトピックへの次のメッセージとして、再利用できるかどうか
+     */
+    bool sameTopic(const std::string &other_topic, SendType other_type) const {
+        return type == other_type && topic == other_topic;
+    }
+
+    void setValue(DataType new_value) {
+        value = std::move(new_value);
+    }
+
+    std::mutex* resolve(TopicFuncPairList &list) override {
+        func = list.getPublishTarget<DataType>(topic);
+        return (func ? &func->queueMutex() : nullptr);
+    }
+
+    void publishLocked(std::chrono::steady_clock::time_point stamp) override {
+        func->publishLocked(value, type, NO_EXCEPT, stamp);
+    }
+
+private:
+    std::string topic;
+    DataType value;
+    SendType type;
+    CallbackFuncs<void, DataType> *func = nullptr; //!< resolveで見つけたトピック 出版中はブローカーのロックを取得しているので削除されない
+};
+
+/**
+ * 複数のトピックのメッセージを溜めておき、まとめて出版する
+ *
+ * \detail commitは、ブローカーのロックを一度だけ取得し、ディスパッチスレッドも一度だけ起こす。
+ * 全てのトピックのロックを取得してから出版するので、購読者からは全てのメッセージが同時に届いたように見える。
+ * 例えばSnapshotReaderは、一つのバッチの一部だけを読み込むことはない。
+ * 全てのメッセージの出版時刻は同じになるので、許容値0の結合購読で組にできる。
+ *
+ * \code
+ * pubsub::PublishBatch batch;
+ * batch.add("/pose", pose);
+ * batch.add("/velocity", velocity);
+ * batch.commit();
+ * \endcode
+ */
+class PublishBatch {
+public:
+    /**
+     * \param broker 出版先のブローカー。nullptrの場合はデフォルトのブローカー
+     */
+    PublishBatch(BrokerCore *broker = nullptr) :
+            broker(broker) {
+    }
+
+    /**
+     * 出版するメッセージを追加する。同じトピックに複数追加した場合は、追加した順に出版する。
+     *
+     * 前回のcommitと同じ順番で同じトピックに追加した場合は、前回のメッセージの領域を再利用する。
+     */
+    template<class DataType>
+    void add(const std::string &topic, DataType value, SendType type = GLOBAL) {
+        if (count < messages.size()) {
+            auto *message = dynamic_cast<BatchMessage<DataType>*>(messages[count].get());
+            if (message && message->sameTopic(topic, type)) {
+                message->setValue(std::move(value));
+                count++;
+                return;
+            }
+            messages.resize(count); //順番が変わったので、これ以降は再利用しない
+        }
+        messages.emplace_back(new BatchMessage<DataType>(topic, std::move(value), type));
+        count++;
+    }
+
+    /**
+     * 追加したメッセージを出版し、空にする
+     */
+    void commit() {
+        if (count < messages.size()) {
+            messages.resize(count);
+        }
+        Broker::getInstance(broker).publish_batch(messages);
+        count = 0;
+    }
+
+    /**
+     * 追加したメッセージを、出版せずに捨てる
+     */
+    void clear() {
+        messages.clear();
+        count = 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+private:
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
+    std::vector<std::unique_ptr<BatchMessageBase>> messages; //!< 出版待ちのメッセージ 先頭からcount個が有効 残りは再利用のために保持する
+    size_t count = 0; //!< 追加されたメッセージの数
+};
+}
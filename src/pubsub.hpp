@@ -8,24 +8,92 @@ namespace pubsub {
 template<class DataType>
 class Publisher {
 public:
-    Publisher(std::string topic, SendType type = GLOBAL) :
-            topic(topic), type(type) {
+    /**
+     * \param broker 出版先のブローカー。nullptrの場合はデフォルトのブローカー
+     */
+    Publisher(std::string topic, SendType type = GLOBAL, BrokerCore *broker = nullptr) :
+            topic(topic), type(type), broker(broker) {
+        Broker::getInstance(broker).retain_publisher<DataType>(topic);
+    }
+
+    Publisher(const Publisher &pub) :
+            topic(pub.topic), type(pub.type), broker(pub.broker) {
+        Broker::getInstance(broker).retain_publisher<DataType>(topic);
+    }
+
+    ~Publisher() {
+        Broker::getInstance(broker).release_publisher(topic);
+    }
 
+    Publisher& operator=(const Publisher &rhs) {
+        if (this != &rhs) {
+            Broker::getInstance(rhs.broker).retain_publisher<DataType>(rhs.topic);
+            Broker::getInstance(broker).release_publisher(topic);
+            topic = rhs.topic;
+            type = rhs.type;
+            broker = rhs.broker;
+        }
+        return *this;
     }
 
     void publish(const DataType &value) {
-        Broker::getInstance().publish(topic, value, type);
+        Broker::getInstance(broker).publish(topic, value, type);
     }
 
 private:
     std::string topic;
     SendType type;
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
+};
+
+/**
+ * キー付きトピックの出版者
+ *
+ * 一つのトピックに、キーで区別される複数の系列を出版する。メッセージの履歴と最新のメッセージは、キーごとに保持される。
+ */
+template<class Key, class DataType>
+class KeyedPublisher {
+public:
+    /**
+     * \param broker 出版先のブローカー。nullptrの場合はデフォルトのブローカー
+     */
+    KeyedPublisher(std::string topic, BrokerCore *broker = nullptr) :
+            topic(topic), broker(broker) {
+        Broker::getInstance(broker).retain_keyed_publisher<Key, DataType>(topic);
+    }
+
+    KeyedPublisher(const KeyedPublisher &pub) :
+            topic(pub.topic), broker(pub.broker) {
+        Broker::getInstance(broker).retain_keyed_publisher<Key, DataType>(topic);
+    }
+
+    ~KeyedPublisher() {
+        Broker::getInstance(broker).release_publisher(topic);
+    }
+
+    KeyedPublisher& operator=(const KeyedPublisher &rhs) {
+        if (this != &rhs) {
+            Broker::getInstance(rhs.broker).retain_keyed_publisher<Key, DataType>(rhs.topic);
+            Broker::getInstance(broker).release_publisher(topic);
+            topic = rhs.topic;
+            broker = rhs.broker;
+        }
+        return *this;
+    }
+
+    void publish(const Key &key, const DataType &value) {
+        Broker::getInstance(broker).publish_keyed(topic, key, value);
+    }
+
+private:
+    std::string topic;
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
 };
 
 class Subscriber {
 public:
     Subscriber(Subscriber &&sub) :
-            topic(sub.topic), handler(sub.handler) {
+            topic(sub.topic), handler(sub.handler), broker(sub.broker) {
         sub.handler = 0;
     }
 
@@ -40,32 +108,88 @@ public:
         if (handler == 0) {
             return;
         }
-        Broker::getInstance().close_subscribe(topic, handler);
+        Broker::getInstance(broker).close_subscribe(topic, handler);
+        handler = 0;
     }
 
     void pause() {
         if (handler == 0) {
             return;
         }
-        Broker::getInstance().pause_subscribe(topic, handler);
+        Broker::getInstance(broker).pause_subscribe(topic, handler);
     }
 
     void resume() {
         if (handler == 0) {
             return;
         }
-        Broker::getInstance().resume_subscribe(topic, handler);
+        Broker::getInstance(broker).resume_subscribe(topic, handler);
+    }
+
+    /**
+     * 同じトピックの購読の中での優先度を設定する。値が大きいほど先に実行される。
+     */
+    void setPriority(int priority) {
+        if (handler == 0) {
+            return;
+        }
+        Broker::getInstance(broker).set_subscribe_priority(topic, handler, priority);
+    }
+
+    /**
+     * N個に1個のメッセージだけを受信する。1だと全て受信する。
+     *
+     * 間引かれたメッセージは、コピーもコールバックの呼び出しもされない。
+     */
+    void setDecimation(unsigned int decimation) {
+        if (handler == 0) {
+            return;
+        }
+        Broker::getInstance(broker).set_subscribe_decimation(topic, handler, decimation);
+    }
+
+    /**
+     * コールバック関数を呼び出す最小間隔を設定する。0だと制限しない。
+     *
+     * 間隔内に届いたメッセージは、最新のもの以外は読み飛ばされる。
+     */
+    void setMinInterval(std::chrono::nanoseconds interval) {
+        if (handler == 0) {
+            return;
+        }
+        Broker::getInstance(broker).set_subscribe_interval(topic, handler, interval);
+    }
+
+    /**
+     * コールバック関数を呼び出す最大頻度[Hz]を設定する。0以下だと制限しない。
+     */
+    void setMaxRate(double hz) {
+        setMinInterval(hz > 0 ? std::chrono::nanoseconds(static_cast<long long>(1e9 / hz)) : std::chrono::nanoseconds(0));
+    }
+
+    /**
+     * メッセージの有効期間を設定する。0だとトピックの設定に従う。
+     *
+     * 出版から有効期間が過ぎたメッセージは、コピーもコールバックの呼び出しもされずに読み飛ばされる。
+     */
+    void setTimeToLive(std::chrono::nanoseconds ttl) {
+        if (handler == 0) {
+            return;
+        }
+        Broker::getInstance(broker).set_subscribe_ttl(topic, handler, ttl);
     }
 
     pubsub::Subscriber& operator=(pubsub::Subscriber &&rhs) {
+        close();
         topic = rhs.topic;
         handler = rhs.handler;
+        broker = rhs.broker;
         rhs.handler = 0;
         return *this;
     }
 private:
-    Subscriber(std::string topic, int handler) :
-            topic(topic), handler(handler) {
+    Subscriber(std::string topic, SubscribeHandler handler, BrokerCore *broker) :
+            topic(topic), handler(handler), broker(broker) {
     }
 
     Subscriber(const Subscriber &sub) = delete;
@@ -73,21 +197,219 @@ private:
 
 private:
     std::string topic;
+    SubscribeHandler handler = 0; //!< 0は、無効値
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
+    friend class api;
+};
+
+class JoinSubscriber {
+public:
+    JoinSubscriber() {
+    }
+
+    JoinSubscriber(JoinSubscriber &&sub) :
+            handler(sub.handler), broker(sub.broker) {
+        sub.handler = 0;
+    }
+
+    ~JoinSubscriber() {
+        close();
+    }
+
+    void close() {
+        if (handler == 0) {
+            return;
+        }
+        Broker::getInstance(broker).close_join(handler);
+        handler = 0;
+    }
+
+    /**
+     * 購読の開始に成功したかどうか
+     */
+    bool isValid() const {
+        return handler != 0;
+    }
+
+    pubsub::JoinSubscriber& operator=(pubsub::JoinSubscriber &&rhs) {
+        close();
+        handler = rhs.handler;
+        broker = rhs.broker;
+        rhs.handler = 0;
+        return *this;
+    }
+private:
+    JoinSubscriber(unsigned int handler, BrokerCore *broker) :
+            handler(handler), broker(broker) {
+    }
+
+    JoinSubscriber(const JoinSubscriber &sub) = delete;
+    JoinSubscriber(JoinSubscriber &sub) = delete;
+
+private:
+    unsigned int handler = 0; //!< 0は、無効値
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
+    friend class api;
+};
+
+class ServiceServer {
+public:
+    ServiceServer() {
+    }
+
+    ServiceServer(ServiceServer &&srv) :
+            name(srv.name), handler(srv.handler), broker(srv.broker) {
+        srv.handler = 0;
+    }
+
+    ~ServiceServer() {
+        close();
+    }
+
+    void close() {
+        if (handler == 0) {
+            return;
+        }
+        Broker::getInstance(broker).unadvertise_service(name, handler);
+        handler = 0;
+    }
+
+    /**
+     * サービスの登録に成功したかどうか
+     */
+    bool isValid() const {
+        return handler != 0;
+    }
+
+    pubsub::ServiceServer& operator=(pubsub::ServiceServer &&rhs) {
+        close();
+        name = rhs.name;
+        handler = rhs.handler;
+        broker = rhs.broker;
+        rhs.handler = 0;
+        return *this;
+    }
+private:
+    ServiceServer(std::string name, unsigned int handler, BrokerCore *broker) :
+            name(name), handler(handler), broker(broker) {
+    }
+
+    ServiceServer(const ServiceServer &srv) = delete;
+    ServiceServer(ServiceServer &srv) = delete;
+
+private:
+    std::string name;
     unsigned int handler = 0; //!< 0は、無効値
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
     friend class api;
 };
 
+/**
+ * 出版・購読のAPI
+ *
+ * 各関数の引数brokerで、利用するブローカーを指定できる。nullptrの場合はデフォルトのブローカーを利用する。
+ */
 class api {
 public:
     template<class ReturnType, class ClassType, class DataType>
-    static Subscriber subscribe(const std::string &topic, ReturnType (ClassType::*func_ptr)(DataType), ClassType *caller, size_t max_queue_size = 0) {
-        auto handler = Broker::getInstance().subscribe(topic, func_ptr, caller, max_queue_size);
-        return Subscriber(topic, handler);
+    static Subscriber subscribe(const std::string &topic, ReturnType (ClassType::*func_ptr)(DataType), ClassType *caller, size_t max_queue_size = 0, BrokerCore *broker = nullptr) {
+        auto handler = Broker::getInstance(broker).subscribe(topic, func_ptr, caller, max_queue_size);
+        return Subscriber(topic, handler, broker);
+    }
+
+    /**
+     * 出版時刻がtolerance以内に揃った、複数トピックのメッセージの組を購読する
+     *
+     * コールバック関数は、組ごとに一度呼ばれる。組にならなかった古いメッセージは、コピーされずに読み飛ばされる。
+     * toleranceが0の場合は、出版時刻が完全に一致する組だけを受け取る。
+     *
+     * \code
+     * auto sub = pubsub::api::subscribe_join({"/camera", "/lidar"}, &Fusion::onSync, &fusion, std::chrono::milliseconds(5));
+     * \endcode
+     *
+     * \param max_queue_size トピックごとに溜めるメッセージの最大数 0だと無限
+     */
+    template<class ClassType, class... DataTypes>
+    static JoinSubscriber subscribe_join(const std::array<std::string, sizeof...(DataTypes)> &topics, void (ClassType::*func_ptr)(const DataTypes&...), ClassType *caller, std::chrono::nanoseconds tolerance, size_t max_queue_size = 0, BrokerCore *broker = nullptr) {
+        auto handler = Broker::getInstance(broker).subscribe_join(topics, func_ptr, caller, tolerance, max_queue_size);
+        return JoinSubscriber(handler, broker);
+    }
+
+    /**
+     * キー付きトピックを購読する
+     *
+     * コールバック関数には、キーとメッセージが渡される。キーごとのメッセージは出版順に、キーの間では順番に公平に送信される。
+     * 処理が追いつかない場合、あるキーのメッセージは、同じキーの新しいメッセージにだけ押し出される。
+     *
+     * \param conflate trueの場合、キーごとに最新のメッセージだけを受け取る
+     */
+    template<class ClassType, class Key, class DataType>
+    static Subscriber subscribe_keyed(const std::string &topic, void (ClassType::*func_ptr)(const Key&, const DataType&), ClassType *caller, bool conflate = false, BrokerCore *broker = nullptr) {
+        auto handler = Broker::getInstance(broker).subscribe_keyed(topic, func_ptr, caller, conflate);
+        return Subscriber(topic, handler, broker);
+    }
+
+    /**
+     * キー付きトピックの、キーの最新のメッセージを取得する
+     */
+    template<class Key, class DataType>
+    static bool getLatestKeyedData(const std::string &topic, const Key &key, DataType &data, BrokerCore *broker = nullptr) {
+        return Broker::getInstance(broker).getLatestKeyedData(topic, key, data);
     }
 
     template<class DataType>
-    static bool getLatestData(const std::string &topic, DataType &data) {
-        return Broker::getInstance().getLatestData<DataType>(topic, data);
+    static bool getLatestData(const std::string &topic, DataType &data, BrokerCore *broker = nullptr) {
+        return Broker::getInstance(broker).getLatestData<DataType>(topic, data);
+    }
+
+    /**
+     * 最新のメッセージと、出版からの経過時間を取得する
+     */
+    template<class DataType>
+    static bool getLatestData(const std::string &topic, DataType &data, std::chrono::nanoseconds &age, BrokerCore *broker = nullptr) {
+        return Broker::getInstance(broker).getLatestData<DataType>(topic, data, age);
+    }
+
+    /**
+     * サービスを登録する
+     *
+     * \param pool ハンドラを実行するスレッドプール。nullptrの場合は、呼び出し元のスレッドで実行する。
+     */
+    template<class ClassType, class ReqType, class RepType>
+    static ServiceServer advertise_service(const std::string &name, RepType (ClassType::*func_ptr)(const ReqType&), ClassType *caller, QThreadPool *pool = nullptr, BrokerCore *broker = nullptr) {
+        auto handler = Broker::getInstance(broker).advertise_service(name, func_ptr, caller, pool);
+        return ServiceServer(name, handler, broker);
+    }
+
+    /**
+     * サービスを呼び出す
+     *
+     * サービスが見つからない場合は、std::runtime_errorが設定されたfutureを返す。
+     */
+    template<class ReqType, class RepType>
+    static std::future<RepType> call(const std::string &name, const ReqType &req, BrokerCore *broker = nullptr) {
+        return Broker::getInstance(broker).call<ReqType, RepType>(name, req);
+    }
+
+    /**
+     * サービスを呼び出し、レスポンスを待つ
+     *
+     * スレッドプールが設定されていないサービスでも、ハンドラを別のスレッドで実行するので、タイムアウトで戻る。
+     *
+     * \return タイムアウトまでにレスポンスを受け取れた場合はtrue。サービスが見つからない場合や、ハンドラが例外を投げた場合はfalse
+     */
+    template<class ReqType, class RepType>
+    static bool call(const std::string &name, const ReqType &req, RepType &rep, std::chrono::microseconds timeout, BrokerCore *broker = nullptr) {
+        auto future = Broker::getInstance(broker).call<ReqType, RepType>(name, req, true);
+        if (future.wait_for(timeout) != std::future_status::ready) {
+            return false;
+        }
+        try {
+            rep = future.get();
+        } catch (...) {
+            return false;
+        }
+        return true;
     }
 private:
     api() = delete;
@@ -101,12 +423,14 @@ public:
     }
 
     Subscriber_serialized(Subscriber_serialized &&sub) :
-            handler(sub.handler) {
+            handler(sub.handler), broker(sub.broker) {
         sub.handler = 0;
     }
 
     pubsub::Subscriber_serialized& operator=(pubsub::Subscriber_serialized &&rhs) {
+        close();
         handler = rhs.handler;
+        broker = rhs.broker;
         rhs.handler = 0;
         return *this;
     }
@@ -120,33 +444,177 @@ public:
             return;
         }
 
-        Broker::getInstance().close_subscribe_serialized(handler);
+        Broker::getInstance(broker).close_subscribe_serialized(handler);
+        handler = 0;
     }
 
 private:
-    Subscriber_serialized(int handler) :
-            handler(handler) {
+    Subscriber_serialized(int handler, BrokerCore *broker) :
+            handler(handler), broker(broker) {
     }
 private:
     unsigned int handler = 0; //!< 0は、無効値
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
     friend class extra_api;
 };
 
+/**
+ * シリアライズされたメッセージや、トピックの設定を扱うAPI
+ *
+ * 各関数の引数brokerで、利用するブローカーを指定できる。nullptrの場合はデフォルトのブローカーを利用する。
+ */
 class extra_api {
 public:
+    /**
+     * 全トピックのシリアライズされたメッセージを購読する
+     *
+     * 購読を開始した時点で、各トピックの最新のメッセージが一つ受信される。
+     * 購読はブローカー全体で一つの列を観測するので、トピックの数が多くても、購読の開始やトピックの生成は遅くならない。
+     *
+     * \param max_queue_size トピックごとの、未送信のメッセージの最大数 超えた場合は古いものから捨てる 0だと無限
+     * \param except_sender この送信者がpublish_serializedで出版したメッセージは受け取らない
+     */
+    template<class ClassType>
+    static Subscriber_serialized subscribe_serialized(void (ClassType::*func_ptr)(const std::string&, const std::string&), ClassType *caller, size_t max_queue_size = 0, int except_sender = NO_EXCEPT, BrokerCore *broker = nullptr) {
+        int handler = Broker::getInstance(broker).subscribe_serialized(func_ptr, caller, max_queue_size, except_sender);
+        return Subscriber_serialized(handler, broker);
+    }
+
+    /**
+     * filterがtrueを返すトピックの、シリアライズされたメッセージを購読する
+     *
+     * filterは購読の一覧が変わった後、トピックごとに最初の出版時に、出版するスレッドで一度だけ呼ばれる。受け取らないトピックの出版は、コピーもシリアライズもされない。
+     *
+     * \code
+     * auto sub = pubsub::extra_api::subscribe_serialized(&Bridge::onMessage, &bridge, [](const std::string &topic) {return topic.compare(0, 7, "/fleet/") == 0;});
+     * \endcode
+     */
     template<class ClassType>
-    static Subscriber_serialized subscribe_serialized(void (ClassType::*func_ptr)(const std::string&, const std::string&), ClassType *caller, size_t max_queue_size = 0, int except_sender = NO_EXCEPT) {
-        int handler = Broker::getInstance().subscribe_serialized(func_ptr, caller, max_queue_size, except_sender);
-        return Subscriber_serialized(handler);
+    static Subscriber_serialized subscribe_serialized(void (ClassType::*func_ptr)(const std::string&, const std::string&), ClassType *caller, const std::function<bool(const std::string&)> &filter, size_t max_queue_size = 0, int except_sender = NO_EXCEPT, BrokerCore *broker = nullptr) {
+        int handler = Broker::getInstance(broker).subscribe_serialized(func_ptr, caller, max_queue_size, except_sender, filter);
+        return Subscriber_serialized(handler, broker);
     }
 
     template<class DataType, class SerializerType>
-    static void setSerializer(std::string topic) {
-        Broker::getInstance().setSerializer<DataType, SerializerType>(topic);
+    static void setSerializer(std::string topic, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setSerializer<DataType, SerializerType>(topic);
+    }
+
+    static void publish_serialized(std::string topic, const std::string &msg, int sender_id, SendType type = GLOBAL, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).publish_serialized(topic, msg, type, sender_id);
+    }
+
+    /**
+     * トピックの優先度を設定する。優先度の高いトピックから処理される。
+     *
+     * \param deadline 出版からコールバック実行までの期限。同じ優先度のトピックの中では、期限の早いものから処理される。
+     */
+    static void setPriority(std::string topic, int priority, std::chrono::microseconds deadline = std::chrono::microseconds(0), BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setPriority(topic, priority, deadline);
+    }
+
+    /**
+     * トピックのコールバック関数を実行するスレッドプールを設定する。
+     *
+     * 重要なトピックに専用のスレッドプールを割り当てることで、他のトピックのコールバック待ちを回避できる。
+     * nullptrを設定すると、グローバルなスレッドプールに戻る。
+     */
+    static void setThreadPool(std::string topic, QThreadPool *pool, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setThreadPool(topic, pool);
+    }
+
+    /**
+     * トピックのコールバック関数を実行するスレッドを、指定したCPUに固定する。cpusOfNodeで、NUMAノード単位で指定できる。
+     *
+     * スレッドの固定は実行の直前に行うため、setThreadPoolで専用のスレッドプールを割り当てておくと、固定し直す回数が減る。
+     * グローバルなスレッドプールでは、実行後に元のCPUの設定に戻すので、他のトピックのコールバック関数は固定されない。
+     */
+    static void setWorkerAffinity(std::string topic, const CpuSet &cpus, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setWorkerAffinity(topic, cpus);
+    }
+
+    /**
+     * トピックを参照する出版者・購読者がいなくなった後に、最新のメッセージを保持する時間を設定する。
+     *
+     * 保持期間が過ぎたトピックは、メッセージキューと共に削除される。デフォルトは0で、参照がなくなるとすぐに削除される。
+     * std::chrono::milliseconds::max()を設定すると削除されない。
+     */
+    static void setRetention(std::string topic, std::chrono::milliseconds retention, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setRetention(topic, retention);
+    }
+
+    /**
+     * トピックごとの設定(保持期間、優先度、スレッドプール、シリアライザなど)を削除する
+     *
+     * セッションごとのトピック名のように使い捨てるトピックの設定は、使い終わったら削除する。
+     * 生成済みのトピックには設定が残り、再び生成されたトピックには既定値が使われる。
+     * 全ての設定を既定値に戻したトピックの設定は、トピックの削除時に自動的に削除される。
+     */
+    static void clearTopicConfig(std::string topic, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).clearTopicConfig(topic);
+    }
+
+    /**
+     * 設定が残っているトピックの数
+     */
+    static size_t topicConfigCount(BrokerCore *broker = nullptr) {
+        return Broker::getInstance(broker).topicConfigCount();
+    }
+
+    /**
+     * トピックのシリアライズされたメッセージを、直前のメッセージとの差分で符号化する
+     *
+     * subscribe_serializedに渡すメッセージは符号化され、publish_serializedで受け取ったメッセージは送信者ごとに復号される。
+     * 送信側と受信側の両方で有効にする必要がある。少しずつ変化する大きなメッセージで、通信量を大きく減らせる。
+     * 購読ごとに最初のメッセージと、keyframe_interval個ごとのメッセージは、全体を送るキーフレームになる。
+     *
+     * 復号したメッセージの長さは送信者が決めるので、max_message_sizeを超える長さのメッセージは、領域を確保せずに捨てる。
+     *
+     * \param keyframe_interval キーフレームを送る間隔 0だと符号化しない
+     * \param max_message_size 復号後のメッセージの最大の長さ
+     */
+    static void setDeltaCodec(std::string topic, size_t keyframe_interval, size_t max_message_size = DeltaDecoder::DEFAULT_MAX_SIZE, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setDeltaCodec(topic, keyframe_interval, max_message_size);
+    }
+
+    /**
+     * トピックのメッセージを、専用のスレッドがスピンして待つようにする
+     *
+     * 届いたメッセージのコールバック関数は、ディスパッチスレッドとスレッドプールを経由せず、専用のスレッドで直接実行される。
+     * 起床の遅延がなくなる代わりに、有効な間はCPUを一つ占有する。setWorkerAffinityで、専用のスレッドを固定するCPUも指定できる。
+     * 同じトピックのコールバック関数は順に実行されるので、時間のかかる処理には向かない。
+     */
+    static void setBusyPoll(std::string topic, bool enable, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setBusyPoll(topic, enable);
+    }
+
+    /**
+     * トピックのメッセージの有効期間を設定する。0だと期限なし。
+     *
+     * 処理が追いつかず、出版から有効期間が過ぎたメッセージは、コピーもコールバックの呼び出しもされずに読み飛ばされる。
+     * 購読ごとの有効期間は、Subscriber::setTimeToLiveで設定する。
+     */
+    static void setTimeToLive(std::string topic, std::chrono::nanoseconds ttl, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setTimeToLive(topic, ttl);
+    }
+
+    /**
+     * キー付きトピックで、キーごとに保持するメッセージの数を設定する。既定値は1
+     *
+     * 購読の処理が追いつかない場合、キーごとにこの数までのメッセージが送信を待てる。
+     */
+    static void setKeyHistoryDepth(std::string topic, size_t depth, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setKeyHistoryDepth(topic, depth);
     }
 
-    static void publish_serialized(std::string topic, const std::string &msg, int sender_id, SendType type = GLOBAL) {
-        Broker::getInstance().publish_serialized(topic, msg, type, sender_id);
+    /**
+     * キー付きトピックで、最後の出版からtimeoutが過ぎたキーを破棄する。0だと破棄しない。既定値は0
+     *
+     * 破棄したキーは、getLatestKeyedDataで取得できなくなる。未送信のメッセージが残っているキーは、送信されるまで破棄しない。
+     * 破棄するキーの確認は出版時に行い、timeoutに一度だけ全てのキーを走査する。
+     */
+    static void setKeyIdleTimeout(std::string topic, std::chrono::nanoseconds timeout, BrokerCore *broker = nullptr) {
+        Broker::getInstance(broker).setKeyIdleTimeout(topic, timeout);
     }
 private:
     extra_api() = delete;
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+
+namespace pubsub {
+
+class ServiceBase {
+public:
+    virtual ~ServiceBase() {
+    }
+
+    /**
+     * 新しい呼び出しを受け付けないようにする。ServiceListのロックを取得した状態で呼ぶ。
+     */
+    virtual void close() = 0;
+
+    /**
+     * 実行中の呼び出しが全て終わるまで待つ
+     */
+    virtual void waitForFinished() = 0;
+};
+
+/**
+ * リクエストを受け取り、レスポンスを返すサービス
+ *
+ * メッセージキューを経由せず、呼び出し元のスレッド、または指定されたスレッドプールで直接ハンドラを実行する。
+ * 複数の呼び出し元から同時に呼ばれた場合、ハンドラは並行して実行される。
+ */
+template<class ReqType, class RepType>
+class Service: public ServiceBase, public std::enable_shared_from_this<Service<ReqType, RepType>> {
+public:
+    Service(const std::function<RepType(const ReqType&)> &handler, QThreadPool *pool) :
+            handler(handler), pool(pool) {
+    }
+
+    /**
+     * 呼び出しの開始を登録する。ServiceListのロックを取得した状態で呼ぶ。
+     *
+     * 登録の解除と同じロックの中で数えるので、解除後に呼び出しが始まることはない。
+     *
+     * \return 登録が解除されている場合はfalse
+     */
+    bool tryBegin() {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (closed) {
+            return false;
+        }
+        running++;
+        return true;
+    }
+
+    /**
+     * サービスを呼び出す。tryBeginが成功した後に、一度だけ呼ぶ。
+     *
+     * スレッドプールが設定されていない場合は、呼び出し元のスレッドでハンドラを実行し、完了済みのfutureを返す。
+     *
+     * \param async trueの場合、スレッドプールが設定されていなくても、グローバルなスレッドプールで実行する。呼び出し元がタイムアウトで待つ場合に使う。
+     */
+    std::future<RepType> call(const ReqType &req, bool async = false) {
+        auto promise = std::make_shared<std::promise<RepType>>();
+        auto future = promise->get_future();
+
+        if (!pool && !async) {
+            invoke(*promise, req);
+            end();
+        } else {
+            auto self = this->shared_from_this(); //実行中にサービスが破棄されないよう、保持しておく
+            QtConcurrent::run(pool ? pool : QThreadPool::globalInstance(), [self, promise, req]() {
+                self->invoke(*promise, req);
+                self->end();
+            });
+        }
+        return future;
+    }
+
+    void close() override {
+        std::lock_guard<std::mutex> lk(mtx);
+        closed = true;
+    }
+
+    void waitForFinished() override {
+        std::unique_lock<std::mutex> lk(mtx);
+        cond.wait(lk, [&] {return running == 0;});
+    }
+
+private:
+    void invoke(std::promise<RepType> &promise, const ReqType &req) {
+        try {
+            promise.set_value(handler(req));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    }
+
+    void end() {
+        std::lock_guard<std::mutex> lk(mtx);
+        running--;
+        cond.notify_all();
+    }
+
+private:
+    std::function<RepType(const ReqType&)> handler; //!< リクエストを処理する関数
+    QThreadPool *pool = nullptr; //!< ハンドラを実行するスレッドプール nullptrだと呼び出し元のスレッドで実行する
+
+    std::mutex mtx;
+    std::condition_variable cond;
+    unsigned int running = 0; //!< 実行中の呼び出しの数
+    bool closed = false; //!< 登録が解除されたかどうか
+};
+
+/**
+ * サービス名と、サービスのリスト
+ */
+class ServiceList {
+    struct ServiceInfo {
+        std::shared_ptr<ServiceBase> service;
+        unsigned int handler = 0; //!< サービスを停止するためのハンドラ
+    };
+
+public:
+    /**
+     * サービスを登録する
+     *
+     * \return サービスを停止するためのハンドラ。同じ名前のサービスが登録済みの場合は0
+     */
+    template<class ReqType, class RepType>
+    unsigned int advertise(const std::string &name, const std::function<RepType(const ReqType&)> &handler, QThreadPool *pool) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (services.count(name) != 0) {
+            return 0;
+        }
+        ServiceInfo info { std::make_shared<Service<ReqType, RepType>>(handler, pool), ++cur_handler };
+        services.emplace(name, info);
+        return info.handler;
+    }
+
+    /**
+     * サービスの登録を解除する
+     *
+     * 実行中の呼び出しがある場合は、終わるまで待つ。
+     */
+    void unadvertise(const std::string &name, unsigned int handler) {
+        std::shared_ptr<ServiceBase> service;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto itr = services.find(name);
+            if (itr == services.end() || itr->second.handler != handler) {
+                return;
+            }
+            service = itr->second.service;
+            service->close();
+            services.erase(itr);
+        }
+        service->waitForFinished(); //他の呼び出しを止めないよう、ロックの外で待つ
+    }
+
+    /**
+     * サービスを呼び出す
+     *
+     * サービスが見つからない場合や、型が一致しない場合は、例外が設定されたfutureを返す。
+     *
+     * \param async trueの場合、ハンドラを必ず別のスレッドで実行する
+     */
+    template<class ReqType, class RepType>
+    std::future<RepType> call(const std::string &name, const ReqType &req, bool async = false) {
+        std::shared_ptr<Service<ReqType, RepType>> service;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto itr = services.find(name);
+            if (itr != services.end()) {
+                service = std::dynamic_pointer_cast<Service<ReqType, RepType>>(itr->second.service);
+            }
+            if (service && !service->tryBegin()) {
+                service = nullptr;
+            }
+        }
+
+        if (!service) {
+            std::promise<RepType> promise;
+            promise.set_exception(std::make_exception_ptr(std::runtime_error("service not found: " + name)));
+            return promise.get_future();
+        }
+        return service->call(req, async);
+    }
+
+private:
+    std::mutex mtx;
+    std::map<std::string, ServiceInfo> services;
+    unsigned int cur_handler = 0; //!< サービスのハンドラを割り振るための値
+};
+}
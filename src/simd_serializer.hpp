@@ -0,0 +1,383 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+#include "delta_codec.hpp"
+
+namespace pubsub {
+
+/**
+ * 数値配列用のシリアライザで共通して使う処理
+ *
+ * シリアライズ後の形式はリトルエンディアンで統一する。
+ */
+class serializerUtil {
+public:
+    static constexpr bool isLittleEndian() {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return false;
+#else
+        return true;
+#endif
+    }
+
+    /**
+     * 要素をリトルエンディアンに変換しながら書き込む。リトルエンディアンのCPUでは、そのままコピーする。
+     */
+    static void writeLittleEndian(const void *src, size_t elem_size, size_t count, char *dst) {
+        if (isLittleEndian() || elem_size == 1) {
+            std::memcpy(dst, src, elem_size * count);
+            return;
+        }
+        auto *bytes = static_cast<const char*>(src);
+        for (size_t idx = 0; idx < count; ++idx) {
+            std::reverse_copy(bytes + idx * elem_size, bytes + (idx + 1) * elem_size, dst + idx * elem_size);
+        }
+    }
+
+    static void readLittleEndian(const char *src, size_t elem_size, size_t count, void *dst) {
+        if (isLittleEndian() || elem_size == 1) {
+            std::memcpy(dst, src, elem_size * count);
+            return;
+        }
+        auto *bytes = static_cast<char*>(dst);
+        for (size_t idx = 0; idx < count; ++idx) {
+            std::reverse_copy(src + idx * elem_size, src + (idx + 1) * elem_size, bytes + idx * elem_size);
+        }
+    }
+
+    template<class T>
+    static void writeValue(T value, std::string &out) {
+        size_t pos = out.size();
+        out.resize(pos + sizeof(T));
+        writeLittleEndian(&value, sizeof(T), 1, &out[pos]);
+    }
+
+    /**
+     * \return データが足りない場合はfalse
+     */
+    template<class T>
+    static bool readValue(const std::string &msg, size_t &pos, T &value) {
+        if (msg.size() < pos + sizeof(T)) {
+            return false;
+        }
+        readLittleEndian(msg.data() + pos, sizeof(T), 1, &value);
+        pos += sizeof(T);
+        return true;
+    }
+};
+
+/**
+ * 数値の配列や、固定レイアウトの構造体を、メモリ上の表現のままシリアライズする
+ *
+ * \detail std::vector<T>は、要素数(uint64_t)に続けて要素を格納する。それ以外の型はそのまま格納する。
+ * 数値の配列は、ビッグエンディアンのCPUでもリトルエンディアンに変換するので、異なるCPU間でもやり取りできる。
+ * 構造体はバイト列をそのままコピーするため、同じレイアウトを持つ環境同士でのみ利用できる。
+ *
+ * \code
+ * pubsub::extra_api::setSerializer<std::vector<float>, pubsub::arraySerializer>("joint_states");
+ * \endcode
+ */
+class arraySerializer {
+public:
+    template<class DataType>
+    std::string serialize(DataType &data) {
+        std::string out;
+        encode(data, out);
+        return out;
+    }
+
+    template<class DataType>
+    DataType deserialize(const std::string &msg) {
+        DataType data {};
+        decode(msg, data);
+        return data;
+    }
+
+private:
+    template<class T>
+    static void encode(const std::vector<T> &data, std::string &out) {
+        static_assert(std::is_arithmetic<T>::value, "arraySerializer supports vectors of arithmetic types");
+        serializerUtil::writeValue<uint64_t>(data.size(), out);
+        size_t pos = out.size();
+        out.resize(pos + data.size() * sizeof(T));
+        serializerUtil::writeLittleEndian(data.data(), sizeof(T), data.size(), &out[pos]);
+    }
+
+    template<class T>
+    static void decode(const std::string &msg, std::vector<T> &data) {
+        size_t pos = 0;
+        uint64_t size = 0;
+        if (!serializerUtil::readValue(msg, pos, size) || (msg.size() - pos) / sizeof(T) < size) {
+            return;
+        }
+        data.resize(size);
+        serializerUtil::readLittleEndian(msg.data() + pos, sizeof(T), size, data.data());
+    }
+
+    template<class T>
+    static void encode(const T &data, std::string &out) {
+        static_assert(std::is_trivially_copyable<T>::value, "arraySerializer supports trivially copyable types");
+        out.assign(reinterpret_cast<const char*>(&data), sizeof(T));
+    }
+
+    template<class T>
+    static void decode(const std::string &msg, T &data) {
+        if (msg.size() == sizeof(T)) {
+            std::memcpy(&data, msg.data(), sizeof(T));
+        }
+    }
+};
+
+/**
+ * 浮動小数点数の配列を、最小値と最大値の間を16bitに量子化してシリアライズする
+ *
+ * \detail 要素数(uint64_t)、最小値(float)、量子化の幅(float)に続けて、要素ごとにuint16_tを格納する。
+ * 誤差は最大で(最大値 - 最小値) / 131070。データ量はfloatの半分、doubleの1/4になる。
+ * AVX2やSSE4.1が有効な場合は、8要素または4要素ずつまとめて変換する。
+ */
+class quantizedSerializer {
+public:
+    template<class DataType>
+    std::string serialize(DataType &data) {
+        std::string out;
+        encode(data, out);
+        return out;
+    }
+
+    template<class DataType>
+    DataType deserialize(const std::string &msg) {
+        DataType data {};
+        decode(msg, data);
+        return data;
+    }
+
+private:
+    template<class T>
+    static void encode(const std::vector<T> &data, std::string &out) {
+        static_assert(std::is_floating_point<T>::value, "quantizedSerializer supports vectors of floating point types");
+        float min = 0, max = 0;
+        if (!data.empty()) {
+            auto range = std::minmax_element(data.begin(), data.end());
+            min = static_cast<float>(*range.first);
+            max = static_cast<float>(*range.second);
+        }
+        float step = (max > min ? (max - min) / 65535.0f : 1.0f);
+
+        serializerUtil::writeValue<uint64_t>(data.size(), out);
+        serializerUtil::writeValue(min, out);
+        serializerUtil::writeValue(step, out);
+
+        std::vector<uint16_t> quantized(data.size());
+        quantize(data.data(), data.size(), min, 1.0f / step, quantized.data());
+        size_t pos = out.size();
+        out.resize(pos + quantized.size() * sizeof(uint16_t));
+        serializerUtil::writeLittleEndian(quantized.data(), sizeof(uint16_t), quantized.size(), &out[pos]);
+    }
+
+    template<class T>
+    static void decode(const std::string &msg, std::vector<T> &data) {
+        size_t pos = 0;
+        uint64_t size = 0;
+        float min = 0, step = 0;
+        if (!serializerUtil::readValue(msg, pos, size) || !serializerUtil::readValue(msg, pos, min) || !serializerUtil::readValue(msg, pos, step)
+                || (msg.size() - pos) / sizeof(uint16_t) < size) {
+            return;
+        }
+
+        std::vector<uint16_t> quantized(size);
+        serializerUtil::readLittleEndian(msg.data() + pos, sizeof(uint16_t), size, quantized.data());
+        data.resize(size);
+        dequantize(quantized.data(), size, min, step, data.data());
+    }
+
+    static uint16_t quantizeOne(float value, float min, float inv_step) {
+        float q = std::nearbyint((value - min) * inv_step);
+        return static_cast<uint16_t>(std::min(65535.0f, std::max(0.0f, q)));
+    }
+
+    static void quantize(const float *src, size_t size, float min, float inv_step, uint16_t *dst) {
+        size_t idx = 0;
+#if defined(__AVX2__)
+        const __m256 vmin = _mm256_set1_ps(min);
+        const __m256 vinv = _mm256_set1_ps(inv_step);
+        const __m256i vzero = _mm256_setzero_si256();
+        const __m256i vmax = _mm256_set1_epi32(65535);
+        for (; idx + 8 <= size; idx += 8) {
+            __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(src + idx), vmin), vinv));
+            q = _mm256_min_epi32(_mm256_max_epi32(q, vzero), vmax);
+            //レーンごとに16bitへ詰めた後、下位128bitに並べる
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(q, q), 0x08);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + idx), _mm256_castsi256_si128(packed));
+        }
+#elif defined(__SSE4_1__)
+        const __m128 vmin = _mm_set1_ps(min);
+        const __m128 vinv = _mm_set1_ps(inv_step);
+        for (; idx + 4 <= size; idx += 4) {
+            __m128i q = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + idx), vmin), vinv));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + idx), _mm_packus_epi32(q, q));
+        }
+#endif
+        for (; idx < size; ++idx) {
+            dst[idx] = quantizeOne(src[idx], min, inv_step);
+        }
+    }
+
+    static void quantize(const double *src, size_t size, float min, float inv_step, uint16_t *dst) {
+        for (size_t idx = 0; idx < size; ++idx) {
+            dst[idx] = quantizeOne(static_cast<float>(src[idx]), min, inv_step);
+        }
+    }
+
+    static void dequantize(const uint16_t *src, size_t size, float min, float step, float *dst) {
+        size_t idx = 0;
+#if defined(__AVX2__)
+        const __m256 vmin = _mm256_set1_ps(min);
+        const __m256 vstep = _mm256_set1_ps(step);
+        for (; idx + 8 <= size; idx += 8) {
+            __m256i q = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + idx)));
+            _mm256_storeu_ps(dst + idx, _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(q), vstep), vmin));
+        }
+#elif defined(__SSE4_1__)
+        const __m128 vmin = _mm_set1_ps(min);
+        const __m128 vstep = _mm_set1_ps(step);
+        for (; idx + 4 <= size; idx += 4) {
+            __m128i q = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + idx)));
+            _mm_storeu_ps(dst + idx, _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(q), vstep), vmin));
+        }
+#endif
+        for (; idx < size; ++idx) {
+            dst[idx] = src[idx] * step + min;
+        }
+    }
+
+    static void dequantize(const uint16_t *src, size_t size, float min, float step, double *dst) {
+        for (size_t idx = 0; idx < size; ++idx) {
+            dst[idx] = static_cast<double>(src[idx]) * step + min;
+        }
+    }
+};
+
+/**
+ * 整数の配列を、可変長整数で詰めてシリアライズする
+ *
+ * \detail 要素数に続けて、要素ごとに可変長整数(7bitずつ、最上位bitが継続を表す)を格納する。
+ * 符号付き整数はジグザグ符号化((x << 1) ^ (x >> 63))して、絶対値の小さい負の数も短くなるようにする。
+ * 小さい値の多い配列ほど小さくなる。AVX2が有効な場合は、32bit以下の整数で8要素全てが1byteに収まる区間をまとめて変換する。
+ */
+class varintSerializer {
+public:
+    template<class DataType>
+    std::string serialize(DataType &data) {
+        std::string out;
+        encode(data, out);
+        return out;
+    }
+
+    template<class DataType>
+    DataType deserialize(const std::string &msg) {
+        DataType data {};
+        decode(msg, data);
+        return data;
+    }
+
+private:
+    template<class T>
+    static void encode(const std::vector<T> &data, std::string &out) {
+        static_assert(std::is_integral<T>::value, "varintSerializer supports vectors of integral types");
+        out.reserve(data.size() + 10);
+        RunLengthCompressor::writeVarint(data.size(), out);
+
+        size_t idx = 0;
+#if defined(__AVX2__)
+        if (sizeof(T) == 4) {
+            idx = encodeShortRuns(reinterpret_cast<const int32_t*>(data.data()), data.size(), std::is_signed<T>::value, out);
+        }
+#endif
+        for (; idx < data.size(); ++idx) {
+            RunLengthCompressor::writeVarint(zigzag(data[idx]), out);
+        }
+    }
+
+    template<class T>
+    static void decode(const std::string &msg, std::vector<T> &data) {
+        size_t pos = 0;
+        uint64_t size = 0;
+        if (!RunLengthCompressor::readVarint(msg.data(), msg.size(), pos, size) || msg.size() - pos < size) { //1要素は最低1byte
+            return;
+        }
+
+        data.resize(size);
+        for (size_t idx = 0; idx < size; ++idx) {
+            if (pos >= msg.size()) { //複数byteの要素があると、要素数の確認だけでは足りない
+                data.clear();
+                return;
+            }
+            //1byteに収まっている値が多いので、先に判定する
+            uint64_t value = static_cast<uint8_t>(msg[pos]);
+            if (value < 0x80) {
+                pos++;
+            } else if (!RunLengthCompressor::readVarint(msg.data(), msg.size(), pos, value)) {
+                data.clear();
+                return;
+            }
+            data[idx] = unzigzag<T>(value);
+        }
+    }
+
+#if defined(__AVX2__)
+    /**
+     * 先頭から、8要素全てが1byteに収まる区間を変換する
+     *
+     * \return 変換した要素数
+     */
+    static size_t encodeShortRuns(const int32_t *src, size_t size, bool is_signed, std::string &out) {
+        const __m256i high_bits = _mm256_set1_epi32(~0x7f);
+        size_t idx = 0;
+        for (; idx + 8 <= size; idx += 8) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + idx));
+            if (is_signed) {
+                v = _mm256_xor_si256(_mm256_slli_epi32(v, 1), _mm256_srai_epi32(v, 31));
+            }
+            if (!_mm256_testz_si256(v, high_bits)) {
+                break;
+            }
+            __m256i packed16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+            __m128i packed8 = _mm_packus_epi16(_mm256_castsi256_si128(packed16), _mm256_castsi256_si128(packed16));
+            char bytes[16];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes), packed8);
+            out.append(bytes, 8);
+        }
+        return idx;
+    }
+#endif
+
+    template<class T>
+    static uint64_t zigzag(T value) {
+        if (std::is_signed<T>::value) {
+            int64_t v = static_cast<int64_t>(value);
+            return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+        }
+        return static_cast<uint64_t>(value);
+    }
+
+    template<class T>
+    static T unzigzag(uint64_t value) {
+        if (std::is_signed<T>::value) {
+            return static_cast<T>(static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1)));
+        }
+        return static_cast<T>(value);
+    }
+};
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <array>
+#include <tuple>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <algorithm>
+
+#include "broker.hpp"
+
+namespace pubsub {
+
+/**
+ * 複数トピックの最新のメッセージを、互いに矛盾のない組として読み込む
+ *
+ * \detail 生成時にトピックのハンドルを取得しておき、readではブローカーのロックを取らない。
+ * readは全てのトピックのロックをアドレスの小さい順に取得してから読み込むので、読み込み中にこれらのトピックへの出版は割り込まない。
+ * 読み込んだ組は、出版順のある一時点での各トピックの最新のメッセージになる。
+ * 読み込み中は、これらのトピックへの出版が待たされる。
+ *
+ * 出力先はreadの呼び出し側が持つので、同じ変数を使い回せば、std::vectorなどの領域は再確保されない。
+ *
+ * \code
+ * pubsub::SnapshotReader<int, std::vector<double>> reader({"/mode", "/joints"});
+ * int mode;
+ * std::vector<double> joints;
+ * while (running) {
+ *     reader.read(mode, joints);
+ * }
+ * \endcode
+ */
+template<class... DataTypes>
+class SnapshotReader {
+    using Indices = std::index_sequence_for<DataTypes...>;
+    static constexpr size_t N = sizeof...(DataTypes);
+
+public:
+    /**
+     * \param broker 読み込むブローカー。nullptrの場合はデフォルトのブローカー
+     */
+    SnapshotReader(const std::array<std::string, N> &topics, BrokerCore *broker = nullptr) :
+            topics(topics), broker(broker) {
+        valid = retainAll(Indices());
+        if (!valid) {
+            return;
+        }
+
+        //同じトピックが複数含まれていても、ロックは一度だけ取得する
+        lock_order.assign(mutexes.begin(), mutexes.end());
+        std::sort(lock_order.begin(), lock_order.end());
+        lock_order.erase(std::unique(lock_order.begin(), lock_order.end()), lock_order.end());
+    }
+
+    ~SnapshotReader() {
+        releaseAll(Indices());
+    }
+
+    /**
+     * 全てのトピックを参照できたかどうか。型の一致しないトピックがあった場合はfalse
+     */
+    bool isValid() const {
+        return valid;
+    }
+
+    /**
+     * 各トピックの最新のメッセージを読み込む
+     *
+     * メッセージがまだないトピックの出力先は変更しない。
+     *
+     * \return 全てのトピックのメッセージを読み込めた場合はtrue
+     */
+    bool read(DataTypes&... outputs) {
+        if (!valid) {
+            return false;
+        }
+        for (auto *mutex : lock_order) {
+            mutex->lock();
+        }
+        bool ret = readAll(std::tie(outputs...), Indices());
+        for (auto itr = lock_order.rbegin(); itr != lock_order.rend(); ++itr) {
+            (*itr)->unlock();
+        }
+        return ret;
+    }
+
+private:
+    template<size_t... I>
+    bool retainAll(std::index_sequence<I...>) {
+        auto &core = Broker::getInstance(broker);
+        int dummy[] = { 0, (std::get<I>(funcs) = core.template retain_topic<DataTypes>(topics[I]), 0)... };
+        (void)dummy;
+        bool found[] = { (std::get<I>(funcs) != nullptr)... };
+        int dummy2[] = { 0, (mutexes[I] = (std::get<I>(funcs) ? &std::get<I>(funcs)->queueMutex() : nullptr), 0)... };
+        (void)dummy2;
+        return std::all_of(std::begin(found), std::end(found), [](bool f) {return f;});
+    }
+
+    template<size_t... I>
+    void releaseAll(std::index_sequence<I...>) {
+        auto &core = Broker::getInstance(broker);
+        int dummy[] = { 0, (std::get<I>(funcs) ? (core.release_topic(topics[I]), 0) : 0)... };
+        (void)dummy;
+    }
+
+    template<size_t... I>
+    bool readAll(std::tuple<DataTypes&...> outputs, std::index_sequence<I...>) {
+        bool found[] = { std::get<I>(funcs)->getLatestDataLocked(std::get<I>(outputs))... };
+        return std::all_of(std::begin(found), std::end(found), [](bool f) {return f;});
+    }
+
+    SnapshotReader(const SnapshotReader &reader) = delete;
+    SnapshotReader& operator=(const SnapshotReader &reader) = delete;
+
+private:
+    std::array<std::string, N> topics;
+    BrokerCore *broker = nullptr; //!< nullptrは、デフォルトのブローカー
+    std::tuple<std::shared_ptr<CallbackFuncs<void, DataTypes>>...> funcs; //!< 各トピックのハンドル
+    std::array<std::mutex*, N> mutexes; //!< 各トピックのロック
+    std::vector<std::mutex*> lock_order; //!< ロックを取得する順番 アドレスの小さい順
+    bool valid = false;
+};
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+
+namespace pubsub {
+
+/**
+ * スピン待ちの1回分、CPUに待機中であることを伝える
+ *
+ * \detail x86のpause命令は、ハイパースレッドの相手に実行資源を譲り、ループ脱出時のパイプラインの破棄を抑える。
+ */
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+/**
+ * スピン待ちの間隔を、待った回数に応じて伸ばす
+ *
+ * 最初のSPIN_LIMIT回はpause命令で待ち、それ以降はOSに実行を譲る。
+ */
+class SpinBackoff {
+public:
+    void pause() {
+        if (count < SPIN_LIMIT) {
+            cpuRelax();
+        } else {
+            std::this_thread::yield();
+        }
+        count++;
+    }
+
+    void reset() {
+        count = 0;
+    }
+
+    /**
+     * resetしてから待った回数
+     */
+    unsigned long spins() const {
+        return count;
+    }
+
+private:
+    static constexpr unsigned long SPIN_LIMIT = 256; //!< pause命令で待つ回数
+    unsigned long count = 0;
+};
+}
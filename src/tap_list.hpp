@@ -0,0 +1,365 @@
+#pragma once
+
+#include <iostream>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <utility>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+
+#include "callback_funcs_base.hpp"
+#include "delta_codec.hpp"
+#include "serializer_holder.hpp"
+
+namespace pubsub {
+
+/**
+ * タップに流すメッセージの内容。送信するときに初めてシリアライズする。
+ *
+ * \detail 一つのメッセージを複数のタップで共有し、シリアライズは最初に必要になったときに一度だけ行う。
+ * 送信しないメッセージは、シリアライズされない。
+ */
+class TapPayload {
+public:
+    virtual ~TapPayload() {
+    }
+
+    /**
+     * シリアライズしたメッセージを取得する。複数のスレッドから同時に呼ばれてもよい。
+     */
+    const std::string& serialized() {
+        std::call_once(once, [this]() {
+            data = serialize();
+        });
+        return data;
+    }
+
+protected:
+    virtual std::string serialize() = 0;
+
+private:
+    std::once_flag once;
+    std::string data; //!< シリアライズしたメッセージ
+};
+
+/**
+ * 型付きのメッセージのコピーと、それをシリアライズするシリアライザを持つ内容
+ */
+template<class DataType>
+class TypedTapPayload: public TapPayload {
+public:
+    TypedTapPayload(const DataType &value, std::shared_ptr<SerializerHolderBase<DataType>> serializer) :
+            value(value), serializer(std::move(serializer)) {
+    }
+
+protected:
+    std::string serialize() override {
+        return serializer->serialize(value);
+    }
+
+private:
+    DataType value;
+    std::shared_ptr<SerializerHolderBase<DataType>> serializer; //!< 出版時のシリアライザ 差し替えられても、送信し終えるまで破棄されない
+};
+
+/**
+ * タップから見た、トピックごとの状態。TapListのロックで保護する。
+ *
+ * トピックが持ち、列のメッセージからも参照されるので、トピックが破棄されても送信し終えるまで残る。
+ */
+struct TapTopic {
+    explicit TapTopic(const std::string &name) :
+            name(name) {
+    }
+
+    const std::string name; //!< トピック名
+    unsigned long latest = 0; //!< 最後に列に追加したメッセージの、トピック内の通し番号
+    unsigned long version = 0; //!< interestを求めたときの、タップの一覧の版 0は未計算
+    std::vector<std::pair<unsigned int, int>> interest; //!< このトピックを受け取るタップのハンドラと、除く送信者
+};
+
+/**
+ * 全トピックの出版を観測する購読に流すメッセージ
+ */
+struct TapMessage {
+    std::shared_ptr<TapTopic> topic;
+    std::shared_ptr<TapPayload> payload; //!< 全ての購読で共有する
+    int sender_id; //!< メッセージの送信者
+    size_t keyframe_interval; //!< 出版時のトピックの差分符号化のキーフレーム間隔 0だと符号化しない
+    unsigned long seq; //!< 列の上の通し番号
+    unsigned long topic_index; //!< トピック内の通し番号
+};
+
+/**
+ * 全トピックの出版を観測する購読(タップ)の一覧
+ *
+ * \detail GLOBALで出版されたメッセージは、受け取るタップがある場合に限り、コピーを一本の列に追加する。
+ * 受け取るかどうかはトピックごとに、タップの一覧が変わった後の最初の出版で求めておくので、受け取るタップのないトピックの出版はコピーもされない。
+ * シリアライズは出版時ではなく、送信するタスクの中で一度だけ行い、全てのタップで共有する。
+ * 各タップは列の上の読み込み位置だけを持つので、トピックの数とタップの数が増えても、費用は掛け算ではなく足し算で増える。
+ *
+ * 未送信のメッセージの最大数は、トピックごとに数える。送信時に、同じトピックの新しいメッセージが最大数以上ある古いメッセージは読み飛ばす。
+ * 全てのタップが読み終えたメッセージは、列から削除する。
+ * 読み終えていないタップがあっても、どのタップにも送信されないメッセージは、列が前回の倍の長さになるたびにまとめて削除する。
+ *
+ * コールバック関数は、グローバルなスレッドプールで、タップごとに一つずつ順に実行する。
+ */
+class TapList {
+    struct Tap {
+        std::function<void(const std::string&, const std::string&)> func; //!< コールバック関数 トピック名とメッセージを受け取る
+        std::function<bool(const std::string&)> filter; //!< 受け取るトピックを選ぶ関数 nullptrだと全てのトピック
+        int except_sender = NO_EXCEPT; //!< この送信者のメッセージは受け取らない
+        size_t max_queue_size = 0; //!< トピックごとの、未送信のメッセージの最大数 0だと無限
+        unsigned long next_seq = 0; //!< 次に送信する、列の上のメッセージの通し番号
+        std::deque<TapMessage> seeds; //!< 購読開始時に送る、各トピックの最新のメッセージ
+        std::shared_ptr<std::map<std::string, DeltaEncoder>> encoders = std::make_shared<std::map<std::string, DeltaEncoder>>(); //!< トピックごとの、直前に送ったメッセージ 送信中のタスクと共有する
+        QFuture<void> future; //!< コールバック実行結果取得
+    };
+
+public:
+    ~TapList() {
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto &tap : taps) {
+            if (tap.second.future.isRunning()) {
+                tap.second.future.waitForFinished();
+            }
+        }
+    }
+
+    /**
+     * タップがあるかどうか。ない場合、出版時にロックを取らない。
+     */
+    bool enabled() const {
+        return tap_count.load(std::memory_order_acquire) != 0;
+    }
+
+    /**
+     * タップを登録する
+     *
+     * \param seeds 購読開始時に送る、各トピックの最新のメッセージ
+     * \return タップを特定するハンドラ
+     */
+    unsigned int subscribe(const std::function<void(const std::string&, const std::string&)> &func, const std::function<bool(const std::string&)> &filter, size_t max_queue_size, int except_sender, std::deque<TapMessage> &&seeds) {
+        std::lock_guard<std::mutex> lk(mtx);
+        Tap tap;
+        tap.func = func;
+        tap.filter = filter;
+        tap.except_sender = except_sender;
+        tap.max_queue_size = max_queue_size;
+        tap.next_seq = end_seq;
+        tap.seeds = std::move(seeds);
+        unsigned int handler = ++cur_handler;
+        taps.emplace(handler, std::move(tap));
+        version++;
+        tap_count.store(taps.size(), std::memory_order_release);
+        return handler;
+    }
+
+    /**
+     * タップを削除する。ロックを解放してから、実行中のコールバック関数の終了を待つ。
+     */
+    void close(unsigned int handler) {
+        QFuture<void> future;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            auto itr = taps.find(handler);
+            if (itr == taps.end()) {
+                return;
+            }
+            future = itr->second.future;
+            taps.erase(itr);
+            version++;
+            tap_count.store(taps.size(), std::memory_order_release);
+            trim();
+        }
+        if (future.isRunning()) {
+            future.waitForFinished();
+        }
+    }
+
+    /**
+     * 出版されたメッセージを、受け取るタップがある場合に列に追加する。トピックのロックを取得した状態で呼ばれる。
+     *
+     * \param make_payload メッセージの内容を生成する関数 受け取るタップがない場合は呼ばない
+     */
+    template<class MakePayload>
+    void push(const std::shared_ptr<TapTopic> &topic, int sender_id, size_t keyframe_interval, MakePayload make_payload) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (taps.empty()) {
+            return;
+        }
+        if (topic->version != version) {
+            updateInterest(*topic);
+        }
+        auto itr = std::find_if(topic->interest.begin(), topic->interest.end(), [sender_id](const std::pair<unsigned int, int> &interest) {
+            return interest.second == NO_EXCEPT || interest.second != sender_id;
+        });
+        if (itr == topic->interest.end()) {
+            return; //受け取るタップがないので、コピーもしない
+        }
+
+        stream.push_back(TapMessage { topic, make_payload(), sender_id, keyframe_interval, end_seq++, ++topic->latest });
+        if (stream.size() >= compact_threshold) {
+            compact();
+        }
+    }
+
+    /**
+     * 各タップに対して、未送信のメッセージがある場合は、まとめてコールバック関数を呼び出す
+     *
+     * \detail 実行中でないタップごとに、最大MAX_BATCH個のメッセージを一つのタスクにまとめてスレッドプールに投入する。
+     * タスクは順にシリアライズとコールバック関数の呼び出しを行うので、タップの中では出版順が保たれる。
+     *
+     * \return コールバック関数実行中かどうか
+     */
+    bool callOnce() {
+        if (!enabled()) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lk(mtx);
+        bool processing = false;
+        bool advanced = false;
+        for (auto &tap : taps) {
+            auto &info = tap.second;
+            if (!info.future.isFinished()) {
+                processing = true;
+                continue;
+            }
+
+            std::vector<TapMessage> batch;
+            while (!info.seeds.empty() && batch.size() < MAX_BATCH) {
+                if (info.except_sender == NO_EXCEPT || info.seeds.front().sender_id != info.except_sender) {
+                    batch.push_back(std::move(info.seeds.front()));
+                }
+                info.seeds.pop_front();
+            }
+            if (info.next_seq < end_seq) {
+                auto itr = std::lower_bound(stream.begin(), stream.end(), info.next_seq, [](const TapMessage &msg, unsigned long seq) {return msg.seq < seq;});
+                for (; itr != stream.end() && batch.size() < MAX_BATCH; ++itr) {
+                    info.next_seq = itr->seq + 1;
+                    if (accepts(tap.first, info, *itr)) {
+                        batch.push_back(*itr);
+                    }
+                }
+                if (itr == stream.end()) {
+                    info.next_seq = end_seq;
+                }
+                advanced = true;
+            }
+            if (batch.empty()) {
+                continue;
+            }
+
+            auto function = info.func;
+            auto encoders = info.encoders;
+            info.future = QtConcurrent::run(QThreadPool::globalInstance(), [function, encoders, batch]() {
+                for (auto &msg : batch) {
+                    auto &payload = msg.payload->serialized();
+                    if (msg.keyframe_interval == 0) {
+                        if (!encoders->empty()) {
+                            encoders->erase(msg.topic->name); //再び有効になった場合は、キーフレームから始める
+                        }
+                        function(msg.topic->name, payload);
+                    } else {
+                        function(msg.topic->name, (*encoders)[msg.topic->name].encode(payload, msg.keyframe_interval));
+                    }
+                }
+            });
+            processing = true;
+        }
+        if (advanced) {
+            trim();
+        }
+        return processing;
+    }
+
+private:
+    /**
+     * トピックを受け取るタップの一覧を求め直す。タップの一覧が変わった後、トピックごとに一度だけ呼ばれる。
+     */
+    void updateInterest(TapTopic &topic) {
+        topic.interest.clear();
+        for (auto &tap : taps) {
+            if (!tap.second.filter || tap.second.filter(topic.name)) {
+                topic.interest.emplace_back(tap.first, tap.second.except_sender);
+            }
+        }
+        topic.version = version;
+    }
+
+    /**
+     * タップが列のメッセージを受け取るかどうか
+     *
+     * メッセージを追加した後にタップの一覧が変わっても、新しいタップは追加済みのメッセージを読まないので、トピックのinterestで判定できる。
+     */
+    bool accepts(unsigned int handler, const Tap &tap, const TapMessage &msg) const {
+        if (tap.except_sender != NO_EXCEPT && msg.sender_id == tap.except_sender) {
+            return false;
+        }
+        if (tap.max_queue_size != 0 && msg.topic->latest - msg.topic_index >= tap.max_queue_size) {
+            return false; //同じトピックの新しいメッセージに押し出された
+        }
+        for (auto &interest : msg.topic->interest) {
+            if (interest.first == handler) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * 全てのタップが読み終えたメッセージを、列から削除する
+     */
+    void trim() {
+        unsigned long min_seq = end_seq;
+        for (auto &tap : taps) {
+            min_seq = std::min(min_seq, tap.second.next_seq);
+        }
+        while (!stream.empty() && stream.front().seq < min_seq) {
+            stream.pop_front();
+        }
+    }
+
+    /**
+     * どのタップにも送信されないメッセージを、列から削除する
+     *
+     * \detail 同じトピックの新しいメッセージが、全てのタップの最大数のうち最大のもの以上あるメッセージは、どのタップも読み飛ばす。
+     * 削除した後の列の倍の長さになるまで次の削除を行わないので、メッセージごとの費用は定数になる。
+     */
+    void compact() {
+        size_t limit = 0;
+        for (auto &tap : taps) {
+            if (tap.second.max_queue_size == 0) {
+                limit = 0;
+                break;
+            }
+            limit = std::max(limit, tap.second.max_queue_size);
+        }
+        if (limit != 0) {
+            stream.erase(std::remove_if(stream.begin(), stream.end(), [limit](const TapMessage &msg) {
+                return msg.topic->latest - msg.topic_index >= limit;
+            }), stream.end());
+        }
+        compact_threshold = std::max(MIN_COMPACT_THRESHOLD, stream.size() * 2);
+    }
+
+private:
+    static constexpr size_t MAX_BATCH = 64; //!< 一つのタスクで送信するメッセージの最大数
+    static constexpr size_t MIN_COMPACT_THRESHOLD = 1024; //!< 送信されないメッセージを削除する、列の長さの最小値
+    std::mutex mtx;
+    std::map<unsigned int, Tap> taps; //!< タップの一覧
+    std::atomic<size_t> tap_count { 0 }; //!< タップの数 ロックを取らずに確認するために持つ
+    unsigned int cur_handler = 0; //!< タップを特定するハンドラ
+    unsigned long version = 1; //!< タップの一覧の版 変わるたびに増やす
+    std::deque<TapMessage> stream; //!< 未送信のタップがあるメッセージの列 通し番号の順
+    unsigned long end_seq = 0; //!< 次に追加するメッセージの通し番号
+    size_t compact_threshold = MIN_COMPACT_THRESHOLD; //!< 列がこの長さになったら、送信されないメッセージを削除する
+};
+}
@@ -2,71 +2,477 @@
 
 #include <iostream>
 #include <map>
+#include <deque>
 #include <string>
 #include <functional>
 #include <type_traits>
+#include <vector>
+#include <array>
+#include <memory>
+#include <utility>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
 
 #include "default_serializer.hpp"
 #include "callback_funcs.hpp"
+#include "keyed_callback_funcs.hpp"
+#include "join.hpp"
 
 namespace pubsub {
+
+class TopicFuncPairList;
+
+/**
+ * まとめて出版するメッセージの一つ
+ *
+ * \detail 型ごとの実装はpublish_batch.hppのBatchMessage
+ */
+class BatchMessageBase {
+public:
+    virtual ~BatchMessageBase() {
+    }
+
+    /**
+     * 出版先のトピックを探し、そのロックを返す。トピックがなければ生成する。ブローカーのロックを取得した状態で呼ぶ。
+     *
+     * \return トピックの型が一致しない場合はnullptr
+     */
+    virtual std::mutex* resolve(TopicFuncPairList &list) = 0;
+
+    /**
+     * resolveで見つけたトピックに出版する。トピックのロックを取得した状態で呼ぶ。
+     */
+    virtual void publishLocked(std::chrono::steady_clock::time_point stamp) = 0;
+};
+
 /**
  * トピックとコールバック関数のリスト
  */
 class TopicFuncPairList {
     /**
-     * シリアライズされたデータを扱う関数を格納する
+     * トピックごとの設定。トピックが生成される前に設定された場合は、生成時に適用する。
      */
-    struct FuncSerializedData{
-        std::function<void(std::string, std::string)> func;
-        int except_sender = 0; //!< 送信してきた相手に、再度送信するのを防ぐためのID
-        unsigned int handler = 0; //!< 関数を停止したりするためのハンドラ
-        size_t max_queue_size = 0;
+    struct TopicConfig {
+        int priority = 0; //!< トピックの優先度 値が大きいほど先に処理される
+        std::chrono::microseconds deadline { 0 }; //!< 出版からコールバック実行までの期限 0だと期限なし
+        QThreadPool *pool = nullptr; //!< コールバック関数を実行するスレッドプール nullptrだとグローバルなスレッドプール
+        std::chrono::milliseconds retention { 0 }; //!< 参照がなくなった後、最新のメッセージを保持する時間 maxだと無期限
+        CpuSet worker_cpus; //!< コールバック関数を実行するスレッドを固定するCPU
+        size_t codec_keyframe_interval = 0; //!< シリアライズされたメッセージの差分符号化のキーフレーム間隔 0だと符号化しない
+        size_t codec_max_message_size = DeltaDecoder::DEFAULT_MAX_SIZE; //!< 差分符号化されたメッセージの、復号後の最大の長さ
+        bool busy_poll = false; //!< 専用のスレッドでスピンしてメッセージを待つかどうか
+        std::chrono::nanoseconds ttl { 0 }; //!< メッセージの有効期間 0だと期限なし
+        size_t key_history_depth = 1; //!< キー付きトピックで、キーごとに保持するメッセージの数
+        std::chrono::nanoseconds key_idle_timeout { 0 }; //!< キー付きトピックで、最後の出版からキーを破棄するまでの時間 0だと破棄しない
+        std::function<void(CallbackFuncsBase&)> serializer; //!< シリアライザを設定する関数 空だとデフォルトのシリアライザ
+
+        /**
+         * 全ての設定が既定値かどうか。既定値の設定は、トピックの削除時に一緒に削除する。
+         */
+        bool isDefault() const {
+            TopicConfig defaults;
+            return priority == defaults.priority && deadline == defaults.deadline && pool == defaults.pool && retention == defaults.retention
+                    && worker_cpus == defaults.worker_cpus && codec_keyframe_interval == defaults.codec_keyframe_interval
+                    && codec_max_message_size == defaults.codec_max_message_size && busy_poll == defaults.busy_poll && ttl == defaults.ttl
+                    && key_history_depth == defaults.key_history_depth && key_idle_timeout == defaults.key_idle_timeout && !serializer;
+        }
+    };
+
+    /**
+     * callOnceでトピックを処理する順番を決めるための情報
+     */
+    struct DispatchOrder {
+        int priority;
+        std::chrono::steady_clock::time_point deadline;
+        std::shared_ptr<CallbackFuncsBase> func;
+        bool has_deadline; //!< 処理期限が設定されているかどうか 設定されていないトピックは、期限を問い合わせない
     };
 
 public:
+    /**
+     * ディスパッチスレッドが処理するトピックと結合購読の一覧
+     *
+     * 一度作ったら変更しない。購読者の追加やトピックの削除では、新しい一覧を作って差し替える。
+     * ディスパッチスレッドは一覧の参照を持つ間、ロックを取らずに処理できる。
+     * 一覧から外されたトピックは、参照がなくなった時点で解放される。
+     */
+    struct DispatchSnapshot {
+        std::vector<DispatchOrder> orders; //!< 処理する順番に並べたトピック
+        std::vector<std::shared_ptr<JoinBase>> joins; //!< 結合購読 トピックの後に処理する
+        bool deadline_enabled = false; //!< 処理期限が設定されたトピックがあるかどうか
+        TapList *taps = nullptr; //!< 全トピックの購読 トピックと結合購読の後に処理する
+
+        /**
+         * 処理期限を考慮した順番。ディスパッチスレッドだけが読み書きする作業領域。
+         *
+         * 前回の順番を保持しておき、期限の順が変わった場合だけ並べ直す。
+         */
+        mutable std::vector<DispatchOrder> deadline_orders;
+    };
+
+    TopicFuncPairList() {
+        updateSnapshot();
+    }
 
     ~TopicFuncPairList() {
-        for (auto &func : topic_funcs) {
-            if (func.second) {
-                delete func.second;
-                func.second = nullptr;
-            }
+        for (auto &join : joins) {
+            join.second.join->close();
         }
+        joins.clear();
     }
 
     /**
      * コールバック関数を登録する
      */
     template<class DataTypeWithConstAndReference>
-    unsigned short subscribe(const std::string &topic, const std::function<void(DataTypeWithConstAndReference)> &in_func, size_t max_que_size = 0) {
-        unsigned short ret = 0;
+    SubscribeHandler subscribe(const std::string &topic, const std::function<void(DataTypeWithConstAndReference)> &in_func, size_t max_que_size = 0) {
+        SubscribeHandler ret = 0;
         using DataType = typename std::remove_const<typename std::remove_reference<DataTypeWithConstAndReference>::type>::type;
         auto *func = createOrGetFunc<DataType>(topic);
         if (func) {
             ret = func->subscribe(in_func, max_que_size);
+            retain(topic);
         }
         return ret;
     }
 
-    void close_subscribe(const std::string &topic, unsigned int handler){
-        if (topic_funcs.count(topic) != 0) {
-            topic_funcs[topic]->close_subscribe(handler);
+    /**
+     * takeでメッセージを取り出す購読を登録する
+     */
+    template<class DataType>
+    SubscribeHandler subscribe_pull(const std::string &topic, size_t max_que_size = 0) {
+        SubscribeHandler ret = 0;
+        auto *func = createOrGetFunc<DataType>(topic);
+        if (func) {
+            ret = func->subscribe_pull(max_que_size);
+            retain(topic);
+        }
+        return ret;
+    }
+
+    template<class DataType>
+    bool take(const std::string &topic, SubscribeHandler handler, DataType &data) {
+        auto func = getFunc<DataType>(topic);
+        if (func) {
+            return func->take(handler, data);
         }
+        return false;
     }
 
-    void pause_subscribe(const std::string &topic, unsigned int handler){
+    template<class DataType>
+    bool await_next(const std::string &topic, SubscribeHandler handler, const std::function<void(const DataType*)> &waiter, QThreadPool *pool) {
+        auto func = getFunc<DataType>(topic);
+        if (func) {
+            return func->await_next(handler, waiter, pool);
+        }
+        return false;
+    }
+
+    /**
+     * トピックの参照を一つ増やして取得する。トピックがなければ生成する。
+     *
+     * \return トピックの型が一致しない場合はnullptr。その場合は参照を増やさない。
+     */
+    template<class DataType>
+    std::shared_ptr<CallbackFuncs<void, DataType>> retain_topic(const std::string &topic) {
+        if (!createOrGetFunc<DataType>(topic)) {
+            return nullptr;
+        }
+        retain(topic);
+        return std::static_pointer_cast<CallbackFuncs<void, DataType>>(topic_funcs[topic]);
+    }
+
+    /**
+     * トピックを取得する。ロックを解放した後も、参照を持つ間は削除されない。
+     */
+    std::shared_ptr<CallbackFuncsBase> getTopic(const std::string &topic) {
+        auto itr = topic_funcs.find(topic);
+        return (itr != topic_funcs.end() ? itr->second : nullptr);
+    }
+
+    /**
+     * 出版時刻の揃った、複数トピックのメッセージの組を受け取る購読を登録する
+     *
+     * \return 結合購読のハンドラ。トピックの型が一致しない場合は0
+     */
+    template<class... DataTypes>
+    unsigned int subscribe_join(const std::array<std::string, sizeof...(DataTypes)> &topics, const std::function<void(const DataTypes&...)> &func, std::chrono::nanoseconds tolerance, size_t max_que_size, QThreadPool *pool) {
+        if (!typesMatch<DataTypes...>(topics, std::index_sequence_for<DataTypes...>())) {
+            return 0; //型の合わないトピックがあれば、何も生成しない
+        }
+        auto funcs = getJoinFuncs<DataTypes...>(topics, std::index_sequence_for<DataTypes...>());
+        if (!allFound(funcs, std::index_sequence_for<DataTypes...>())) {
+            return 0;
+        }
+        for (auto &topic : topics) {
+            retain(topic);
+        }
+
+        JoinInfo info;
+        info.join.reset(new Join<DataTypes...>(funcs, func, tolerance, max_que_size, pool));
+        info.topics.assign(topics.begin(), topics.end());
+        joins.emplace(++cur_join_handler, std::move(info));
+        updateSnapshot();
+        return cur_join_handler;
+    }
+
+    /**
+     * 結合購読を一覧から外す
+     *
+     * 外した結合購読は、呼び出し側でcloseしてから、topicsの各トピックをreleaseする。
+     */
+    std::shared_ptr<JoinBase> detach_join(unsigned int handler, std::vector<std::string> &topics) {
+        auto itr = joins.find(handler);
+        if (itr == joins.end()) {
+            return nullptr;
+        }
+        auto join = itr->second.join;
+        topics = itr->second.topics;
+        joins.erase(itr);
+        updateSnapshot();
+        return join;
+    }
+
+    /**
+     * トピックを参照する出版者を登録する。トピックがなければ生成する。
+     */
+    template<class DataType>
+    void retain_publisher(const std::string &topic) {
+        if (createOrGetFunc<DataType>(topic)) {
+            retain(topic);
+        }
+    }
+
+    /**
+     * トピックの参照を一つ減らす
+     *
+     * 参照がなくなった場合、保持期間が0であればトピックを削除する。
+     * 保持期間が設定されていれば、期間が過ぎるまで最新のメッセージを保持し、その後callOnceで削除する。
+     */
+    void release(const std::string &topic) {
+        auto itr = ref_counts.find(topic);
+        if (itr == ref_counts.end()) {
+            return;
+        }
+        if (--itr->second != 0) {
+            return;
+        }
+        ref_counts.erase(itr);
+
+        auto retention = (topic_configs.count(topic) != 0 ? topic_configs[topic].retention : std::chrono::milliseconds(0));
+        if (retention.count() == 0) {
+            removeTopic(topic);
+        } else if (retention != std::chrono::milliseconds::max()) {
+            auto expire = std::chrono::steady_clock::now() + retention;
+            expire_times[topic] = expire;
+            next_expire = std::min(next_expire, expire);
+        }
+    }
+
+    /**
+     * 参照がなくなった後に、トピックの最新のメッセージを保持する時間を設定する
+     *
+     * \param retention 0だとすぐに削除する。std::chrono::milliseconds::max()だと削除しない。
+     */
+    void setRetention(const std::string &topic, std::chrono::milliseconds retention) {
+        topic_configs[topic].retention = retention;
+    }
+
+    /**
+     * トピックごとの設定を削除する
+     *
+     * 生成済みのトピックには設定が残り、削除された後に再び生成されたトピックには既定値が使われる。
+     * 保持期間も既定値に戻るので、参照がなくなればすぐに削除される。
+     */
+    void clearTopicConfig(const std::string &topic) {
+        if (topic_configs.erase(topic) != 0) {
+            sortDispatchOrder(); //処理期限の設定がなくなった場合に備えて、並べ直す
+        }
+    }
+
+    /**
+     * 設定が残っているトピックの数
+     */
+    size_t topicConfigCount() const {
+        return topic_configs.size();
+    }
+
+    void pause_subscribe(const std::string &topic, SubscribeHandler handler){
         if (topic_funcs.count(topic) != 0) {
             topic_funcs[topic]->pause_subscribe(handler);
         }
     }
 
-    void resume_subscribe(const std::string &topic, unsigned int handler){
+    void resume_subscribe(const std::string &topic, SubscribeHandler handler){
         if (topic_funcs.count(topic) != 0) {
             topic_funcs[topic]->resume_subscribe(handler);
         }
     }
 
+    void set_subscribe_priority(const std::string &topic, SubscribeHandler handler, int priority){
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->set_subscribe_priority(handler, priority);
+        }
+    }
+
+    void set_subscribe_decimation(const std::string &topic, SubscribeHandler handler, unsigned int decimation){
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->set_subscribe_decimation(handler, decimation);
+        }
+    }
+
+    void set_subscribe_interval(const std::string &topic, SubscribeHandler handler, std::chrono::nanoseconds interval){
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->set_subscribe_interval(handler, interval);
+        }
+    }
+
+    void set_subscribe_ttl(const std::string &topic, SubscribeHandler handler, std::chrono::nanoseconds ttl){
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->set_subscribe_ttl(handler, ttl);
+        }
+    }
+
+    /**
+     * トピックのメッセージの有効期間を設定する
+     */
+    void setTimeToLive(const std::string &topic, std::chrono::nanoseconds ttl) {
+        topic_configs[topic].ttl = ttl;
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->setTimeToLive(ttl);
+        }
+    }
+
+    /**
+     * トピックの優先度と処理期限を設定する
+     */
+    void setPriority(const std::string &topic, int priority, std::chrono::microseconds deadline) {
+        auto &config = topic_configs[topic];
+        config.priority = priority;
+        config.deadline = deadline;
+        auto itr = topic_funcs.find(topic);
+        if (itr != topic_funcs.end()) {
+            itr->second->setPriority(priority, deadline);
+            for (auto &order : dispatch_order) {
+                if (order.func == itr->second) {
+                    order.has_deadline = (deadline.count() != 0);
+                }
+            }
+        }
+        sortDispatchOrder(); //トピックの生成前でも、処理期限の有無を反映する
+    }
+
+    /**
+     * トピックのコールバック関数を実行するスレッドプールを設定する
+     */
+    void setThreadPool(const std::string &topic, QThreadPool *pool) {
+        topic_configs[topic].pool = pool;
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->setThreadPool(pool);
+        }
+    }
+
+    /**
+     * トピックのコールバック関数を実行するスレッドを固定するCPUを設定する
+     */
+    void setWorkerAffinity(const std::string &topic, const CpuSet &cpus) {
+        topic_configs[topic].worker_cpus = cpus;
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->setWorkerAffinity(cpus);
+        }
+    }
+
+    /**
+     * トピックのシリアライズされたメッセージの差分符号化を設定する
+     */
+    void setDeltaCodec(const std::string &topic, size_t keyframe_interval, size_t max_message_size) {
+        auto &config = topic_configs[topic];
+        config.codec_keyframe_interval = keyframe_interval;
+        config.codec_max_message_size = max_message_size;
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->setDeltaCodec(keyframe_interval, max_message_size);
+        }
+    }
+
+    /**
+     * キー付きトピックの購読を登録する
+     */
+    template<class Key, class DataType>
+    SubscribeHandler subscribe_keyed(const std::string &topic, const std::function<void(const Key&, const DataType&)> &in_func, bool conflate) {
+        SubscribeHandler ret = 0;
+        auto *func = createOrGetKeyed<Key, DataType>(topic);
+        if (func) {
+            ret = func->subscribe(in_func, conflate);
+            retain(topic);
+        }
+        return ret;
+    }
+
+    /**
+     * キー付きトピックの出版者によるトピックの参照を増やす
+     */
+    template<class Key, class DataType>
+    void retain_keyed_publisher(const std::string &topic) {
+        if (createOrGetKeyed<Key, DataType>(topic)) {
+            retain(topic);
+        }
+    }
+
+    template<class Key, class DataType>
+    void publish_keyed(const std::string &topic, const Key &key, const DataType &data) {
+        auto *func = createOrGetKeyed<Key, DataType>(topic);
+        if (func) {
+            func->publish(key, data);
+        }
+    }
+
+    /**
+     * キー付きトピックの、キーの最新のメッセージを取得する
+     */
+    template<class Key, class DataType>
+    bool getLatestKeyedData(const std::string &topic, const Key &key, DataType &data) {
+        if (topic_funcs.count(topic) == 0) {
+            return false;
+        }
+        auto *func = dynamic_cast<KeyedCallbackFuncs<Key, DataType>*>(topic_funcs[topic].get());
+        return (func ? func->getLatestData(key, data) : false);
+    }
+
+    /**
+     * キー付きトピックで、キーごとに保持するメッセージの数を設定する
+     */
+    void setKeyHistoryDepth(const std::string &topic, size_t depth) {
+        topic_configs[topic].key_history_depth = depth;
+        if (topic_funcs.count(topic) != 0) {
+            if (auto *keyed = dynamic_cast<KeyedCallbackFuncsBase*>(topic_funcs[topic].get())) {
+                keyed->setHistoryDepth(depth);
+            }
+        }
+    }
+
+    /**
+     * キー付きトピックで、最後の出版からキーを破棄するまでの時間を設定する
+     */
+    void setKeyIdleTimeout(const std::string &topic, std::chrono::nanoseconds timeout) {
+        topic_configs[topic].key_idle_timeout = timeout;
+        if (topic_funcs.count(topic) != 0) {
+            if (auto *keyed = dynamic_cast<KeyedCallbackFuncsBase*>(topic_funcs[topic].get())) {
+                keyed->setKeyIdleTimeout(timeout);
+            }
+        }
+    }
+
+    /**
+     * トピックのビジーポーリングを設定する
+     */
+    void setBusyPoll(const std::string &topic, bool enable) {
+        topic_configs[topic].busy_poll = enable;
+        if (topic_funcs.count(topic) != 0) {
+            topic_funcs[topic]->setBusyPoll(enable);
+        }
+    }
+
     template<class DataType>
     bool getLatestData(const std::string &topic, DataType& data){
         auto func = getFunc<DataType>(topic);
@@ -76,36 +482,58 @@ public:
         return false;
     }
 
+    template<class DataType>
+    bool getLatestData(const std::string &topic, DataType& data, std::chrono::nanoseconds &age){
+        auto func = getFunc<DataType>(topic);
+        if(func){
+            return func->getLatestData(data, age);
+        }
+        return false;
+    }
+
     /**
-     * シリアライザ付きのコールバック関数を登録する
+     * 全トピックのシリアライズされたメッセージを受け取る購読を登録する
+     *
+     * 各トピックに関数を登録せず、ブローカー全体で一つの列を観測する。開始時に、各トピックの最新のメッセージを一つずつ送る。
+     *
+     * \param filter 受け取るトピックを選ぶ関数 nullptrだと全てのトピック
+     * \param max_queue_size トピックごとの、未送信のメッセージの最大数 超えた場合は古いものから捨てる 0だと無限
      */
-    int subscribe_serialized(std::function<void(const std::string&, const std::string&)> func, size_t max_queue_size, int except_sender) {
-        FuncSerializedData func_info { func, except_sender, ++cur_handler, max_queue_size };
-        generalized_funcs.push_back(func_info);
-        for (auto topic_func : topic_funcs) {
-            auto functional = std::bind(func_info.func, topic_func.first, std::placeholders::_1);
-            topic_func.second->subscribe_serialized(functional, func_info.except_sender, func_info.handler ,max_queue_size);
+    unsigned int subscribe_serialized(const std::function<void(const std::string&, const std::string&)> &func, const std::function<bool(const std::string&)> &filter, size_t max_queue_size, int except_sender) {
+        std::deque<TapMessage> seeds;
+        for (auto &topic_func : topic_funcs) {
+            if (filter && !filter(topic_func.first)) {
+                continue;
+            }
+            TapMessage msg;
+            if (topic_func.second->getLatestTapMessage(msg)) {
+                seeds.push_back(std::move(msg));
+            }
         }
-        return func_info.handler;
+        return taps.subscribe(func, filter, max_queue_size, except_sender, std::move(seeds));
     }
 
+    /**
+     * subscribe_serializedで登録した購読を閉じる。TopicFuncPairListのロックは不要。
+     */
     void close_subscribe_serialized(unsigned int handler) {
-        for (auto topic_func : topic_funcs) {
-            topic_func.second->close_subscribe_serialized(handler);
-        }
-
-        auto itr = std::find_if(generalized_funcs.begin(), generalized_funcs.end(), [&](const FuncSerializedData &info) {return info.handler == handler;});
-        if (itr != generalized_funcs.end()) {
-            generalized_funcs.erase(itr);
-        }
+        taps.close(handler);
     }
 
 
     /**
      * シリアライザを登録する
+     *
+     * 設定はトピックごとに保持し、トピックが破棄されて再び生成された場合にも適用する。型が一致しないトピックには適用しない。
      */
     template<class DataType, class SerializerType>
     void setSerializer(const std::string &topic) {
+        auto &config = topic_configs[topic];
+        config.serializer = [](CallbackFuncsBase &base) {
+            if (auto *func = dynamic_cast<CallbackFuncs<void, DataType>*>(&base)) {
+                func->template setSerializer<SerializerType>();
+            }
+        };
         CallbackFuncs<void, DataType> *func = createOrGetFunc<DataType>(topic);
         if (func) {
             func->template setSerializer<SerializerType>();
@@ -113,6 +541,49 @@ public:
     }
 
 
+    /**
+     * 出版先のトピックを取得する。トピックがなければ生成する。
+     *
+     * \return トピックの型が一致しない場合はnullptr
+     */
+    template<class DataType>
+    CallbackFuncs<void, DataType>* getPublishTarget(const std::string &topic) {
+        return createOrGetFunc<DataType>(topic);
+    }
+
+    /**
+     * 複数のトピックにまとめて出版する
+     *
+     * \detail 全てのトピックのロックをアドレスの小さい順に取得してから出版するので、購読者や他の読み込みからは、全てのメッセージが同時に届いたように見える。
+     * 全てのメッセージの出版時刻は同じになる。型の一致しないトピックへのメッセージは捨てる。
+     */
+    void publish_batch(const std::vector<std::unique_ptr<BatchMessageBase>> &messages) {
+        auto &targets = batch_targets;
+        auto &locks = batch_locks;
+        targets.clear();
+        locks.clear();
+        for (auto &message : messages) {
+            auto *mutex = message->resolve(*this);
+            if (mutex) {
+                targets.push_back(message.get());
+                locks.push_back(mutex);
+            }
+        }
+        std::sort(locks.begin(), locks.end());
+        locks.erase(std::unique(locks.begin(), locks.end()), locks.end());
+
+        for (auto *mutex : locks) {
+            mutex->lock();
+        }
+        auto stamp = std::chrono::steady_clock::now();
+        for (auto *target : targets) {
+            target->publishLocked(stamp);
+        }
+        for (auto itr = locks.rbegin(); itr != locks.rend(); ++itr) {
+            (*itr)->unlock();
+        }
+    }
+
     /**
      * データを更新する
      */
@@ -131,13 +602,51 @@ public:
     }
 
     /**
-     * 各トピックのコールバック関数を、最大一回実行する。
+     * ディスパッチする一覧を取得する。保持期間が過ぎたトピックは、ここで一覧から外す。
+     */
+    std::shared_ptr<const DispatchSnapshot> getDispatchSnapshot() {
+        if (!expire_times.empty() && std::chrono::steady_clock::now() >= next_expire) {
+            removeExpiredTopics();
+        }
+        return snapshot;
+    }
+
+    /**
+     * 各トピックのコールバック関数を、最大一回実行する。TopicFuncPairListのロックは不要。
      *
+     * 優先度の高いトピックから処理する。処理期限が設定されている場合、同じ優先度の中では期限の早いものから処理する。
      */
-    bool callOnce() {
+    static bool callOnce(const DispatchSnapshot &snapshot) {
         bool processing = false;
-        for (auto &func : topic_funcs) {
-            processing |= func.second->callOnce();
+        if (snapshot.deadline_enabled) {
+            auto &orders = snapshot.deadline_orders;
+            auto earlier = [](const DispatchOrder &a, const DispatchOrder &b) {
+                return a.priority != b.priority ? a.priority > b.priority : a.deadline < b.deadline;
+            };
+            bool sorted = true;
+            for (size_t idx = 0; idx < orders.size(); ++idx) {
+                if (orders[idx].has_deadline) {
+                    orders[idx].deadline = orders[idx].func->getNextDeadline();
+                }
+                sorted = sorted && (idx == 0 || !earlier(orders[idx], orders[idx - 1]));
+            }
+            if (!sorted) {
+                std::stable_sort(orders.begin(), orders.end(), earlier);
+            }
+            for (auto &order : orders) {
+                processing |= order.func->callOnce();
+            }
+        } else {
+            for (auto &order : snapshot.orders) {
+                processing |= order.func->callOnce();
+            }
+        }
+
+        for (auto &join : snapshot.joins) {
+            processing |= join->callOnce();
+        }
+        if (snapshot.taps) {
+            processing |= snapshot.taps->callOnce();
         }
         return processing;
     }
@@ -148,28 +657,159 @@ private:
         CallbackFuncs<void, DataType> *func = nullptr;
         if (topic_funcs.count(topic) == 0) {
             func = new CallbackFuncs<void, DataType>();
+            func->setTopic(topic);
             func->template setSerializer<defaultSerializer>();
-            topic_funcs.emplace(topic, func);
-            for (auto &gfunc : generalized_funcs) {
-                auto functional = std::bind(gfunc.func, topic, std::placeholders::_1);
-                func->subscribe_serialized(functional, gfunc.except_sender, gfunc.handler, gfunc.max_queue_size);
-            }
+            addTopic(topic, std::shared_ptr<CallbackFuncsBase>(func));
         } else {
-            func = cast<void, DataType>(topic_funcs[topic]);
+            func = cast<void, DataType>(topic_funcs[topic].get());
+        }
+        return func;
+    }
+
+
+    template<class Key, class DataType>
+    KeyedCallbackFuncs<Key, DataType> * createOrGetKeyed(const std::string &topic){
+        if (topic_funcs.count(topic) != 0) {
+            return dynamic_cast<KeyedCallbackFuncs<Key, DataType>*>(topic_funcs[topic].get());
         }
+        auto *func = new KeyedCallbackFuncs<Key, DataType>();
+        func->setTopic(topic);
+        addTopic(topic, std::shared_ptr<CallbackFuncsBase>(func));
         return func;
     }
 
+    /**
+     * 生成したトピックを登録し、トピックの設定を適用する
+     */
+    void addTopic(const std::string &topic, const std::shared_ptr<CallbackFuncsBase> &owner) {
+        topic_funcs.emplace(topic, owner);
+        owner->setTapList(&taps);
+        if (topic_configs.count(topic) != 0) {
+            auto &config = topic_configs[topic];
+            owner->setPriority(config.priority, config.deadline);
+            owner->setThreadPool(config.pool);
+            owner->setWorkerAffinity(config.worker_cpus);
+            owner->setDeltaCodec(config.codec_keyframe_interval, config.codec_max_message_size);
+            owner->setTimeToLive(config.ttl);
+            if (config.busy_poll) {
+                owner->setBusyPoll(true);
+            }
+            if (auto *keyed = dynamic_cast<KeyedCallbackFuncsBase*>(owner.get())) {
+                keyed->setHistoryDepth(config.key_history_depth);
+                keyed->setKeyIdleTimeout(config.key_idle_timeout);
+            }
+            if (config.serializer) {
+                config.serializer(*owner);
+            }
+        }
+        //全体を並べ直さず、同じ優先度の末尾に挿入する
+        bool has_deadline = (topic_configs.count(topic) != 0 && topic_configs[topic].deadline.count() != 0);
+        DispatchOrder order { owner->getPriority(), std::chrono::steady_clock::time_point::max(), owner, has_deadline };
+        auto itr = std::upper_bound(dispatch_order.begin(), dispatch_order.end(), order, [](const DispatchOrder &a, const DispatchOrder &b) {return a.priority > b.priority;});
+        dispatch_order.insert(itr, order);
+        updateSnapshot();
+    }
 
     template<class DataType>
     CallbackFuncs<void, DataType> * getFunc(const std::string &topic){
         CallbackFuncs<void, DataType> *func = nullptr;
         if (topic_funcs.count(topic) != 0) {
-            func = cast<void, DataType>(topic_funcs[topic]);
+            func = cast<void, DataType>(topic_funcs[topic].get());
         }
         return func;
     }
 
+    template<class... DataTypes, size_t... I>
+    typename Join<DataTypes...>::FuncsType getJoinFuncs(const std::array<std::string, sizeof...(DataTypes)> &topics, std::index_sequence<I...>) {
+        return typename Join<DataTypes...>::FuncsType(createOrGetFunc<DataTypes>(topics[I])...);
+    }
+
+    template<class... DataTypes, size_t... I>
+    bool typesMatch(const std::array<std::string, sizeof...(DataTypes)> &topics, std::index_sequence<I...>) {
+        bool match[] = { (topic_funcs.count(topics[I]) == 0 || cast<void, DataTypes>(topic_funcs[topics[I]].get()) != nullptr)... };
+        return std::all_of(std::begin(match), std::end(match), [](bool m) {return m;});
+    }
+
+    template<class FuncsType, size_t... I>
+    static bool allFound(const FuncsType &funcs, std::index_sequence<I...>) {
+        bool found[] = { (std::get<I>(funcs) != nullptr)... };
+        return std::all_of(std::begin(found), std::end(found), [](bool f) {return f;});
+    }
+
+    void retain(const std::string &topic) {
+        ref_counts[topic]++;
+        expire_times.erase(topic);
+    }
+
+    /**
+     * トピックを一覧から外す。メッセージキューとコールバック関数は、ディスパッチ中の一覧からも外れた時点で解放される。
+     */
+    void removeTopic(const std::string &topic) {
+        auto itr = topic_funcs.find(topic);
+        if (itr == topic_funcs.end()) {
+            return;
+        }
+        auto func = itr->second;
+        dispatch_order.erase(std::remove_if(dispatch_order.begin(), dispatch_order.end(), [&](const DispatchOrder &order) {return order.func == func;}), dispatch_order.end());
+        topic_funcs.erase(itr);
+
+        //既定値に戻された設定は、使い捨てのトピック名で一覧が増え続けないよう、一緒に削除する
+        auto config = topic_configs.find(topic);
+        if (config != topic_configs.end() && config->second.isDefault()) {
+            topic_configs.erase(config);
+        }
+        updateSnapshot();
+    }
+
+    /**
+     * 保持期間が過ぎたトピックを削除する
+     */
+    void removeExpiredTopics() {
+        auto now = std::chrono::steady_clock::now();
+        next_expire = std::chrono::steady_clock::time_point::max();
+        for (auto itr = expire_times.begin(); itr != expire_times.end();) {
+            if (itr->second <= now) {
+                removeTopic(itr->first);
+                itr = expire_times.erase(itr);
+            } else {
+                next_expire = std::min(next_expire, itr->second);
+                ++itr;
+            }
+        }
+    }
+
+    /**
+     * トピックの処理順を、優先度の高い順に並べ替える
+     */
+    void sortDispatchOrder() {
+        deadline_enabled = false;
+        for (auto &order : dispatch_order) {
+            order.priority = order.func->getPriority();
+        }
+        for (auto &config : topic_configs) {
+            deadline_enabled = deadline_enabled || config.second.deadline.count() != 0;
+        }
+        std::stable_sort(dispatch_order.begin(), dispatch_order.end(), [](const DispatchOrder &a, const DispatchOrder &b) {return a.priority > b.priority;});
+        updateSnapshot();
+    }
+
+    /**
+     * ディスパッチする一覧を作り直して、差し替える
+     */
+    void updateSnapshot() {
+        auto next = std::make_shared<DispatchSnapshot>();
+        next->orders = dispatch_order;
+        next->deadline_enabled = deadline_enabled;
+        if (deadline_enabled) {
+            next->deadline_orders = dispatch_order;
+        }
+        for (auto &join : joins) {
+            next->joins.push_back(join.second.join);
+        }
+        next->taps = &taps;
+        snapshot = next;
+    }
+
     template<class ReturnType, class DataType>
     CallbackFuncs<ReturnType, DataType>* cast(CallbackFuncsBase *base) {
         return dynamic_cast<CallbackFuncs<ReturnType, DataType>*>(base);
@@ -177,9 +817,28 @@ private:
 
 
 private:
-    std::map<std::string, CallbackFuncsBase*> topic_funcs;
+    TapList taps; //!< 全トピックの購読 トピックから参照されるので、トピックより先に生成し、後に破棄する
+    std::map<std::string, std::shared_ptr<CallbackFuncsBase>> topic_funcs;
+
+    /**
+     * 結合購読と、その参照するトピック
+     */
+    struct JoinInfo {
+        std::shared_ptr<JoinBase> join;
+        std::vector<std::string> topics;
+    };
+    unsigned int cur_join_handler = 0; //!< 結合購読を特定するハンドラ
+    std::map<unsigned int, JoinInfo> joins; //!< 結合購読の一覧 トピックの後に処理する
+
+    std::map<std::string, TopicConfig> topic_configs; //!< トピックごとの設定
+    std::vector<DispatchOrder> dispatch_order; //!< callOnceでトピックを処理する順番
+    std::shared_ptr<const DispatchSnapshot> snapshot; //!< ディスパッチスレッドに渡す一覧
+    bool deadline_enabled = false; //!< 処理期限が設定されたトピックがあるかどうか
+    std::vector<BatchMessageBase*> batch_targets; //!< publish_batchの作業領域 出版するたびに確保しないよう保持する
+    std::vector<std::mutex*> batch_locks; //!< publish_batchの作業領域 取得するトピックのロック
 
-    unsigned int cur_handler = 0; //!< シリアライズ付きのデータサブスクライブ関数を特定するハンドラ
-    std::vector<FuncSerializedData> generalized_funcs;
+    std::map<std::string, unsigned int> ref_counts; //!< トピックを参照している出版者・購読者の数
+    std::map<std::string, std::chrono::steady_clock::time_point> expire_times; //!< 参照がなくなったトピックを削除する時刻
+    std::chrono::steady_clock::time_point next_expire = std::chrono::steady_clock::time_point::max(); //!< 次にトピックを削除する時刻
 };
 }
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+namespace pubsub {
+
+/**
+ * メッセージごとの、出版からコールバック終了までの時刻を記録する
+ *
+ * 記録はスレッドごとのバッファに行い、ロックを取らない。バッファが一杯になると、古いものから上書きする。
+ * dumpChromeTraceで、chrome://tracing や Perfetto で開けるJSONを出力する。
+ *
+ * \code
+ * pubsub::Tracer::enable();
+ * ...
+ * pubsub::Tracer::dumpChromeTrace("trace.json");
+ * \endcode
+ */
+class Tracer {
+public:
+    enum EventType : uint8_t {
+        PUBLISH,        //!< 出版の開始
+        ENQUEUE,        //!< 受信キューへの追加
+        DISPATCH,       //!< スレッドプールへの投入
+        CALLBACK_BEGIN, //!< コールバック関数の開始
+        CALLBACK_END    //!< コールバック関数の終了
+    };
+
+    /**
+     * 記録を開始する
+     *
+     * \param events_per_thread スレッドごとに保持するイベントの数。これから生成されるバッファに適用される。
+     */
+    static void enable(size_t events_per_thread = 1 << 16) {
+        auto &tracer = instance();
+        tracer.capacity.store(events_per_thread, std::memory_order_relaxed);
+        tracer.active.store(true, std::memory_order_release);
+    }
+
+    static void disable() {
+        instance().active.store(false, std::memory_order_release);
+    }
+
+    static bool enabled() {
+        return instance().active.load(std::memory_order_relaxed);
+    }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * 生成されたトピックに、記録用の番号を割り当てる
+     *
+     * メッセージの通し番号はトピックが再び生成されると0から数え直すので、同じ名前でも生成ごとに別の番号にし、フローの識別子が重ならないようにする。
+     * トピック名の文字列は、名前ごとに一つだけ保持する。
+     */
+    static uint32_t topicId(const std::string &topic) {
+        auto &tracer = instance();
+        std::lock_guard<std::mutex> lk(tracer.mtx);
+        auto itr = tracer.name_indices.find(topic);
+        if (itr == tracer.name_indices.end()) {
+            itr = tracer.name_indices.emplace(topic, tracer.topic_names.size()).first;
+            tracer.topic_names.push_back(topic);
+        }
+        tracer.topic_name_indices.push_back(itr->second);
+        return tracer.topic_name_indices.size(); //0は未登録を表す
+    }
+
+    /**
+     * イベントを記録する
+     *
+     * \param seq トピック内のメッセージの通し番号
+     */
+    static void record(EventType type, uint32_t topic_id, uint64_t seq, int64_t time = now()) {
+        auto &buffer = threadBuffer();
+        size_t idx = buffer.count.load(std::memory_order_relaxed);
+        buffer.events[idx % buffer.events.size()] = Event { time, seq, topic_id, type };
+        buffer.count.store(idx + 1, std::memory_order_release);
+    }
+
+    /**
+     * 記録したイベントを破棄する
+     */
+    static void clear() {
+        auto &tracer = instance();
+        std::lock_guard<std::mutex> lk(tracer.mtx);
+        for (auto &buffer : tracer.buffers) {
+            buffer->count.store(0, std::memory_order_release);
+        }
+    }
+
+    static bool dumpChromeTrace(const std::string &path) {
+        std::ofstream ofs(path);
+        if (!ofs) {
+            return false;
+        }
+        dumpChromeTrace(ofs);
+        return true;
+    }
+
+    /**
+     * 記録したイベントを、Chrome trace形式のJSONで出力する
+     *
+     * 出版から受信キューへの追加、コールバック関数の実行を区間として、メッセージごとの流れをフローとして出力する。
+     * バッファが一周して区間の開始が上書きされた場合、対応する終了は出力しない。
+     * 記録中に呼んだ場合、出力中に上書きされたイベントが混ざる可能性がある。
+     */
+    static void dumpChromeTrace(std::ostream &os) {
+        auto &tracer = instance();
+        std::lock_guard<std::mutex> lk(tracer.mtx);
+
+        os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+        bool first = true;
+        for (auto &buffer : tracer.buffers) {
+            size_t count = buffer->count.load(std::memory_order_acquire);
+            size_t size = buffer->events.size();
+            size_t begin = (count > size ? count - size : 0);
+            size_t open_slices = 0; //出力した区間の開始のうち、終了していないものの数 区間はスレッドごとに入れ子になる
+            for (size_t idx = begin; idx < count; ++idx) {
+                auto &event = buffer->events[idx % size];
+                if (event.type == ENQUEUE || event.type == CALLBACK_END) {
+                    if (open_slices == 0) {
+                        continue; //開始が上書きされた
+                    }
+                    open_slices--;
+                } else if (event.type == PUBLISH || event.type == CALLBACK_BEGIN) {
+                    open_slices++;
+                }
+                std::string topic = (event.topic_id != 0 && event.topic_id <= tracer.topic_name_indices.size() ? tracer.topic_names[tracer.topic_name_indices[event.topic_id - 1]] : "");
+                std::string flow_id = std::to_string(event.topic_id) + ":" + std::to_string(event.seq);
+                std::string common = ",\"pid\":1,\"tid\":" + std::to_string(buffer->tid) + ",\"ts\":" + std::to_string(event.time / 1000.0);
+                std::string args = ",\"args\":{\"topic\":\"" + escape(topic) + "\",\"seq\":" + std::to_string(event.seq) + "}";
+
+                switch (event.type) {
+                case PUBLISH:
+                    write(os, first, "{\"name\":\"publish " + escape(topic) + "\",\"ph\":\"B\"" + common + args + "}");
+                    write(os, first, "{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"s\",\"id\":\"" + flow_id + "\"" + common + "}");
+                    break;
+                case ENQUEUE:
+                    write(os, first, "{\"ph\":\"E\"" + common + "}");
+                    break;
+                case DISPATCH:
+                    write(os, first, "{\"name\":\"dispatch " + escape(topic) + "\",\"ph\":\"i\",\"s\":\"t\"" + common + args + "}");
+                    write(os, first, "{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"t\",\"id\":\"" + flow_id + "\"" + common + "}");
+                    break;
+                case CALLBACK_BEGIN:
+                    write(os, first, "{\"name\":\"callback " + escape(topic) + "\",\"ph\":\"B\"" + common + args + "}");
+                    write(os, first, "{\"name\":\"message\",\"cat\":\"message\",\"ph\":\"f\",\"bp\":\"e\",\"id\":\"" + flow_id + "\"" + common + "}");
+                    break;
+                case CALLBACK_END:
+                    write(os, first, "{\"ph\":\"E\"" + common + "}");
+                    break;
+                }
+            }
+        }
+        os << "]}" << std::endl;
+    }
+
+private:
+    struct Event {
+        int64_t time;      //!< 時刻[ns]
+        uint64_t seq;      //!< トピック内のメッセージの通し番号
+        uint32_t topic_id; //!< トピックの番号
+        EventType type;
+    };
+
+    struct ThreadBuffer {
+        std::vector<Event> events;
+        std::atomic<size_t> count { 0 }; //!< これまでに記録したイベントの数 書き込むのは所有スレッドのみ
+        unsigned int tid = 0;
+    };
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    /**
+     * 実行中のスレッドのバッファを取得する。初めて呼ばれたときに生成して登録する。
+     */
+    static ThreadBuffer& threadBuffer() {
+        thread_local std::shared_ptr<ThreadBuffer> buffer;
+        if (!buffer) {
+            auto &tracer = instance();
+            buffer = std::make_shared<ThreadBuffer>();
+            buffer->events.resize(std::max<size_t>(1, tracer.capacity.load(std::memory_order_relaxed)));
+
+            std::lock_guard<std::mutex> lk(tracer.mtx);
+            buffer->tid = tracer.buffers.size() + 1;
+            tracer.buffers.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    static void write(std::ostream &os, bool &first, const std::string &event) {
+        if (!first) {
+            os << ",";
+        }
+        os << "\n" << event;
+        first = false;
+    }
+
+    static std::string escape(const std::string &str) {
+        std::string ret;
+        for (auto c : str) {
+            if (c == '"' || c == '\\') {
+                ret += '\\';
+            }
+            ret += c;
+        }
+        return ret;
+    }
+
+private:
+    std::atomic<bool> active { false };
+    std::atomic<size_t> capacity { 1 << 16 };
+
+    std::mutex mtx; //!< バッファの登録とトピック名の変換、出力を保護する
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+    std::map<std::string, uint32_t> name_indices; //!< トピック名から、topic_namesの添字
+    std::vector<std::string> topic_names; //!< 記録したトピックの名前 名前ごとに一つ
+    std::vector<uint32_t> topic_name_indices; //!< トピックの番号-1から、topic_namesの添字
+};
+}
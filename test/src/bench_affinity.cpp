@@ -0,0 +1,83 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+
+#include "pubsub.hpp"
+
+/**
+ * CPUを固定した場合と、固定しない場合のコールバック関数の処理量を比較する
+ *
+ * 固定しない場合、固定してグローバルなスレッドプールで実行する場合(実行後に元に戻す)、
+ * 固定して専用のスレッドプールで実行する場合(固定し直さない)を測る。
+ */
+namespace {
+
+constexpr int MESSAGE_COUNT = 20000;
+constexpr int SUBSCRIBER_COUNT = 8;
+
+class Counter {
+public:
+    void onData(const int&) {
+        count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<int> count { 0 };
+};
+
+int firstCpu() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+void run(const std::string &label, bool pinned, QThreadPool *pool) {
+    pubsub::BrokerCore broker;
+    broker.setBusyPoll(std::chrono::microseconds(200)); //ディスパッチスレッドの待ち時間ではなく、コールバック関数の実行を測る
+    broker.run();
+    if (pool) {
+        pubsub::extra_api::setThreadPool("/bench", pool, &broker);
+    }
+    if (pinned) {
+        pubsub::extra_api::setWorkerAffinity("/bench", { firstCpu() }, &broker);
+    }
+
+    Counter counter;
+    {
+        std::vector<pubsub::Subscriber> subs;
+        for (int idx = 0; idx < SUBSCRIBER_COUNT; ++idx) {
+            subs.push_back(pubsub::api::subscribe("/bench", &Counter::onData, &counter, 0, &broker));
+        }
+        pubsub::Publisher<int> pub("/bench", pubsub::GLOBAL, &broker);
+
+        auto begin = std::chrono::steady_clock::now();
+        for (int idx = 0; idx < MESSAGE_COUNT; ++idx) {
+            pub.publish(idx);
+        }
+        while (counter.count.load() < MESSAGE_COUNT * SUBSCRIBER_COUNT) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        std::cout << std::left << std::setw(28) << label << std::fixed << std::setprecision(0) << MESSAGE_COUNT * SUBSCRIBER_COUNT / elapsed.count() << " callbacks/s" << std::endl;
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    QThreadPool pool;
+    run("unpinned, global pool", false, nullptr);
+    run("pinned, global pool", true, nullptr);
+    run("pinned, dedicated pool", true, &pool);
+    return 0;
+}
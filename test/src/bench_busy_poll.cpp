@@ -0,0 +1,91 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+
+#include "pubsub.hpp"
+
+/**
+ * 出版からコールバック関数の開始までの遅延を、ビジーポーリングの設定ごとに比較する
+ *
+ * 通常の設定、ディスパッチスレッドのビジーポーリング、トピックのビジーポーリングで、中央値と99パーセンタイルを測る。
+ * ビジーポーリングはCPUを占有するので、CPUが少ない環境では遅くなる場合がある。
+ */
+namespace {
+
+constexpr int MESSAGE_COUNT = 2000;
+constexpr auto PUBLISH_INTERVAL = std::chrono::microseconds(200);
+
+int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class LatencyRecorder {
+public:
+    void onData(const int64_t &published) {
+        int64_t latency = nowNs() - published;
+        std::lock_guard<std::mutex> lk(mtx);
+        latencies.push_back(latency);
+    }
+
+    size_t count() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return latencies.size();
+    }
+
+    void print(const std::string &label) {
+        std::lock_guard<std::mutex> lk(mtx);
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) {return latencies[static_cast<size_t>(p * (latencies.size() - 1))] / 1000.0;};
+        std::cout << std::left << std::setw(20) << label << std::right << std::fixed << std::setprecision(1)
+                << " p50 " << std::setw(8) << percentile(0.5) << " us"
+                << "  p99 " << std::setw(8) << percentile(0.99) << " us" << std::endl;
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<int64_t> latencies;
+};
+
+enum class Mode {
+    DEFAULT, BROKER_BUSY_POLL, TOPIC_BUSY_POLL
+};
+
+void run(const std::string &label, Mode mode) {
+    pubsub::BrokerCore broker;
+    if (mode == Mode::BROKER_BUSY_POLL) {
+        broker.setBusyPoll(std::chrono::microseconds(500));
+    }
+    broker.run();
+    if (mode == Mode::TOPIC_BUSY_POLL) {
+        pubsub::extra_api::setBusyPoll("/latency", true, &broker);
+    }
+
+    LatencyRecorder recorder;
+    {
+        auto sub = pubsub::api::subscribe("/latency", &LatencyRecorder::onData, &recorder, 0, &broker);
+        pubsub::Publisher<int64_t> pub("/latency", pubsub::GLOBAL, &broker);
+        for (int idx = 0; idx < MESSAGE_COUNT; ++idx) {
+            pub.publish(nowNs());
+            std::this_thread::sleep_for(PUBLISH_INTERVAL);
+        }
+        while (recorder.count() < static_cast<size_t>(MESSAGE_COUNT)) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    broker.stop();
+    recorder.print(label);
+}
+}
+
+int main() {
+    run("default", Mode::DEFAULT);
+    run("broker busy-poll", Mode::BROKER_BUSY_POLL);
+    run("topic busy-poll", Mode::TOPIC_BUSY_POLL);
+    return 0;
+}
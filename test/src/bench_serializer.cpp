@@ -0,0 +1,90 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+#include "simd_serializer.hpp"
+
+/**
+ * 数値配列のシリアライザの処理量[GB/s]を、文字列に変換する方法と比較する
+ *
+ * 処理量は、シリアライズ前の配列のバイト数を基準にする。SIMDの効果を見る場合は、-march=nativeでビルドする。
+ */
+namespace {
+
+constexpr size_t ELEMENT_COUNT = 1 << 20;
+constexpr int REPEAT = 20;
+
+/**
+ * 要素を空白区切りの文字列に変換する
+ */
+class textSerializer {
+public:
+    template<class T>
+    std::string serialize(std::vector<T> &data) {
+        std::ostringstream oss;
+        for (auto &value : data) {
+            oss << value << ' ';
+        }
+        return oss.str();
+    }
+
+    template<class DataType>
+    DataType deserialize(const std::string &msg) {
+        DataType data;
+        std::istringstream iss(msg);
+        typename DataType::value_type value;
+        while (iss >> value) {
+            data.push_back(value);
+        }
+        return data;
+    }
+};
+
+template<class Serializer, class T>
+void run(const std::string &label, std::vector<T> &data) {
+    Serializer serializer;
+    double bytes = static_cast<double>(data.size() * sizeof(T)) * REPEAT;
+    std::string msg;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int idx = 0; idx < REPEAT; ++idx) {
+        msg = serializer.serialize(data);
+    }
+    std::chrono::duration<double> encode_time = std::chrono::steady_clock::now() - begin;
+
+    size_t decoded_size = 0;
+    begin = std::chrono::steady_clock::now();
+    for (int idx = 0; idx < REPEAT; ++idx) {
+        decoded_size += serializer.template deserialize<std::vector<T>>(msg).size();
+    }
+    std::chrono::duration<double> decode_time = std::chrono::steady_clock::now() - begin;
+
+    std::cout << std::left << std::setw(24) << label << std::right << std::fixed << std::setprecision(3)
+            << " serialize " << std::setw(8) << bytes / encode_time.count() / 1e9 << " GB/s"
+            << "  deserialize " << std::setw(8) << bytes / decode_time.count() / 1e9 << " GB/s"
+            << "  size " << std::setprecision(2) << static_cast<double>(msg.size()) / (data.size() * sizeof(T)) << "x"
+            << (decoded_size == data.size() * REPEAT ? "" : "  (decode failed)") << std::endl;
+}
+}
+
+int main() {
+    std::vector<float> floats(ELEMENT_COUNT);
+    std::vector<int32_t> ints(ELEMENT_COUNT);
+    for (size_t idx = 0; idx < ELEMENT_COUNT; ++idx) {
+        floats[idx] = std::sin(idx * 0.001f) * 100.0f;
+        ints[idx] = static_cast<int32_t>(idx % 100) - 50;
+    }
+
+    run<textSerializer>("text float", floats);
+    run<pubsub::arraySerializer>("arraySerializer float", floats);
+    run<pubsub::quantizedSerializer>("quantizedSerializer", floats);
+    run<textSerializer>("text int32", ints);
+    run<pubsub::arraySerializer>("arraySerializer int32", ints);
+    run<pubsub::varintSerializer>("varintSerializer", ints);
+    return 0;
+}
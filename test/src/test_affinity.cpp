@@ -0,0 +1,112 @@
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <sched.h>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+cpu_set_t currentMask() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    return set;
+}
+
+int firstCpu(const cpu_set_t &set) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+class MaskRecorder {
+public:
+    void onPinned(const int&) {
+        record(pinned, pinned_count);
+    }
+
+    void onFree(const int&) {
+        record(free, free_count);
+    }
+
+    cpu_set_t pinned;
+    cpu_set_t free;
+    std::atomic<int> pinned_count { 0 };
+    std::atomic<int> free_count { 0 };
+
+private:
+    void record(cpu_set_t &mask, std::atomic<int> &count) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            mask = currentMask();
+        }
+        count++;
+    }
+
+    std::mutex mtx;
+};
+
+/**
+ * 空のCPUを指定すると、固定する前の設定に戻る
+ */
+void testPinAndRestore() {
+    std::thread([] {
+        auto original = currentMask();
+        pubsub::pinCurrentThread( { firstCpu(original) });
+        auto pinned = currentMask();
+        CHECK(CPU_COUNT(&pinned) == 1);
+        CHECK(CPU_ISSET(firstCpu(original), &pinned));
+
+        pubsub::pinCurrentThread(pubsub::CpuSet());
+        auto restored = currentMask();
+        CHECK(CPU_EQUAL(&restored, &original));
+    }).join();
+}
+
+/**
+ * 固定したトピックと同じスレッドプールで実行される、固定しないトピックは、元の設定で実行される
+ */
+void testSharedPool(QThreadPool *pool) {
+    pubsub::BrokerCore broker;
+    broker.run();
+    auto original = currentMask();
+    if (pool) {
+        pubsub::extra_api::setThreadPool("/pinned", pool, &broker);
+        pubsub::extra_api::setThreadPool("/free", pool, &broker);
+    }
+    pubsub::extra_api::setWorkerAffinity("/pinned", { firstCpu(original) }, &broker);
+
+    MaskRecorder recorder;
+    {
+        auto pinned_sub = pubsub::api::subscribe("/pinned", &MaskRecorder::onPinned, &recorder, 0, &broker);
+        auto free_sub = pubsub::api::subscribe("/free", &MaskRecorder::onFree, &recorder, 0, &broker);
+        pubsub::Publisher<int> pinned_pub("/pinned", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<int> free_pub("/free", pubsub::GLOBAL, &broker);
+
+        pinned_pub.publish(1);
+        CHECK(test_util::waitUntil([&] {return recorder.pinned_count == 1;}));
+        free_pub.publish(1);
+        CHECK(test_util::waitUntil([&] {return recorder.free_count == 1;}));
+
+        CHECK(CPU_COUNT(&recorder.pinned) == 1);
+        CHECK(CPU_EQUAL(&recorder.free, &original));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testPinAndRestore();
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(1); //同じスレッドで実行されるようにする
+    testSharedPool(&pool);
+    QThreadPool::globalInstance()->setMaxThreadCount(1);
+    testSharedPool(nullptr);
+    return test_util::result("test_affinity");
+}
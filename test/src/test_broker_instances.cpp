@@ -0,0 +1,77 @@
+#include <iostream>
+#include <atomic>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Receiver {
+public:
+    void onData(const int &data) {
+        last = data;
+        count++;
+    }
+
+    std::atomic<int> last { 0 };
+    std::atomic<int> count { 0 };
+};
+
+/**
+ * 同じ名前のトピックでも、ブローカーが異なれば届かない
+ */
+void testIsolation() {
+    pubsub::BrokerCore broker_a;
+    pubsub::BrokerCore broker_b;
+    broker_a.run();
+    broker_b.run();
+    Receiver receiver_a;
+    Receiver receiver_b;
+    {
+        auto sub_a = pubsub::api::subscribe("/shared", &Receiver::onData, &receiver_a, 0, &broker_a);
+        auto sub_b = pubsub::api::subscribe("/shared", &Receiver::onData, &receiver_b, 0, &broker_b);
+        pubsub::Publisher<int> pub_a("/shared", pubsub::GLOBAL, &broker_a);
+
+        pub_a.publish(1);
+        CHECK(test_util::waitUntil([&] {return receiver_a.count == 1;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(receiver_b.count == 0);
+
+        int latest = 0;
+        CHECK(pubsub::api::getLatestData("/shared", latest, &broker_a));
+        CHECK(latest == 1);
+        CHECK(!pubsub::api::getLatestData("/shared", latest, &broker_b));
+    }
+    broker_a.stop();
+    broker_b.stop();
+}
+
+/**
+ * 一方のブローカーを止めても、もう一方の配信は続く
+ */
+void testIndependentStop() {
+    pubsub::BrokerCore broker_a;
+    broker_a.run();
+    Receiver receiver;
+    {
+        pubsub::BrokerCore broker_b;
+        broker_b.run();
+        auto sub = pubsub::api::subscribe("/shared", &Receiver::onData, &receiver, 0, &broker_a);
+        pubsub::Publisher<int> pub("/shared", pubsub::GLOBAL, &broker_a);
+        pub.publish(1);
+        CHECK(test_util::waitUntil([&] {return receiver.count == 1;}));
+
+        broker_b.stop();
+        pub.publish(2);
+        CHECK(test_util::waitUntil([&] {return receiver.count == 2;}));
+        CHECK(receiver.last == 2);
+    }
+    broker_a.stop();
+}
+}
+
+int main() {
+    testIsolation();
+    testIndependentStop();
+    return test_util::result("test_broker_instances");
+}
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Receiver {
+public:
+    void onData(const int &data) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            threads.insert(std::this_thread::get_id());
+        }
+        last = data;
+        count++;
+    }
+
+    size_t threadCount() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return threads.size();
+    }
+
+    std::atomic<int> last { -1 };
+    std::atomic<int> count { 0 };
+
+private:
+    std::mutex mtx;
+    std::set<std::thread::id> threads;
+};
+
+/**
+ * コールバック関数の中で、トピックの最後の購読を閉じる
+ */
+class SelfCloser {
+public:
+    void onData(const int&) {
+        sub.close();
+        closed = true;
+    }
+
+    pubsub::Subscriber sub;
+    std::atomic<bool> closed { false };
+};
+
+/**
+ * ビジーポーリングのトピックは、専用のスレッドで順にコールバック関数を実行する
+ */
+void testTopicBusyPoll() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::extra_api::setBusyPoll("/spin", true, &broker);
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/spin", &Receiver::onData, &receiver, 0, &broker);
+        pubsub::Publisher<int> pub("/spin", pubsub::GLOBAL, &broker);
+        for (int idx = 0; idx < 100; ++idx) {
+            pub.publish(idx);
+        }
+        CHECK(test_util::waitUntil([&] {return receiver.count == 100;}));
+        CHECK(receiver.last == 99);
+        CHECK(receiver.threadCount() == 1);
+
+        pubsub::extra_api::setBusyPoll("/spin", false, &broker); //スレッドプールでの実行に戻る
+        pub.publish(100);
+        CHECK(test_util::waitUntil([&] {return receiver.count == 101;}));
+    }
+    broker.stop();
+}
+
+/**
+ * ディスパッチスレッドのビジーポーリングでも、全てのメッセージが届く
+ */
+void testBrokerBusyPoll() {
+    pubsub::BrokerCore broker;
+    broker.setBusyPoll(std::chrono::microseconds(100));
+    broker.run();
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/dispatch", &Receiver::onData, &receiver, 0, &broker);
+        pubsub::Publisher<int> pub("/dispatch", pubsub::GLOBAL, &broker);
+        for (int idx = 0; idx < 50; ++idx) {
+            pub.publish(idx);
+        }
+        CHECK(test_util::waitUntil([&] {return receiver.count == 50;}));
+        broker.setBusyPoll(std::chrono::microseconds(0));
+        pub.publish(50);
+        CHECK(test_util::waitUntil([&] {return receiver.last == 50;}));
+    }
+    broker.stop();
+}
+
+/**
+ * ビジーポーリングのスレッドで最後の購読を閉じ、トピックが破棄されても、止まらない
+ */
+void testCloseLastFromSpinner() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::extra_api::setBusyPoll("/last", true, &broker);
+    for (int round = 0; round < 20; ++round) {
+        SelfCloser closer;
+        closer.sub = pubsub::api::subscribe("/last", &SelfCloser::onData, &closer, 0, &broker);
+        {
+            pubsub::Publisher<int> pub("/last", pubsub::GLOBAL, &broker);
+            pub.publish(round);
+        } //購読だけがトピックを参照している
+        CHECK(test_util::waitUntil([&] {return closer.closed.load();}));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testTopicBusyPoll();
+    testBrokerBusyPoll();
+    testCloseLastFromSpinner();
+    return test_util::result("test_busy_poll");
+}
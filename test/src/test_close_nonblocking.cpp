@@ -0,0 +1,86 @@
+#include <iostream>
+#include <atomic>
+#include <future>
+#include <thread>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class SlowReceiver {
+public:
+    SlowReceiver() :
+            gate(release.get_future().share()) {
+    }
+
+    void onData(const int&) {
+        started = true;
+        gate.wait();
+    }
+
+    std::promise<void> release;
+    std::shared_future<void> gate;
+    std::atomic<bool> started { false };
+};
+
+class Receiver {
+public:
+    void onData(const int&) {
+        count++;
+    }
+
+    std::atomic<int> count { 0 };
+};
+
+/**
+ * 実行中のコールバック関数の終了を待つ間も、出版、購読、他のトピックのディスパッチは止まらない
+ */
+void testCloseDoesNotStall() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(2); //遅いコールバック関数が一つを占有する
+    pubsub::extra_api::setThreadPool("/slow", &pool, &broker);
+    SlowReceiver slow;
+    Receiver other;
+    Receiver late;
+    {
+        pubsub::Publisher<int> slow_pub("/slow", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<int> other_pub("/other", pubsub::GLOBAL, &broker);
+        auto other_sub = pubsub::api::subscribe("/other", &Receiver::onData, &other, 0, &broker);
+        auto slow_sub = pubsub::api::subscribe("/slow", &SlowReceiver::onData, &slow, 0, &broker);
+
+        slow_pub.publish(1);
+        CHECK(test_util::waitUntil([&] {return slow.started.load();}));
+
+        std::atomic<bool> closed { false };
+        std::thread closer([&] {
+            slow_sub.close(); //コールバック関数が終わるまで戻らない
+            closed = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        CHECK(!closed);
+
+        auto begin = std::chrono::steady_clock::now();
+        slow_pub.publish(2);
+        auto late_sub = pubsub::api::subscribe("/slow", &Receiver::onData, &late, 0, &broker);
+        other_pub.publish(1);
+        CHECK(std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(100));
+        CHECK(test_util::waitUntil([&] {return other.count == 1;}));
+        slow_pub.publish(3);
+        CHECK(test_util::waitUntil([&] {return late.count >= 1;}));
+        CHECK(!closed);
+
+        slow.release.set_value();
+        closer.join();
+        CHECK(closed);
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testCloseDoesNotStall();
+    return test_util::result("test_close_nonblocking");
+}
@@ -0,0 +1,122 @@
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <atomic>
+
+#include "pubsub.hpp"
+#include "coro_subscriber.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+/**
+ * メッセージを一つ待って受け取り、コルーチンの中から購読を閉じる
+ */
+pubsub::Task closeInside(pubsub::CoroSubscriber<int> *sub, std::atomic<int> *received, std::atomic<bool> *done) {
+    auto data = co_await sub->next();
+    *received = data ? *data : -1;
+    sub->close();
+    *done = true;
+}
+
+/**
+ * メッセージを一つ待って受け取り、コルーチンの中で購読を破棄する
+ */
+pubsub::Task deleteInside(std::unique_ptr<pubsub::CoroSubscriber<int>> sub, std::atomic<int> *received, std::atomic<bool> *done) {
+    auto data = co_await sub->next();
+    *received = data ? *data : -1;
+    sub.reset();
+    *done = true;
+}
+
+/**
+ * まとめて受け取り、購読が閉じられるまで続ける
+ */
+pubsub::Task consumeBatch(pubsub::CoroSubscriber<int> *sub, std::vector<size_t> *sizes, std::atomic<int> *total, std::atomic<bool> *done) {
+    while (true) {
+        auto values = co_await sub->next_batch(10);
+        if (values.empty()) {
+            break;
+        }
+        sizes->push_back(values.size());
+        *total += values.size();
+    }
+    *done = true;
+}
+
+void testCloseInsideCoroutine() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    {
+        pubsub::Publisher<int> pub("/coro", pubsub::GLOBAL, &broker);
+        pubsub::CoroSubscriber<int> sub("/coro", 0, &pool, &broker);
+        std::atomic<int> received { 0 };
+        std::atomic<bool> done { false };
+        closeInside(&sub, &received, &done);
+        CHECK(!done);
+
+        pub.publish(7);
+        CHECK(test_util::waitUntil([&] {return done.load();}));
+        CHECK(received == 7);
+    }
+    pool.waitForDone();
+    broker.stop();
+}
+
+void testDeleteInsideCoroutine() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    {
+        pubsub::Publisher<int> pub("/coro", pubsub::GLOBAL, &broker);
+        std::atomic<int> received { 0 };
+        std::atomic<bool> done { false };
+        deleteInside(std::make_unique<pubsub::CoroSubscriber<int>>("/coro", 0, &pool, &broker), &received, &done);
+        CHECK(!done);
+
+        pub.publish(8);
+        CHECK(test_util::waitUntil([&] {return done.load();}));
+        CHECK(received == 8);
+    }
+    pool.waitForDone();
+    broker.stop();
+}
+
+/**
+ * 届いているメッセージはまとめて受け取り、外から閉じると空の配列で終わる
+ */
+void testBatch() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    {
+        pubsub::Publisher<int> pub("/batch", pubsub::GLOBAL, &broker);
+        pubsub::CoroSubscriber<int> sub("/batch", 0, &pool, &broker);
+        for (int idx = 0; idx < 3; ++idx) {
+            pub.publish(idx);
+        }
+
+        std::vector<size_t> sizes;
+        std::atomic<int> total { 0 };
+        std::atomic<bool> done { false };
+        consumeBatch(&sub, &sizes, &total, &done);
+        CHECK(total == 3); //届いている分は、スレッドを切り替えずに受け取る
+
+        pub.publish(3);
+        CHECK(test_util::waitUntil([&] {return total.load() == 4;}));
+        sub.close();
+        CHECK(test_util::waitUntil([&] {return done.load();}));
+        CHECK(!sizes.empty() && sizes.front() == 3);
+    }
+    pool.waitForDone();
+    broker.stop();
+}
+}
+
+int main() {
+    testCloseInsideCoroutine();
+    testDeleteInsideCoroutine();
+    testBatch();
+    return test_util::result("test_coro_subscriber");
+}
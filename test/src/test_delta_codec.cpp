@@ -0,0 +1,107 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <limits>
+
+#include "delta_codec.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+/**
+ * 連長圧縮のヘッダだけを持つ、キーフレームを作る
+ */
+std::string keyframeWithRun(uint64_t declared_size, uint64_t run) {
+    std::string frame = "K";
+    pubsub::RunLengthCompressor::writeVarint(declared_size, frame);
+    pubsub::RunLengthCompressor::writeVarint((run << 1) | 1, frame);
+    frame.push_back('x');
+    return frame;
+}
+
+void testRoundTrip() {
+    pubsub::DeltaEncoder encoder;
+    pubsub::DeltaDecoder decoder;
+    std::vector<std::string> messages = { "pose 0000 0000 0000", "pose 0001 0000 0000", "pose 0001 0002 0000", std::string(1000, 'a'), "", "short" };
+    for (auto &msg : messages) {
+        std::string decoded;
+        auto frame = encoder.encode(msg, 4);
+        CHECK(decoder.decode(frame, decoded));
+        CHECK(decoded == msg);
+    }
+
+    std::string compressed;
+    std::string repeated(1000, 'a');
+    pubsub::RunLengthCompressor::compress(repeated.data(), repeated.size(), compressed);
+    CHECK(compressed.size() < 10);
+}
+
+/**
+ * 宣言した長さを超える繰り返しは、展開せずに捨てる
+ */
+void testOversizedRun() {
+    pubsub::DeltaDecoder decoder;
+    std::string decoded;
+    bool ok = true;
+    try {
+        ok = decoder.decode(keyframeWithRun(8, std::numeric_limits<uint64_t>::max() >> 2), decoded);
+    } catch (...) {
+        CHECK(!"decode threw");
+    }
+    CHECK(!ok);
+    CHECK(!decoder.decode(keyframeWithRun(4, 5), decoded));
+    CHECK(decoder.decode(keyframeWithRun(4, 4), decoded));
+    CHECK(decoded == "xxxx");
+
+    std::string out;
+    std::string data = keyframeWithRun(0, 1u << 30).substr(2);
+    CHECK(!pubsub::RunLengthCompressor::decompress(data.data(), data.size(), out, 1024));
+    CHECK(out.empty());
+}
+
+/**
+ * 上限を超える長さを宣言したフレームは、領域を確保せずに捨てる
+ */
+void testHugeDeclaredSize() {
+    pubsub::DeltaDecoder decoder;
+    std::string decoded;
+    bool ok = true;
+    try {
+        ok = decoder.decode(keyframeWithRun(1ull << 34, 1ull << 34), decoded);
+    } catch (...) {
+        CHECK(!"decode threw");
+    }
+    CHECK(!ok);
+    CHECK(decoded.empty());
+
+    CHECK(!decoder.decode(keyframeWithRun(pubsub::DeltaDecoder::DEFAULT_MAX_SIZE + 1, 1), decoded));
+    CHECK(!decoder.decode(keyframeWithRun(64, 64), decoded, 32)); //上限は呼び出し側で指定できる
+    CHECK(decoder.decode(keyframeWithRun(32, 32), decoded, 32));
+    CHECK(decoded == std::string(32, 'x'));
+}
+
+/**
+ * 宣言した長さを超えるバイト列も捨て、次のキーフレームまで差分を受け付けない
+ */
+void testOversizedLiteral() {
+    pubsub::DeltaEncoder encoder;
+    pubsub::DeltaDecoder decoder;
+    std::string decoded;
+    CHECK(decoder.decode(encoder.encode("abcdef", 10), decoded));
+
+    std::string frame = "K";
+    pubsub::RunLengthCompressor::writeVarint(3, frame);
+    pubsub::RunLengthCompressor::writeVarint(5 << 1, frame);
+    frame += "abcde";
+    CHECK(!decoder.decode(frame, decoded));
+    CHECK(!decoder.decode(encoder.encode("abcdeg", 10), decoded)); //差分は、キーフレームを受け取るまで復元できない
+}
+}
+
+int main() {
+    testRoundTrip();
+    testOversizedRun();
+    testHugeDeclaredSize();
+    testOversizedLiteral();
+    return test_util::result("test_delta_codec");
+}
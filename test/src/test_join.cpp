@@ -0,0 +1,118 @@
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <utility>
+
+#include "pubsub.hpp"
+#include "publish_batch.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Fusion {
+public:
+    void onSync(const int &a, const double &b) {
+        std::lock_guard<std::mutex> lk(mtx);
+        pairs.emplace_back(a, b);
+    }
+
+    std::vector<std::pair<int, double>> received() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return pairs;
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<std::pair<int, double>> pairs;
+};
+
+/**
+ * toleranceが0の場合は、同時に出版した組だけを受け取る
+ */
+void testExactJoin() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Fusion fusion;
+    {
+        pubsub::Publisher<int> pub_a("/a", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<double> pub_b("/b", pubsub::GLOBAL, &broker);
+        auto sub = pubsub::api::subscribe_join<Fusion, int, double>({"/a", "/b"}, &Fusion::onSync, &fusion, std::chrono::nanoseconds(0), 0, &broker);
+        CHECK(sub.isValid());
+
+        pubsub::PublishBatch batch(&broker);
+        batch.add("/a", 1);
+        batch.add("/b", 1.5);
+        batch.commit();
+        CHECK(test_util::waitUntil([&] {return fusion.received().size() == 1;}));
+
+        pub_a.publish(2); //出版時刻が異なるので、組にならない
+        pub_b.publish(2.5);
+        batch.add("/a", 3);
+        batch.add("/b", 3.5);
+        batch.commit();
+        CHECK(test_util::waitUntil([&] {return fusion.received().size() >= 2;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        auto pairs = fusion.received();
+        CHECK(pairs.size() == 2);
+        CHECK(pairs.size() == 2 && pairs[0] == std::make_pair(1, 1.5) && pairs[1] == std::make_pair(3, 3.5));
+    }
+    broker.stop();
+}
+
+/**
+ * tolerance以内の組を受け取り、相手が来なかった古いメッセージは読み飛ばす
+ */
+void testApproximateJoin() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Fusion fusion;
+    {
+        pubsub::Publisher<int> pub_a("/a", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<double> pub_b("/b", pubsub::GLOBAL, &broker);
+        auto sub = pubsub::api::subscribe_join<Fusion, int, double>({"/a", "/b"}, &Fusion::onSync, &fusion, std::chrono::milliseconds(50), 0, &broker);
+
+        pub_a.publish(10);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        pub_b.publish(10.5);
+        CHECK(test_util::waitUntil([&] {return fusion.received().size() == 1;}));
+
+        pub_a.publish(20); //相手が来ない
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        pub_a.publish(21);
+        pub_b.publish(21.5);
+        CHECK(test_util::waitUntil([&] {return fusion.received().size() == 2;}));
+        auto pairs = fusion.received();
+        CHECK(pairs.size() == 2 && pairs[1] == std::make_pair(21, 21.5));
+
+        sub.close();
+        pub_a.publish(30);
+        pub_b.publish(30.5);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(fusion.received().size() == 2);
+    }
+    broker.stop();
+}
+
+/**
+ * 型の一致しないトピックとは、結合購読できない
+ */
+void testTypeMismatch() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Fusion fusion;
+    {
+        pubsub::Publisher<std::string> pub("/b", pubsub::GLOBAL, &broker);
+        auto sub = pubsub::api::subscribe_join<Fusion, int, double>({"/a", "/b"}, &Fusion::onSync, &fusion, std::chrono::milliseconds(5), 0, &broker);
+        CHECK(!sub.isValid());
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testExactJoin();
+    testApproximateJoin();
+    testTypeMismatch();
+    return test_util::result("test_join");
+}
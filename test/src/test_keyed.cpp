@@ -0,0 +1,138 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Tracker {
+public:
+    void onPosition(const int &key, const double &value) {
+        std::lock_guard<std::mutex> lk(mtx);
+        latest[key] = value;
+        count++;
+    }
+
+    std::map<int, double> received() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return latest;
+    }
+
+    int calls() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return count;
+    }
+
+private:
+    std::mutex mtx;
+    std::map<int, double> latest;
+    int count = 0;
+};
+
+/**
+ * 頻繁に出版されるキーが、他のキーのメッセージを押し出さない
+ */
+void testKeysDoNotEvictEachOther() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    pubsub::extra_api::setThreadPool("/tracks", &pool, &broker);
+
+    Tracker tracker;
+    {
+        pubsub::KeyedPublisher<int, double> pub("/tracks", &broker);
+        auto sub = pubsub::api::subscribe_keyed("/tracks", &Tracker::onPosition, &tracker, false, &broker);
+
+        test_util::PoolBlocker blocker(&pool);
+        for (int idx = 0; idx < 100; ++idx) {
+            pub.publish(1, idx);
+        }
+        pub.publish(2, 0.5);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        blocker.release();
+
+        CHECK(test_util::waitUntil([&] {
+            auto latest = tracker.received();
+            return latest.count(2) != 0 && latest.count(1) != 0 && latest[1] == 99;
+        }));
+        CHECK(tracker.calls() <= 3); //キー1は、最初に投入したものと最新のものだけ
+        CHECK(tracker.received()[2] == 0.5);
+
+        double value = 0;
+        CHECK(pubsub::api::getLatestKeyedData("/tracks", 1, value, &broker) && value == 99);
+    }
+    broker.stop();
+}
+
+/**
+ * 出版されなくなったキーは、設定した時間が過ぎた後の出版で破棄される
+ */
+void testIdleKeysEvicted() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::extra_api::setKeyIdleTimeout("/sessions", std::chrono::milliseconds(30), &broker);
+    {
+        pubsub::KeyedPublisher<int, double> pub("/sessions", &broker);
+        pubsub::KeyedPublisher<int, double> kept_pub("/kept", &broker);
+        for (int key = 0; key < 100; ++key) {
+            pub.publish(key, key);
+            kept_pub.publish(key, key);
+        }
+        double value = 0;
+        CHECK(pubsub::api::getLatestKeyedData("/sessions", 0, value, &broker));
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        pub.publish(1000, 1.0);
+        kept_pub.publish(1000, 1.0);
+
+        CHECK(!pubsub::api::getLatestKeyedData("/sessions", 0, value, &broker));
+        CHECK(!pubsub::api::getLatestKeyedData("/sessions", 99, value, &broker));
+        CHECK(pubsub::api::getLatestKeyedData("/sessions", 1000, value, &broker) && value == 1.0);
+        CHECK(pubsub::api::getLatestKeyedData("/kept", 0, value, &broker)); //設定しないトピックでは破棄しない
+
+        pub.publish(0, 2.0); //破棄されたキーにも、再び出版できる
+        CHECK(pubsub::api::getLatestKeyedData("/sessions", 0, value, &broker) && value == 2.0);
+    }
+    broker.stop();
+}
+
+/**
+ * 未送信のメッセージが残っているキーは、破棄されない
+ */
+void testPendingKeysKept() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    pubsub::extra_api::setThreadPool("/pending", &pool, &broker);
+    pubsub::extra_api::setKeyIdleTimeout("/pending", std::chrono::milliseconds(20), &broker);
+
+    Tracker tracker;
+    {
+        pubsub::KeyedPublisher<int, double> pub("/pending", &broker);
+        auto sub = pubsub::api::subscribe_keyed("/pending", &Tracker::onPosition, &tracker, false, &broker);
+
+        test_util::PoolBlocker blocker(&pool);
+        pub.publish(1, 1.0);
+        pub.publish(2, 2.0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        pub.publish(3, 3.0);
+        blocker.release();
+
+        CHECK(test_util::waitUntil([&] {return tracker.received().size() == 3;}));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testKeysDoNotEvictEachOther();
+    testIdleKeysEvicted();
+    testPendingKeysKept();
+    return test_util::result("test_keyed");
+}
@@ -0,0 +1,83 @@
+#include <iostream>
+#include <vector>
+#include <poll.h>
+
+#include "pubsub.hpp"
+#include "pollable_subscriber.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+/**
+ * fdが読み込み可能かどうかを、待たずに調べる
+ */
+bool readable(int fd) {
+    pollfd pfd { fd, POLLIN, 0 };
+    return ::poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+/**
+ * 未読のメッセージがある間だけ、fdが読み込み可能になる
+ */
+void testReadiness() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    {
+        pubsub::PollableSubscriber<int> sub("/poll", 0, &broker);
+        CHECK(sub.isValid());
+        CHECK(!readable(sub.fd()));
+
+        pubsub::Publisher<int> pub("/poll", pubsub::GLOBAL, &broker);
+        pub.publish(1);
+        pub.publish(2);
+        CHECK(readable(sub.fd()));
+
+        int value = 0;
+        CHECK(sub.try_take(value) && value == 1);
+        CHECK(readable(sub.fd()));
+        CHECK(sub.try_take(value) && value == 2);
+        CHECK(!readable(sub.fd()));
+        CHECK(!sub.try_take(value));
+
+        pub.publish(3);
+        std::vector<int> values;
+        CHECK(sub.drain(values, 8) == 1 && values[0] == 3);
+        CHECK(!readable(sub.fd()));
+    }
+    broker.stop();
+}
+
+/**
+ * 有効期間が過ぎて読み飛ばされたメッセージは、fdを読み込み可能なままにしない
+ */
+void testExpiredClearsReadiness() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::extra_api::setTimeToLive("/poll_ttl", std::chrono::milliseconds(30), &broker);
+    {
+        pubsub::PollableSubscriber<int> sub("/poll_ttl", 0, &broker);
+        pubsub::Publisher<int> pub("/poll_ttl", pubsub::GLOBAL, &broker);
+        pub.publish(1);
+        CHECK(readable(sub.fd()));
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        int value = 0;
+        CHECK(!sub.try_take(value));
+        CHECK(!readable(sub.fd()));
+
+        pub.publish(2);
+        CHECK(readable(sub.fd()));
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        std::vector<int> values;
+        CHECK(sub.drain(values, 8) == 0);
+        CHECK(!readable(sub.fd()));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testReadiness();
+    testExpiredClearsReadiness();
+    return test_util::result("test_pollable");
+}
@@ -0,0 +1,160 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "pubsub.hpp"
+#include "publish_batch.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Recorder {
+public:
+    void onBulk(const int&) {
+        add("/bulk");
+    }
+    void onCritical(const int&) {
+        add("/critical");
+    }
+    void onLate(const int&) {
+        add("/late");
+    }
+    void onUrgent(const int&) {
+        add("/urgent");
+    }
+    void onLow(const int&) {
+        add("low");
+    }
+    void onHigh(const int&) {
+        add("high");
+    }
+
+    std::vector<std::string> calls() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return history;
+    }
+
+    size_t count() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return history.size();
+    }
+
+private:
+    void add(const std::string &name) {
+        std::lock_guard<std::mutex> lk(mtx);
+        history.push_back(name);
+    }
+
+    std::mutex mtx;
+    std::vector<std::string> history;
+};
+
+/**
+ * 待ち行列に並んだコールバック関数は、トピックの優先度の高いものから実行される
+ */
+void testPoolQueuePriority() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    pubsub::extra_api::setThreadPool("/bulk", &pool, &broker);
+    pubsub::extra_api::setThreadPool("/critical", &pool, &broker);
+    pubsub::extra_api::setPriority("/critical", 10, std::chrono::microseconds(0), &broker);
+
+    Recorder recorder;
+    {
+        auto bulk1 = pubsub::api::subscribe("/bulk", &Recorder::onBulk, &recorder, 0, &broker);
+        auto bulk2 = pubsub::api::subscribe("/bulk", &Recorder::onBulk, &recorder, 0, &broker);
+        auto bulk3 = pubsub::api::subscribe("/bulk", &Recorder::onBulk, &recorder, 0, &broker);
+        auto critical = pubsub::api::subscribe("/critical", &Recorder::onCritical, &recorder, 0, &broker);
+        pubsub::Publisher<int> bulk_pub("/bulk", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<int> critical_pub("/critical", pubsub::GLOBAL, &broker);
+
+        test_util::PoolBlocker blocker(&pool);
+        bulk_pub.publish(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100)); //bulkのコールバック関数が、先に待ち行列に並ぶ
+        critical_pub.publish(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        blocker.release();
+
+        CHECK(test_util::waitUntil([&] {return recorder.count() == 4;}));
+        auto calls = recorder.calls();
+        CHECK(!calls.empty() && calls.front() == "/critical");
+    }
+    broker.stop();
+}
+
+/**
+ * 同じ優先度のトピックは、処理期限の早いものから投入される
+ */
+void testDeadlineOrder() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    pubsub::extra_api::setThreadPool("/late", &pool, &broker);
+    pubsub::extra_api::setThreadPool("/urgent", &pool, &broker);
+    pubsub::extra_api::setPriority("/late", 0, std::chrono::milliseconds(500), &broker);
+    pubsub::extra_api::setPriority("/urgent", 0, std::chrono::milliseconds(1), &broker);
+
+    Recorder recorder;
+    {
+        auto late = pubsub::api::subscribe("/late", &Recorder::onLate, &recorder, 0, &broker);
+        auto urgent = pubsub::api::subscribe("/urgent", &Recorder::onUrgent, &recorder, 0, &broker);
+
+        for (int round = 0; round < 3; ++round) {
+            test_util::PoolBlocker blocker(&pool);
+            pubsub::PublishBatch batch(&broker); //同じ出版時刻で、同じディスパッチで処理される
+            batch.add("/late", round);
+            batch.add("/urgent", round);
+            batch.commit();
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            blocker.release();
+            CHECK(test_util::waitUntil([&] {return recorder.count() == static_cast<size_t>(round + 1) * 2;}));
+        }
+        auto calls = recorder.calls();
+        CHECK(calls.size() == 6);
+        for (size_t idx = 0; idx + 1 < calls.size(); idx += 2) {
+            CHECK(calls[idx] == "/urgent");
+        }
+    }
+    broker.stop();
+}
+
+/**
+ * 同じトピックの中では、購読の優先度の高いものから実行される
+ */
+void testSubscriptionPriority() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    pubsub::extra_api::setThreadPool("/multi", &pool, &broker);
+
+    Recorder recorder;
+    {
+        auto low = pubsub::api::subscribe("/multi", &Recorder::onLow, &recorder, 0, &broker);
+        auto high = pubsub::api::subscribe("/multi", &Recorder::onHigh, &recorder, 0, &broker);
+        high.setPriority(5);
+        pubsub::Publisher<int> pub("/multi", pubsub::GLOBAL, &broker);
+
+        test_util::PoolBlocker blocker(&pool);
+        pub.publish(1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        blocker.release();
+
+        CHECK(test_util::waitUntil([&] {return recorder.count() == 2;}));
+        auto calls = recorder.calls();
+        CHECK(!calls.empty() && calls.front() == "high");
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testPoolQueuePriority();
+    testDeadlineOrder();
+    testSubscriptionPriority();
+    return test_util::result("test_priority");
+}
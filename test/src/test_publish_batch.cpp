@@ -0,0 +1,134 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "pubsub.hpp"
+#include "publish_batch.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Recorder {
+public:
+    void onSeq(const int &value) {
+        std::lock_guard<std::mutex> lk(mtx);
+        seq.push_back(value);
+    }
+    void onName(const std::string &value) {
+        std::lock_guard<std::mutex> lk(mtx);
+        names.push_back(value);
+    }
+
+    std::vector<int> receivedSeq() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return seq;
+    }
+
+    std::vector<std::string> receivedNames() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return names;
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<int> seq;
+    std::vector<std::string> names;
+};
+
+/**
+ * 同じトピックに追加したメッセージは、追加した順に全て届く
+ */
+void testOrderWithinTopic() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Recorder recorder;
+    {
+        auto seq = pubsub::api::subscribe("/seq", &Recorder::onSeq, &recorder, 0, &broker);
+        auto name = pubsub::api::subscribe("/name", &Recorder::onName, &recorder, 0, &broker);
+
+        pubsub::PublishBatch batch(&broker);
+        batch.add("/seq", 1);
+        batch.add("/name", std::string("a"));
+        batch.add("/seq", 2);
+        batch.add("/seq", 3);
+        CHECK(batch.size() == 4);
+        batch.commit();
+        CHECK(batch.size() == 0);
+
+        CHECK(test_util::waitUntil([&] {return recorder.receivedSeq().size() == 3 && recorder.receivedNames().size() == 1;}));
+        CHECK(recorder.receivedSeq() == std::vector<int>({ 1, 2, 3 }));
+        CHECK(recorder.receivedNames() == std::vector<std::string>({ "a" }));
+    }
+    broker.stop();
+}
+
+/**
+ * 前回と同じ順でも違う順でも、再利用した領域から正しい値が出版される
+ */
+void testReuseAcrossCommits() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Recorder recorder;
+    {
+        auto seq = pubsub::api::subscribe("/seq", &Recorder::onSeq, &recorder, 0, &broker);
+        auto name = pubsub::api::subscribe("/name", &Recorder::onName, &recorder, 0, &broker);
+
+        pubsub::PublishBatch batch(&broker);
+        batch.add("/seq", 1);
+        batch.add("/name", std::string("a"));
+        batch.commit();
+        CHECK(test_util::waitUntil([&] {return recorder.receivedSeq().size() == 1;}));
+
+        batch.add("/seq", 2); //前回と同じ順
+        batch.add("/name", std::string("b"));
+        batch.commit();
+        CHECK(test_util::waitUntil([&] {return recorder.receivedSeq().size() == 2;}));
+
+        batch.add("/name", std::string("c")); //順番が変わった
+        batch.add("/seq", 3);
+        batch.commit();
+        CHECK(test_util::waitUntil([&] {return recorder.receivedSeq().size() == 3 && recorder.receivedNames().size() == 3;}));
+
+        batch.add("/seq", 4); //前回より少ない
+        batch.commit();
+        CHECK(test_util::waitUntil([&] {return recorder.receivedSeq().size() == 4;}));
+
+        batch.add("/seq", 5);
+        batch.clear(); //捨てたメッセージは出版されない
+        batch.commit();
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+        CHECK(recorder.receivedSeq() == std::vector<int>({ 1, 2, 3, 4 }));
+        CHECK(recorder.receivedNames() == std::vector<std::string>({ "a", "b", "c" }));
+    }
+    broker.stop();
+}
+
+/**
+ * 型の一致しないトピックへのメッセージだけが捨てられる
+ */
+void testTypeMismatchDropped() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Recorder recorder;
+    {
+        auto seq = pubsub::api::subscribe("/seq", &Recorder::onSeq, &recorder, 0, &broker);
+        pubsub::PublishBatch batch(&broker);
+        batch.add("/seq", std::string("wrong"));
+        batch.add("/seq", 7);
+        batch.commit();
+        CHECK(test_util::waitUntil([&] {return recorder.receivedSeq().size() == 1;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(recorder.receivedSeq() == std::vector<int>({ 7 }));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testOrderWithinTopic();
+    testReuseAcrossCommits();
+    testTypeMismatchDropped();
+    return test_util::result("test_publish_batch");
+}
@@ -0,0 +1,111 @@
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Receiver {
+public:
+    void onData(const int &data) {
+        std::lock_guard<std::mutex> lk(mtx);
+        values.push_back(data);
+    }
+
+    size_t count() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return values.size();
+    }
+
+    std::vector<int> received() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return values;
+    }
+
+    int last() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return values.empty() ? -1 : values.back();
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<int> values;
+};
+
+/**
+ * N個に1個のメッセージだけを受信する
+ */
+void testDecimation() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/decimated", &Receiver::onData, &receiver, 0, &broker);
+        sub.setDecimation(3);
+        pubsub::Publisher<int> pub("/decimated", pubsub::GLOBAL, &broker);
+        for (int idx = 0; idx < 9; ++idx) {
+            pub.publish(idx);
+        }
+        CHECK(test_util::waitUntil([&] {return receiver.count() == 3;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(receiver.count() == 3);
+    }
+    broker.stop();
+}
+
+/**
+ * 最小間隔の間に届いたメッセージは、最新のもの以外読み飛ばされる
+ */
+void testMinInterval() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/throttled", &Receiver::onData, &receiver, 0, &broker);
+        sub.setMaxRate(5); //200msに1回
+        pubsub::Publisher<int> pub("/throttled", pubsub::GLOBAL, &broker);
+        for (int idx = 0; idx < 30; ++idx) { //約300msの間に出版する
+            pub.publish(idx);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        CHECK(test_util::waitUntil([&] {return receiver.last() == 29;})); //最新のメッセージは、間隔が過ぎた後に届く
+        CHECK(receiver.count() >= 2);
+        CHECK(receiver.count() <= 4);
+    }
+    broker.stop();
+}
+
+/**
+ * 間引きと最小間隔を併用しても、選ばれたメッセージは選ばれないメッセージに押し出されず、間隔が過ぎた後に届く
+ */
+void testDecimationWithInterval() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/sampled", &Receiver::onData, &receiver, 0, &broker);
+        sub.setDecimation(2);
+        sub.setMinInterval(std::chrono::milliseconds(200));
+        pubsub::Publisher<int> pub("/sampled", pubsub::GLOBAL, &broker);
+        pub.publish(0);
+        CHECK(test_util::waitUntil([&] {return receiver.count() == 1;}));
+        pub.publish(1);
+        pub.publish(2); //間引きで選ばれるが、最小間隔が過ぎていない
+        pub.publish(3); //間引きで選ばれない
+
+        CHECK(test_util::waitUntil([&] {return receiver.count() == 2;}, std::chrono::milliseconds(1000)));
+        CHECK(receiver.received() == std::vector<int>({ 0, 2 }));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testDecimation();
+    testMinInterval();
+    testDecimationWithInterval();
+    return test_util::result("test_rate_limit");
+}
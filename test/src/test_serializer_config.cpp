@@ -0,0 +1,143 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+/**
+ * 先頭に印を付けるシリアライザ
+ */
+class TaggedSerializer {
+public:
+    template<class DataType>
+    std::string serialize(DataType &data) {
+        return "tagged:" + std::to_string(data);
+    }
+
+    template<class DataType>
+    DataType deserialize(const std::string &msg) {
+        return static_cast<DataType>(std::stoi(msg.substr(7)));
+    }
+};
+
+class Receiver {
+public:
+    void onSerialized(const std::string &topic, const std::string &msg) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (topic == "/tagged") {
+            serialized.push_back(msg);
+        }
+    }
+
+    void onData(const int &data) {
+        std::lock_guard<std::mutex> lk(mtx);
+        values.push_back(data);
+    }
+
+    bool hasSerialized(const std::string &msg) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return std::find(serialized.begin(), serialized.end(), msg) != serialized.end();
+    }
+
+    bool hasValue(int value) {
+        std::lock_guard<std::mutex> lk(mtx);
+        return std::find(values.begin(), values.end(), value) != values.end();
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<std::string> serialized;
+    std::vector<int> values;
+};
+
+/**
+ * トピックが破棄されて再び生成されても、設定したシリアライザが使われる
+ */
+void testSerializerSurvivesRecreation() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    {
+        pubsub::extra_api::setSerializer<int, TaggedSerializer>("/tagged", &broker);
+        auto tap = pubsub::extra_api::subscribe_serialized(&Receiver::onSerialized, &receiver, 0, pubsub::NO_EXCEPT, &broker);
+        {
+            pubsub::Publisher<int> pub("/tagged", pubsub::GLOBAL, &broker);
+            pub.publish(5);
+            CHECK(test_util::waitUntil([&] {return receiver.hasSerialized("tagged:5");}));
+        } //参照がなくなり、トピックは破棄される
+        {
+            pubsub::Publisher<int> pub("/tagged", pubsub::GLOBAL, &broker);
+            pub.publish(6);
+            CHECK(test_util::waitUntil([&] {return receiver.hasSerialized("tagged:6");}));
+            CHECK(!receiver.hasSerialized("6"));
+        }
+    }
+    broker.stop();
+}
+
+/**
+ * シリアライズされたメッセージの出版も、設定したシリアライザで復元する
+ */
+void testDeserializeAfterRecreation() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    pubsub::extra_api::setSerializer<int, TaggedSerializer>("/tagged", &broker);
+    {
+        pubsub::Publisher<int> pub("/tagged", pubsub::GLOBAL, &broker);
+    }
+    {
+        auto sub = pubsub::api::subscribe("/tagged", &Receiver::onData, &receiver, 0, &broker);
+        pubsub::extra_api::publish_serialized("/tagged", "tagged:9", 1, pubsub::GLOBAL, &broker);
+        CHECK(test_util::waitUntil([&] {return receiver.hasValue(9);}));
+    }
+    broker.stop();
+}
+
+/**
+ * 削除した設定や既定値に戻した設定は、トピックが破棄された後に残らない
+ */
+void testConfigRemoved() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    {
+        CHECK(pubsub::extra_api::topicConfigCount(&broker) == 0);
+        pubsub::extra_api::setRetention("/session/1", std::chrono::milliseconds(100), &broker);
+        pubsub::extra_api::setRetention("/session/1", std::chrono::milliseconds(0), &broker); //既定値に戻す
+        {
+            pubsub::Publisher<int> pub("/session/1", pubsub::GLOBAL, &broker);
+            CHECK(pubsub::extra_api::topicConfigCount(&broker) == 1);
+        }
+        CHECK(pubsub::extra_api::topicConfigCount(&broker) == 0);
+
+        pubsub::extra_api::setSerializer<int, TaggedSerializer>("/tagged", &broker);
+        auto tap = pubsub::extra_api::subscribe_serialized(&Receiver::onSerialized, &receiver, 0, pubsub::NO_EXCEPT, &broker);
+        {
+            pubsub::Publisher<int> pub("/tagged", pubsub::GLOBAL, &broker);
+        }
+        CHECK(pubsub::extra_api::topicConfigCount(&broker) == 1); //設定したシリアライザは残る
+
+        pubsub::extra_api::clearTopicConfig("/tagged", &broker);
+        CHECK(pubsub::extra_api::topicConfigCount(&broker) == 0);
+        {
+            pubsub::Publisher<int> pub("/tagged", pubsub::GLOBAL, &broker);
+            pub.publish(7);
+            CHECK(test_util::waitUntil([&] {return receiver.hasSerialized("7");})); //既定のシリアライザに戻る
+            CHECK(!receiver.hasSerialized("tagged:7"));
+        }
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testSerializerSurvivesRecreation();
+    testDeserializeAfterRecreation();
+    testConfigRemoved();
+    return test_util::result("test_serializer_config");
+}
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+
+#include "simd_serializer.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+struct Pose {
+    double x;
+    double y;
+    float yaw;
+};
+
+void testArraySerializer() {
+    pubsub::arraySerializer serializer;
+    std::vector<float> values = { 1.5f, -2.25f, 3.0f };
+    auto msg = serializer.serialize(values);
+    CHECK(msg.size() == sizeof(uint64_t) + values.size() * sizeof(float));
+    CHECK(serializer.deserialize<std::vector<float>>(msg) == values);
+
+    Pose pose { 1.0, 2.0, 0.5f };
+    auto pose_msg = serializer.serialize(pose);
+    auto decoded = serializer.deserialize<Pose>(pose_msg);
+    CHECK(decoded.x == 1.0 && decoded.y == 2.0 && decoded.yaw == 0.5f);
+
+    CHECK(serializer.deserialize<std::vector<float>>(msg.substr(0, msg.size() - 1)).empty()); //要素が足りない
+}
+
+void testQuantizedSerializer() {
+    pubsub::quantizedSerializer serializer;
+    std::vector<float> values;
+    for (int idx = 0; idx < 37; ++idx) { //SIMDの幅で割り切れない数
+        values.push_back(std::sin(idx * 0.1f) * 10.0f);
+    }
+    auto decoded = serializer.deserialize<std::vector<float>>(serializer.serialize(values));
+    CHECK(decoded.size() == values.size());
+    float tolerance = 20.0f / 131070.0f * 1.01f;
+    for (size_t idx = 0; idx < decoded.size() && idx < values.size(); ++idx) {
+        CHECK(std::fabs(decoded[idx] - values[idx]) <= tolerance);
+    }
+}
+
+void testVarintRoundTrip() {
+    pubsub::varintSerializer serializer;
+    std::vector<int32_t> small(100);
+    for (int idx = 0; idx < 100; ++idx) {
+        small[idx] = (idx % 2 ? -idx : idx) % 60;
+    }
+    auto msg = serializer.serialize(small);
+    CHECK(msg.size() == 1 + small.size()); //全て1byteに収まる
+    CHECK(serializer.deserialize<std::vector<int32_t>>(msg) == small);
+
+    std::vector<int64_t> large = { 0, -1, 1, INT64_MIN, INT64_MAX, 300, -300 };
+    CHECK(serializer.deserialize<std::vector<int64_t>>(serializer.serialize(large)) == large);
+
+    std::vector<uint16_t> unsigned_values = { 0, 127, 128, 65535 };
+    CHECK(serializer.deserialize<std::vector<uint16_t>>(serializer.serialize(unsigned_values)) == unsigned_values);
+}
+
+/**
+ * 複数byteの要素があるため、要素数の確認は通るが途中でデータが尽きる場合は、空にする
+ */
+void testVarintTruncated() {
+    pubsub::varintSerializer serializer;
+    std::string msg;
+    pubsub::RunLengthCompressor::writeVarint(40, msg);
+    msg.push_back(static_cast<char>(0x80)); //2byteの要素
+    msg.push_back(0x01);
+    msg.append(38, 0x02);
+    CHECK(msg.size() == 41);
+    CHECK(serializer.deserialize<std::vector<int32_t>>(msg).empty());
+
+    std::string unterminated;
+    pubsub::RunLengthCompressor::writeVarint(1, unterminated);
+    unterminated.push_back(static_cast<char>(0x80)); //継続bitで終わる
+    CHECK(serializer.deserialize<std::vector<uint32_t>>(unterminated).empty());
+}
+}
+
+int main() {
+    testArraySerializer();
+    testQuantizedSerializer();
+    testVarintRoundTrip();
+    testVarintTruncated();
+    return test_util::result("test_serializers");
+}
@@ -0,0 +1,156 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Calculator {
+public:
+    int twice(const int &value) {
+        caller = std::this_thread::get_id();
+        return value * 2;
+    }
+
+    int slow(const int &value) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        finished++;
+        return value;
+    }
+
+    int fail(const int&) {
+        throw 1; //std::runtime_error以外の例外
+    }
+
+    std::thread::id caller;
+    std::atomic<int> finished { 0 };
+};
+
+/**
+ * 登録の解除後に実行されたハンドラを数える
+ */
+class Guarded {
+public:
+    int handle(const int &value) {
+        if (closed) {
+            late_calls++; //サーバーを破棄した後に実行された
+        }
+        return value;
+    }
+
+    std::atomic<bool> closed { false };
+    std::atomic<int> late_calls { 0 };
+};
+
+/**
+ * スレッドプールが設定されていないサービスは、futureを返すcallでは呼び出し元のスレッドで実行される
+ */
+void testDirectCall() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Calculator calc;
+    {
+        auto server = pubsub::api::advertise_service("/twice", &Calculator::twice, &calc, nullptr, &broker);
+        CHECK(server.isValid());
+        auto future = pubsub::api::call<int, int>("/twice", 21, &broker);
+        CHECK(future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+        CHECK(future.get() == 42);
+        CHECK(calc.caller == std::this_thread::get_id());
+
+        int rep = 0;
+        CHECK(pubsub::api::call<int, int>("/twice", 5, rep, std::chrono::milliseconds(1000), &broker));
+        CHECK(rep == 10);
+    }
+    broker.stop();
+}
+
+/**
+ * スレッドプールが設定されていないサービスでも、タイムアウトで戻る
+ */
+void testTimeout() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Calculator calc;
+    {
+        auto server = pubsub::api::advertise_service("/slow", &Calculator::slow, &calc, nullptr, &broker);
+        int rep = 0;
+        auto begin = std::chrono::steady_clock::now();
+        CHECK(!pubsub::api::call<int, int>("/slow", 1, rep, std::chrono::milliseconds(20), &broker));
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        CHECK(elapsed < std::chrono::milliseconds(200));
+        CHECK(calc.finished == 0);
+    } //サービスの停止は、実行中のハンドラを待つ
+    CHECK(calc.finished == 1);
+    broker.stop();
+}
+
+/**
+ * ハンドラが投げた例外や、見つからないサービスは、falseになる
+ */
+void testFailure() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Calculator calc;
+    {
+        auto server = pubsub::api::advertise_service("/fail", &Calculator::fail, &calc, nullptr, &broker);
+        int rep = -1;
+        CHECK(!pubsub::api::call<int, int>("/fail", 1, rep, std::chrono::milliseconds(1000), &broker));
+        CHECK(!pubsub::api::call<int, int>("/missing", 1, rep, std::chrono::milliseconds(1000), &broker));
+        CHECK(rep == -1);
+    }
+    broker.stop();
+}
+
+/**
+ * 呼び出しと登録の解除が並行しても、解除から戻った後にハンドラは実行されない
+ */
+void testCallDuringUnadvertise() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Guarded guarded;
+    std::atomic<bool> done { false };
+    std::atomic<int> not_found { 0 };
+    std::vector<std::thread> callers;
+    for (int idx = 0; idx < 2; ++idx) {
+        callers.emplace_back([&] {
+            while (!done) {
+                try {
+                    pubsub::api::call<int, int>("/race", 1, &broker).get();
+                } catch (const std::runtime_error&) {
+                    not_found++; //解除された後は、見つからない
+                }
+            }
+        });
+    }
+
+    for (int round = 0; round < 300; ++round) {
+        guarded.closed = false;
+        {
+            auto server = pubsub::api::advertise_service("/race", &Guarded::handle, &guarded, nullptr, &broker);
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        guarded.closed = true;
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    done = true;
+    for (auto &caller : callers) {
+        caller.join();
+    }
+    CHECK(guarded.late_calls == 0);
+    CHECK(not_found > 0);
+    broker.stop();
+}
+}
+
+int main() {
+    testDirectCall();
+    testTimeout();
+    testFailure();
+    testCallDuringUnadvertise();
+    return test_util::result("test_service");
+}
@@ -0,0 +1,108 @@
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <thread>
+
+#include "pubsub.hpp"
+#include "publish_batch.hpp"
+#include "snapshot_reader.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+/**
+ * 全てのトピックに出版されるまでは、読み込みに失敗する
+ */
+void testReadLatest() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    {
+        pubsub::SnapshotReader<int, std::vector<double>> reader({"/mode", "/joints"}, &broker);
+        CHECK(reader.isValid());
+        int mode = -1;
+        std::vector<double> joints;
+        CHECK(!reader.read(mode, joints));
+        CHECK(mode == -1);
+
+        pubsub::Publisher<int> mode_pub("/mode", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<std::vector<double>> joints_pub("/joints", pubsub::GLOBAL, &broker);
+        mode_pub.publish(1);
+        CHECK(!reader.read(mode, joints));
+        CHECK(mode == 1);
+
+        joints_pub.publish(std::vector<double> { 0.1, 0.2, 0.3 });
+        CHECK(reader.read(mode, joints));
+        CHECK(joints.size() == 3);
+
+        auto *buffer = joints.data();
+        joints_pub.publish(std::vector<double> { 0.4, 0.5, 0.6 });
+        mode_pub.publish(2);
+        CHECK(reader.read(mode, joints));
+        CHECK(mode == 2 && joints[0] == 0.4);
+        CHECK(joints.data() == buffer); //出力先の領域は使い回される
+    }
+    broker.stop();
+}
+
+/**
+ * まとめて出版した組は、読み込みで分かれない
+ */
+void testConsistentWithBatch() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    {
+        pubsub::Publisher<int> x_pub("/x", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<int> y_pub("/y", pubsub::GLOBAL, &broker);
+        pubsub::SnapshotReader<int, int> reader({"/x", "/y"}, &broker);
+
+        std::atomic<bool> done { false };
+        std::thread writer([&] {
+            pubsub::PublishBatch batch(&broker);
+            for (int idx = 0; idx < 5000; ++idx) {
+                batch.add("/x", idx);
+                batch.add("/y", idx);
+                batch.commit();
+            }
+            done = true;
+        });
+
+        int mismatches = 0;
+        int reads = 0;
+        while (!done) {
+            int x = 0, y = 0;
+            if (reader.read(x, y)) {
+                reads++;
+                mismatches += (x != y);
+            }
+        }
+        writer.join();
+        CHECK(mismatches == 0);
+        int x = 0, y = 0;
+        CHECK(reader.read(x, y) && x == 4999 && y == 4999);
+    }
+    broker.stop();
+}
+
+/**
+ * 型の一致しないトピックは読み込めない
+ */
+void testTypeMismatch() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    {
+        pubsub::Publisher<int> pub("/typed", pubsub::GLOBAL, &broker);
+        pubsub::SnapshotReader<double> reader({"/typed"}, &broker);
+        CHECK(!reader.isValid());
+        double value = 0;
+        CHECK(!reader.read(value));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testReadLatest();
+    testConsistentWithBatch();
+    testTypeMismatch();
+    return test_util::result("test_snapshot_reader");
+}
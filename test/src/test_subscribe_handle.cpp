@@ -0,0 +1,85 @@
+#include <iostream>
+#include <vector>
+#include <atomic>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Receiver {
+public:
+    void onFirst(const int&) {
+        first++;
+    }
+
+    void onSecond(const int&) {
+        second++;
+    }
+
+    std::atomic<int> first { 0 };
+    std::atomic<int> second { 0 };
+};
+
+/**
+ * 閉じた購読のスロットが再利用されても、古いハンドラでは操作できない
+ */
+void testStaleHandle() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    {
+        pubsub::Publisher<int> pub("/handle", pubsub::GLOBAL, &broker);
+        auto stale = broker.subscribe("/handle", &Receiver::onFirst, &receiver);
+        broker.close_subscribe("/handle", stale);
+        auto handler = broker.subscribe("/handle", &Receiver::onSecond, &receiver);
+        CHECK(handler != stale);
+        CHECK((handler & 0xffffffff) == (stale & 0xffffffff)); //同じスロットを、次の世代で使う
+
+        broker.pause_subscribe("/handle", stale);
+        broker.close_subscribe("/handle", stale);
+        pub.publish(1);
+        CHECK(test_util::waitUntil([&] {return receiver.second == 1;}));
+        CHECK(receiver.first == 0);
+        broker.close_subscribe("/handle", handler);
+    }
+    broker.stop();
+}
+
+/**
+ * 一時停止した購読にはメッセージが届かず、再開すると届く
+ */
+void testPauseResume() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Receiver receiver;
+    {
+        pubsub::Publisher<int> pub("/pause", pubsub::GLOBAL, &broker);
+        std::vector<pubsub::Subscriber> subs;
+        for (int idx = 0; idx < 200; ++idx) {
+            subs.push_back(pubsub::api::subscribe("/pause", &Receiver::onFirst, &receiver, 0, &broker));
+        }
+        for (size_t idx = 1; idx < subs.size(); idx += 2) {
+            subs[idx].pause();
+        }
+        pub.publish(1);
+        CHECK(test_util::waitUntil([&] {return receiver.first == 100;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(receiver.first == 100);
+
+        for (size_t idx = 1; idx < subs.size(); idx += 2) {
+            subs[idx].resume();
+        }
+        receiver.first = 0;
+        pub.publish(2);
+        CHECK(test_util::waitUntil([&] {return receiver.first >= 200;}));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testStaleHandle();
+    testPauseResume();
+    return test_util::result("test_subscribe_handle");
+}
@@ -0,0 +1,165 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <future>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+std::atomic<int> serialize_count { 0 };
+
+/**
+ * シリアライズした回数を数えるシリアライザ
+ */
+class CountingSerializer {
+public:
+    template<class DataType>
+    std::string serialize(DataType &data) {
+        serialize_count++;
+        return std::to_string(data);
+    }
+
+    template<class DataType>
+    DataType deserialize(const std::string &msg) {
+        return static_cast<DataType>(std::stoi(msg));
+    }
+};
+
+class Bridge {
+public:
+    void onMessage(const std::string &topic, const std::string &msg) {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            received[topic].push_back(msg);
+        }
+        if (topic == "/gate" && !gate_opened.exchange(true)) {
+            gate_entered = true;
+            gate.wait();
+        }
+    }
+
+    std::map<std::string, std::vector<std::string>> messages() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return received;
+    }
+
+    size_t count() {
+        std::lock_guard<std::mutex> lk(mtx);
+        size_t total = 0;
+        for (auto &topic : received) {
+            total += topic.second.size();
+        }
+        return total;
+    }
+
+    std::shared_future<void> gate; //!< 最初の/gateのメッセージで、これが設定されるまで待つ
+    std::atomic<bool> gate_entered { false };
+
+private:
+    std::mutex mtx;
+    std::atomic<bool> gate_opened { false };
+    std::map<std::string, std::vector<std::string>> received;
+};
+
+/**
+ * 受け取るタップのないトピックのメッセージは、シリアライズされない
+ */
+void testFilteredTopicsNotSerialized() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::extra_api::setSerializer<int, CountingSerializer>("/fleet/pose", &broker);
+    pubsub::extra_api::setSerializer<int, CountingSerializer>("/local/debug", &broker);
+    Bridge bridge;
+    {
+        pubsub::Publisher<int> fleet_pub("/fleet/pose", pubsub::GLOBAL, &broker);
+        pubsub::Publisher<int> debug_pub("/local/debug", pubsub::GLOBAL, &broker);
+        auto tap = pubsub::extra_api::subscribe_serialized(&Bridge::onMessage, &bridge, [](const std::string &topic) {return topic.compare(0, 7, "/fleet/") == 0;}, 0, pubsub::NO_EXCEPT, &broker);
+
+        serialize_count = 0;
+        for (int idx = 0; idx < 100; ++idx) {
+            debug_pub.publish(idx);
+        }
+        for (int idx = 0; idx < 5; ++idx) {
+            fleet_pub.publish(idx);
+        }
+        CHECK(test_util::waitUntil([&] {return bridge.count() == 5;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(bridge.count() == 5);
+        CHECK(serialize_count == 5);
+        CHECK(bridge.messages()["/fleet/pose"] == std::vector<std::string>({ "0", "1", "2", "3", "4" }));
+    }
+    broker.stop();
+}
+
+/**
+ * 未送信のメッセージの最大数はトピックごとに数えるので、多くのトピックに出版されても、各トピックの最新のメッセージが残る
+ */
+void testPerTopicKeepLatest() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Bridge bridge;
+    std::promise<void> release;
+    bridge.gate = release.get_future().share();
+    {
+        std::vector<pubsub::Publisher<std::string>> pubs;
+        for (int topic = 0; topic < 12; ++topic) {
+            pubs.emplace_back("/topic" + std::to_string(topic), pubsub::GLOBAL, &broker);
+        }
+        pubsub::Publisher<std::string> gate_pub("/gate", pubsub::GLOBAL, &broker);
+        auto tap = pubsub::extra_api::subscribe_serialized(&Bridge::onMessage, &bridge, 2, pubsub::NO_EXCEPT, &broker);
+
+        gate_pub.publish("open");
+        CHECK(test_util::waitUntil([&] {return bridge.gate_entered.load();}));
+        for (int value = 0; value < 5; ++value) { //タップのコールバック関数が止まっている間に溜まる
+            for (auto &pub : pubs) {
+                pub.publish(std::to_string(value));
+            }
+        }
+        release.set_value();
+
+        CHECK(test_util::waitUntil([&] {return bridge.count() == 1 + 12 * 2;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        auto messages = bridge.messages();
+        CHECK(messages.size() == 13);
+        for (int topic = 0; topic < 12; ++topic) {
+            CHECK(messages["/topic" + std::to_string(topic)] == std::vector<std::string>({ "3", "4" }));
+        }
+    }
+    broker.stop();
+}
+
+/**
+ * except_senderの送信者が出版したメッセージは、そのタップにだけ送らない
+ */
+void testExceptSender() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    Bridge self_bridge;
+    Bridge other_bridge;
+    {
+        pubsub::Publisher<std::string> pub("/chat", pubsub::GLOBAL, &broker);
+        auto self_tap = pubsub::extra_api::subscribe_serialized(&Bridge::onMessage, &self_bridge, 0, 7, &broker);
+        auto other_tap = pubsub::extra_api::subscribe_serialized(&Bridge::onMessage, &other_bridge, 0, 8, &broker);
+
+        pubsub::extra_api::publish_serialized("/chat", "from 7", 7, pubsub::GLOBAL, &broker);
+        pub.publish("local");
+        CHECK(test_util::waitUntil([&] {return other_bridge.count() == 2 && self_bridge.count() == 1;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(self_bridge.messages()["/chat"] == std::vector<std::string>({ "local" }));
+        CHECK(other_bridge.messages()["/chat"] == std::vector<std::string>({ "from 7", "local" }));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testFilteredTopicsNotSerialized();
+    testPerTopicKeepLatest();
+    testExceptSender();
+    return test_util::result("test_tap");
+}
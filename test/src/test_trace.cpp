@@ -0,0 +1,148 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <atomic>
+#include <set>
+#include <thread>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Receiver {
+public:
+    void onData(const int&) {
+        count++;
+    }
+
+    std::atomic<int> count { 0 };
+};
+
+size_t countOf(const std::string &str, const std::string &pattern) {
+    size_t count = 0;
+    for (size_t pos = str.find(pattern); pos != std::string::npos; pos = str.find(pattern, pos + pattern.size())) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * 出版からコールバック関数の終了までが、Chrome trace形式で出力される
+ */
+void testChromeTrace() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::Tracer::clear();
+    pubsub::Tracer::enable();
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/traced", &Receiver::onData, &receiver, 0, &broker);
+        pubsub::Publisher<int> pub("/traced", pubsub::GLOBAL, &broker);
+        for (int idx = 0; idx < 3; ++idx) {
+            pub.publish(idx);
+        }
+        CHECK(test_util::waitUntil([&] {return receiver.count == 3;}));
+        std::string json;
+        CHECK(test_util::waitUntil([&] { //コールバック関数の終了は、関数が戻った後に記録される
+            std::ostringstream oss;
+            pubsub::Tracer::dumpChromeTrace(oss);
+            json = oss.str();
+            return countOf(json, "\"name\":\"callback /traced\"") == 3 && countOf(json, "\"ph\":\"B\"") == countOf(json, "\"ph\":\"E\"");
+        }));
+
+        CHECK(json.compare(0, 17, "{\"displayTimeUnit") == 0);
+        CHECK(countOf(json, "\"name\":\"publish /traced\"") == 3);
+        CHECK(countOf(json, "\"name\":\"dispatch /traced\"") == 3);
+        CHECK(countOf(json, "\"ph\":\"s\"") == 3); //メッセージごとのフロー
+        CHECK(countOf(json, "\"ph\":\"f\"") == 3);
+    }
+    pubsub::Tracer::disable();
+    broker.stop();
+}
+
+/**
+ * バッファが一周して区間の開始が上書きされても、終了だけが出力されることはない
+ */
+void testWrappedBuffer() {
+    pubsub::Tracer::clear();
+    pubsub::Tracer::enable(5); //これから生成されるバッファに適用されるので、新しいスレッドで記録する
+    uint32_t topic_id = pubsub::Tracer::topicId("/wrapped");
+    std::thread thread([&] {
+        for (uint64_t seq = 1; seq <= 4; ++seq) {
+            pubsub::Tracer::record(pubsub::Tracer::PUBLISH, topic_id, seq);
+            pubsub::Tracer::record(pubsub::Tracer::ENQUEUE, topic_id, seq);
+        }
+    });
+    thread.join();
+    pubsub::Tracer::enable(); //容量を既定に戻す
+    pubsub::Tracer::disable();
+
+    std::ostringstream oss;
+    pubsub::Tracer::dumpChromeTrace(oss);
+    std::string json = oss.str();
+    CHECK(countOf(json, "\"ph\":\"B\"") == 2); //残った5件のうち、先頭は開始が上書きされた終了
+    CHECK(countOf(json, "\"ph\":\"E\"") == 2);
+    CHECK(json.find("\"ph\":\"E\"") > json.find("\"ph\":\"B\""));
+}
+
+/**
+ * 同じ名前のトピックを作り直しても、フローの識別子は重ならない
+ */
+void testRecreatedTopic() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::Tracer::clear();
+    pubsub::Tracer::enable();
+    for (int round = 0; round < 2; ++round) {
+        Receiver receiver;
+        auto sub = pubsub::api::subscribe("/recreated", &Receiver::onData, &receiver, 0, &broker);
+        pubsub::Publisher<int> pub("/recreated", pubsub::GLOBAL, &broker);
+        pub.publish(round);
+        CHECK(test_util::waitUntil([&] {return receiver.count == 1;}));
+    }
+    pubsub::Tracer::disable();
+
+    std::ostringstream oss;
+    pubsub::Tracer::dumpChromeTrace(oss);
+    std::string json = oss.str();
+    const std::string pattern = "\"ph\":\"s\",\"id\":\"";
+    std::set<std::string> ids;
+    for (size_t pos = json.find(pattern); pos != std::string::npos; pos = json.find(pattern, pos + 1)) {
+        size_t begin = pos + pattern.size();
+        ids.insert(json.substr(begin, json.find('"', begin) - begin));
+    }
+    CHECK(countOf(json, pattern) == 2);
+    CHECK(ids.size() == 2);
+    CHECK(countOf(json, "\"name\":\"publish /recreated\"") == 2);
+    broker.stop();
+}
+
+/**
+ * 無効にした後は記録されない
+ */
+void testDisabled() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    pubsub::Tracer::clear();
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/untraced", &Receiver::onData, &receiver, 0, &broker);
+        pubsub::Publisher<int> pub("/untraced", pubsub::GLOBAL, &broker);
+        pub.publish(1);
+        CHECK(test_util::waitUntil([&] {return receiver.count == 1;}));
+    }
+    std::ostringstream oss;
+    pubsub::Tracer::dumpChromeTrace(oss);
+    CHECK(oss.str().find("/untraced") == std::string::npos);
+    broker.stop();
+}
+}
+
+int main() {
+    testChromeTrace();
+    testWrappedBuffer();
+    testRecreatedTopic();
+    testDisabled();
+    return test_util::result("test_trace");
+}
@@ -0,0 +1,113 @@
+#include <iostream>
+#include <vector>
+#include <mutex>
+
+#include "pubsub.hpp"
+#include "test_util.hpp"
+
+namespace {
+
+class Receiver {
+public:
+    void onData(const int &data) {
+        std::lock_guard<std::mutex> lk(mtx);
+        values.push_back(data);
+    }
+
+    std::vector<int> received() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return values;
+    }
+
+private:
+    std::mutex mtx;
+    std::vector<int> values;
+};
+
+/**
+ * 有効期間が過ぎたメッセージは、コールバック関数を呼ばずに読み飛ばす
+ */
+void testTopicTimeToLive() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    pubsub::extra_api::setThreadPool("/ttl", &pool, &broker);
+    pubsub::extra_api::setTimeToLive("/ttl", std::chrono::milliseconds(50), &broker);
+    Receiver receiver;
+    {
+        auto sub = pubsub::api::subscribe("/ttl", &Receiver::onData, &receiver, 0, &broker);
+        pubsub::Publisher<int> pub("/ttl", pubsub::GLOBAL, &broker);
+        {
+            test_util::PoolBlocker blocker(&pool);
+            for (int idx = 0; idx < 5; ++idx) {
+                pub.publish(idx);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100)); //先頭以外は、受信キューで期限切れになる
+        }
+        pub.publish(100);
+        CHECK(test_util::waitUntil([&] {return !receiver.received().empty() && receiver.received().back() == 100;}));
+        auto values = receiver.received();
+        CHECK(values.size() == 2); //スレッドプールに投入済みだった先頭のメッセージと、新しいメッセージ
+        CHECK(values.front() == 0);
+    }
+    broker.stop();
+}
+
+/**
+ * 購読ごとの有効期間は、その購読だけに適用される
+ */
+void testSubscriptionTimeToLive() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    QThreadPool pool;
+    pool.setMaxThreadCount(1);
+    pubsub::extra_api::setThreadPool("/sub_ttl", &pool, &broker);
+    Receiver strict;
+    Receiver relaxed;
+    {
+        auto strict_sub = pubsub::api::subscribe("/sub_ttl", &Receiver::onData, &strict, 0, &broker);
+        strict_sub.setTimeToLive(std::chrono::milliseconds(30));
+        auto relaxed_sub = pubsub::api::subscribe("/sub_ttl", &Receiver::onData, &relaxed, 0, &broker);
+        pubsub::Publisher<int> pub("/sub_ttl", pubsub::GLOBAL, &broker);
+        {
+            test_util::PoolBlocker blocker(&pool);
+            for (int idx = 0; idx < 4; ++idx) {
+                pub.publish(idx);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(80));
+        }
+        CHECK(test_util::waitUntil([&] {return relaxed.received().size() == 4;}));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        CHECK(strict.received().size() == 1);
+    }
+    broker.stop();
+}
+
+/**
+ * 最新のメッセージと一緒に、出版からの経過時間を取得できる
+ */
+void testLatestAge() {
+    pubsub::BrokerCore broker;
+    broker.run();
+    {
+        pubsub::Publisher<int> pub("/age", pubsub::GLOBAL, &broker);
+        pub.publish(7);
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        int data = 0;
+        std::chrono::nanoseconds age { 0 };
+        CHECK(pubsub::api::getLatestData("/age", data, age, &broker));
+        CHECK(data == 7);
+        CHECK(age >= std::chrono::milliseconds(30));
+        CHECK(age < std::chrono::seconds(5));
+    }
+    broker.stop();
+}
+}
+
+int main() {
+    testTopicTimeToLive();
+    testSubscriptionTimeToLive();
+    testLatestAge();
+    return test_util::result("test_ttl");
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <iostream>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+
+/**
+ * テストで使う簡単な検査
+ *
+ * CHECKが失敗しても続けて実行し、最後にtest_util::result()で終了コードを返す。
+ */
+namespace test_util {
+
+inline int& failures() {
+    static int count = 0;
+    return count;
+}
+
+inline bool check(bool ok, const char *expr, const char *file, int line) {
+    if (!ok) {
+        std::cerr << file << ":" << line << ": CHECK failed: " << expr << std::endl;
+        failures()++;
+    }
+    return ok;
+}
+
+/**
+ * predがtrueを返すまで待つ
+ *
+ * \return timeoutまでにtrueにならなかった場合はfalse
+ */
+inline bool waitUntil(const std::function<bool()> &pred, std::chrono::milliseconds timeout = std::chrono::milliseconds(5000)) {
+    auto until = std::chrono::steady_clock::now() + timeout;
+    while (!pred()) {
+        if (std::chrono::steady_clock::now() >= until) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+/**
+ * スレッドプールのスレッドを一つ、release()まで占有する。スレッドが一つのプールでは、その間に投入されたタスクは待ち行列に並ぶ。
+ */
+class PoolBlocker {
+public:
+    explicit PoolBlocker(QThreadPool *pool) {
+        auto gate = promise.get_future().share();
+        auto *running = &started;
+        QtConcurrent::run(pool, [gate, running]() {
+            running->store(true);
+            gate.wait();
+        });
+        waitUntil([&] {return started.load();});
+    }
+
+    ~PoolBlocker() {
+        release();
+    }
+
+    void release() {
+        if (!released) {
+            released = true;
+            promise.set_value();
+        }
+    }
+
+private:
+    std::promise<void> promise;
+    std::atomic<bool> started { false };
+    bool released = false;
+};
+
+/**
+ * 結果を表示し、終了コードを返す
+ */
+inline int result(const char *name) {
+    if (failures() == 0) {
+        std::cout << name << ": OK" << std::endl;
+        return 0;
+    }
+    std::cout << name << ": " << failures() << " check(s) failed" << std::endl;
+    return 1;
+}
+}
+
+#define CHECK(...) test_util::check((__VA_ARGS__), #__VA_ARGS__, __FILE__, __LINE__)